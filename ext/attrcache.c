@@ -0,0 +1,299 @@
+// Attributes getattr answered with, by path, for Fuse#attr_cache=. Lookups
+// happen before the GVL is taken, from any of the loop threads, so the
+// cache has its own lock and nothing in here touches ruby.
+//
+// Entries expire after their ttl. The least recently used one goes when
+// the cache is full. Anything changing a path drops its entry (and its
+// parent's, whose mtime changed too), see rf_attr_changed.
+//
+// Fuse#negative_cache= is another one, of paths getattr said ENOENT for:
+// its entries have no attributes.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "attrcache.h"
+
+#define ATTRCACHE_BUCKETS 4096 //a power of two
+#define ATTRCACHE_MAX 16384
+
+struct attrcache_entry {
+  struct attrcache_entry *chain; //same bucket
+  struct attrcache_entry *prev;  //lru, most recent first
+  struct attrcache_entry *next;
+  uint64_t hash;
+  int64_t  expires; //CLOCK_MONOTONIC, ns
+  struct stat st;
+  size_t len;
+  char path[];
+};
+
+static int64_t attrcache_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//FNV-1a
+static uint64_t attrcache_hash(const char *path, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) path[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+struct attrcache *attrcache_new()
+{
+  struct attrcache *ac = malloc(sizeof(struct attrcache));
+  memset(ac, 0, sizeof(struct attrcache));
+  ac->buckets = calloc(ATTRCACHE_BUCKETS, sizeof(struct attrcache_entry *));
+  ac->max = ATTRCACHE_MAX;
+  pthread_mutex_init(&ac->lock, NULL);
+  return ac;
+}
+
+static void attrcache_unlink(struct attrcache *ac, struct attrcache_entry *e)
+{
+  struct attrcache_entry **p = &ac->buckets[e->hash & (ATTRCACHE_BUCKETS - 1)];
+  while (*p != e) {
+    p = &(*p)->chain;
+  }
+  *p = e->chain;
+
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    ac->head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    ac->tail = e->prev;
+  }
+  ac->count--;
+  free(e);
+}
+
+static void attrcache_clear_locked(struct attrcache *ac)
+{
+  while (ac->head != NULL) {
+    attrcache_unlink(ac, ac->head);
+  }
+}
+
+void attrcache_free(struct attrcache *ac)
+{
+  attrcache_clear_locked(ac);
+  pthread_mutex_destroy(&ac->lock);
+  free(ac->buckets);
+  free(ac);
+}
+
+// ttl in seconds, 0 turns the cache off and empties it
+void attrcache_set_ttl(struct attrcache *ac, double ttl)
+{
+  pthread_mutex_lock(&ac->lock);
+  ac->ttl = ttl > 0 ? (int64_t) (ttl * 1e9) : 0;
+  ac->generation++;
+  if (ac->ttl == 0) {
+    attrcache_clear_locked(ac);
+  }
+  pthread_mutex_unlock(&ac->lock);
+}
+
+double attrcache_ttl(struct attrcache *ac)
+{
+  return ac->ttl / 1e9;
+}
+
+// At least one entry, the least recently used go if there are more
+void attrcache_set_max(struct attrcache *ac, size_t max)
+{
+  pthread_mutex_lock(&ac->lock);
+  ac->max = max > 0 ? max : 1;
+  while (ac->count > ac->max) {
+    attrcache_unlink(ac, ac->tail);
+  }
+  pthread_mutex_unlock(&ac->lock);
+}
+
+static struct attrcache_entry *attrcache_find(struct attrcache *ac,
+  const char *path, size_t len, uint64_t hash)
+{
+  struct attrcache_entry *e = ac->buckets[hash & (ATTRCACHE_BUCKETS - 1)];
+  for (; e != NULL; e = e->chain) {
+    if (e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+// 1 and the attributes (if st isn't NULL) if path is cached and hasn't
+// expired
+int attrcache_get(struct attrcache *ac, const char *path, struct stat *st)
+{
+  size_t len = strlen(path);
+  uint64_t hash = attrcache_hash(path, len);
+  struct attrcache_entry *e;
+  int found = 0;
+
+  if (ac->ttl == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&ac->lock);
+  e = attrcache_find(ac, path, len, hash);
+  if (e != NULL && e->expires <= attrcache_now()) {
+    attrcache_unlink(ac, e);
+    e = NULL;
+  }
+  if (e != NULL) {
+    if (st != NULL)
+      *st = e->st;
+    found = 1;
+    if (e->prev != NULL) {
+      //to the front of the lru
+      e->prev->next = e->next;
+      if (e->next != NULL)
+        e->next->prev = e->prev;
+      else
+        ac->tail = e->prev;
+      e->prev = NULL;
+      e->next = ac->head;
+      ac->head->prev = e;
+      ac->head = e;
+    }
+  }
+  if (found)
+    ac->hits++;
+  else
+    ac->misses++;
+  pthread_mutex_unlock(&ac->lock);
+  return found;
+}
+
+// Taken before asking the handler: if anything was invalidated since,
+// attrcache_put drops the answer, it may predate the change
+uint64_t attrcache_generation(struct attrcache *ac)
+{
+  uint64_t gen;
+  pthread_mutex_lock(&ac->lock);
+  gen = ac->generation;
+  pthread_mutex_unlock(&ac->lock);
+  return gen;
+}
+
+// ttl < 0 is the cache's own, 0 doesn't cache. st may be NULL.
+void attrcache_put(struct attrcache *ac, const char *path,
+  const struct stat *st, double ttl, uint64_t generation)
+{
+  size_t len = strlen(path);
+  uint64_t hash = attrcache_hash(path, len);
+  struct attrcache_entry *e;
+  int64_t ns;
+
+  pthread_mutex_lock(&ac->lock);
+  ns = ttl < 0 ? ac->ttl : (int64_t) (ttl * 1e9);
+  if (ac->ttl == 0 || ns <= 0 || generation != ac->generation) {
+    pthread_mutex_unlock(&ac->lock);
+    return;
+  }
+
+  e = attrcache_find(ac, path, len, hash);
+  if (e != NULL) {
+    attrcache_unlink(ac, e);
+  }
+  while (ac->count >= ac->max && ac->tail != NULL) {
+    attrcache_unlink(ac, ac->tail);
+  }
+
+  e = malloc(sizeof(struct attrcache_entry) + len + 1);
+  memcpy(e->path, path, len + 1);
+  e->len     = len;
+  e->hash    = hash;
+  if (st != NULL)
+    e->st    = *st;
+  else
+    memset(&e->st, 0, sizeof(struct stat));
+  e->expires = attrcache_now() + ns;
+
+  e->chain = ac->buckets[hash & (ATTRCACHE_BUCKETS - 1)];
+  ac->buckets[hash & (ATTRCACHE_BUCKETS - 1)] = e;
+  e->prev = NULL;
+  e->next = ac->head;
+  if (ac->head != NULL)
+    ac->head->prev = e;
+  else
+    ac->tail = e;
+  ac->head = e;
+  ac->count++;
+  pthread_mutex_unlock(&ac->lock);
+}
+
+// Drops path, and with tree everything below it. NULL drops everything.
+void attrcache_invalidate(struct attrcache *ac, const char *path, int tree)
+{
+  struct attrcache_entry *e, *next;
+  size_t len;
+
+  pthread_mutex_lock(&ac->lock);
+  ac->generation++;
+  if (path == NULL || (tree && strcmp(path, "/") == 0)) {
+    attrcache_clear_locked(ac);
+  } else if (!tree) {
+    len = strlen(path);
+    e = attrcache_find(ac, path, len, attrcache_hash(path, len));
+    if (e != NULL)
+      attrcache_unlink(ac, e);
+  } else {
+    len = strlen(path);
+    for (e = ac->head; e != NULL; e = next) {
+      next = e->next;
+      if (e->len >= len && memcmp(e->path, path, len) == 0 &&
+          (e->len == len || e->path[len] == '/'))
+        attrcache_unlink(ac, e);
+    }
+  }
+  pthread_mutex_unlock(&ac->lock);
+}
+
+// The directory path is in: its mtime (and nlink) change with its entries
+void attrcache_invalidate_parent(struct attrcache *ac, const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  char parent[ATTRCACHE_PATH_MAX];
+  size_t len;
+
+  if (slash == NULL) {
+    return;
+  }
+  len = slash == path ? 1 : (size_t) (slash - path);
+  if (len >= sizeof(parent)) {
+    attrcache_invalidate(ac, NULL, 1);
+    return;
+  }
+  memcpy(parent, path, len);
+  parent[len] = '\0';
+  attrcache_invalidate(ac, parent, 0);
+}
+
+// Lookups answered and not since the cache was created, and its size
+void attrcache_stats(struct attrcache *ac, uint64_t *hits, uint64_t *misses,
+  size_t *count)
+{
+  pthread_mutex_lock(&ac->lock);
+  *hits   = ac->hits;
+  *misses = ac->misses;
+  *count  = ac->count;
+  pthread_mutex_unlock(&ac->lock);
+}
+
+size_t attrcache_count(struct attrcache *ac)
+{
+  return ac->count;
+}
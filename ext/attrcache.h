@@ -0,0 +1,42 @@
+#ifndef _ATTRCACHE_H
+#define _ATTRCACHE_H
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define ATTRCACHE_PATH_MAX PATH_MAX
+
+struct attrcache_entry;
+
+struct attrcache {
+  pthread_mutex_t lock;
+  struct attrcache_entry **buckets;
+  struct attrcache_entry *head; //lru list
+  struct attrcache_entry *tail;
+  size_t count;
+  size_t max;
+  int64_t ttl;         //ns, 0: off
+  uint64_t generation; //bumped by every invalidation
+  uint64_t hits;       //attrcache_get answered
+  uint64_t misses;     //and didn't, while turned on
+};
+
+struct attrcache *attrcache_new();
+void attrcache_free(struct attrcache *ac);
+void attrcache_set_ttl(struct attrcache *ac, double ttl);
+double attrcache_ttl(struct attrcache *ac);
+void attrcache_set_max(struct attrcache *ac, size_t max);
+int attrcache_get(struct attrcache *ac, const char *path, struct stat *st);
+uint64_t attrcache_generation(struct attrcache *ac);
+void attrcache_put(struct attrcache *ac, const char *path,
+  const struct stat *st, double ttl, uint64_t generation);
+void attrcache_invalidate(struct attrcache *ac, const char *path, int tree);
+void attrcache_invalidate_parent(struct attrcache *ac, const char *path);
+void attrcache_stats(struct attrcache *ac, uint64_t *hits, uint64_t *misses,
+  size_t *count);
+size_t attrcache_count(struct attrcache *ac);
+
+#endif
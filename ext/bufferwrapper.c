@@ -4,6 +4,8 @@
 
 #include "bufferwrapper.h"
 
+static VALUE cBufferWrapper;
+
 VALUE bufferwrapper_new(VALUE class)
 {
   rb_raise(rb_eNotImpError, "new() not implemented (it has no use), and should not be called");
@@ -26,18 +28,13 @@ VALUE bufferwrapper_getdata(VALUE self, VALUE size)
 
 VALUE wrap_buffer(void *buf)
 {
-  VALUE rRFuse;
-  VALUE rBufferWrapper;
-
-  rRFuse         = rb_const_get(rb_cObject,rb_intern("RFuse"));
-  rBufferWrapper = rb_const_get(rRFuse,rb_intern("BufferWrapper"));
-
-  return Data_Wrap_Struct(rBufferWrapper, NULL, NULL, buf);
+  return Data_Wrap_Struct(cBufferWrapper, NULL, NULL, buf);
 }
 
 VALUE bufferwrapper_init(VALUE module)
 {
-  VALUE cBufferWrapper = rb_define_class_under(module,"BufferWrapper",rb_cObject);
+  cBufferWrapper = rb_define_class_under(module,"BufferWrapper",rb_cObject);
+  rb_global_variable(&cBufferWrapper);
 
   rb_define_alloc_func(cBufferWrapper,bufferwrapper_new);
 
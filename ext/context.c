@@ -1,12 +1,40 @@
 #include "context.h"
 #include <fuse.h>
 
+static VALUE cContext;
+
+struct context {
+  struct fuse_context ctx;
+  int valid; //0: a reused Context between calls, see context_point
+};
+
+// A copy: fuse_get_context() is per thread and gets reused by the next
+// request, which may run before a handler holding on to its Context is done
+// (see Fuse#loop_fiber). NULL makes one to be pointed at calls later.
 VALUE wrap_context (struct fuse_context *fctx) {
-  VALUE rRFuse;
-  VALUE rContext;
-  rRFuse=rb_const_get(rb_cObject,rb_intern("RFuse"));
-  rContext=rb_const_get(rRFuse,rb_intern("Context"));
-  return Data_Wrap_Struct(rContext,0,0,fctx); //shouldn't be freed!
+  VALUE self = context_new(cContext);
+  context_point(self, fctx);
+  return self;
+}
+
+// Copies fctx into a Context made by wrap_context, for Fuse#reuse_objects;
+// NULL when the call is over
+void context_point(VALUE self, struct fuse_context *fctx) {
+  struct context *c;
+  Data_Get_Struct(self,struct context,c);
+  if (fctx != NULL) {
+    c->ctx = *fctx;
+  }
+  c->valid = fctx != NULL;
+}
+
+static struct fuse_context *context_of(VALUE self) {
+  struct context *c;
+  Data_Get_Struct(self,struct context,c);
+  if (!c->valid) {
+    rb_raise(rb_eRuntimeError,"context used after its callback returned");
+  }
+  return &c->ctx;
 }
 
 VALUE context_initialize(VALUE self){
@@ -15,29 +43,25 @@ VALUE context_initialize(VALUE self){
 
 VALUE context_new(VALUE class){
   VALUE self;
-  struct fuse_context *ctx;
-  self = Data_Make_Struct(class, struct fuse_context, 0,free,ctx);
+  struct context *c;
+  self = Data_Make_Struct(class, struct context, 0,free,c);
+  c->valid = 1;
   return self;
 }
 
 VALUE context_uid(VALUE self){
-  struct fuse_context *ctx;
-  Data_Get_Struct(self,struct fuse_context,ctx);
-  return INT2FIX(ctx->uid);
+  return INT2FIX(context_of(self)->uid);
 }
 VALUE context_gid(VALUE self){
-  struct fuse_context *ctx;
-  Data_Get_Struct(self,struct fuse_context,ctx);
-  return INT2FIX(ctx->gid);
+  return INT2FIX(context_of(self)->gid);
 }
 VALUE context_pid(VALUE self){
-  struct fuse_context *ctx;
-  Data_Get_Struct(self,struct fuse_context,ctx);
-  return INT2FIX(ctx->pid);
+  return INT2FIX(context_of(self)->pid);
 }
 
 VALUE context_init(VALUE module) {
-  VALUE cContext=rb_define_class_under(module,"Context",rb_cObject);
+  cContext=rb_define_class_under(module,"Context",rb_cObject);
+  rb_global_variable(&cContext);
   rb_define_alloc_func(cContext,context_new);
   rb_define_method(cContext,"initialize",context_initialize,0);
   rb_define_method(cContext,"uid",context_uid,0);
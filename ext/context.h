@@ -2,4 +2,6 @@
 #include <ruby.h>
 
 VALUE wrap_context ();
+void context_point(VALUE self, struct fuse_context *fctx);
+VALUE context_new(VALUE class);
 VALUE context_init(VALUE module);
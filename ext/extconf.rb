@@ -2,9 +2,16 @@ require 'mkmf'
 
 $CFLAGS << ' -Wall'
 $CFLAGS << ' -D_FILE_OFFSET_BITS=64'
-$CFLAGS << ' -DFUSE_USE_VERSION=26'
 
-unless have_library('fuse') || have_library("fuse4x")
+# libfuse 3 unless told otherwise (--with-fuse2), libfuse 2 or fuse4x if
+# that's all there is
+if !with_config('fuse2') && pkg_config('fuse3')
+  $CFLAGS << ' -DFUSE_USE_VERSION=31 -DRFUSE_FUSE3'
+  have_func('fuse_invalidate_path', 'fuse.h')
+  have_struct_member('struct fuse_file_info', 'backing_id', 'fuse.h')
+elsif have_library('fuse') || have_library("fuse4x")
+  $CFLAGS << ' -DFUSE_USE_VERSION=26'
+else
   puts "No FUSE install available"
   exit
 end
@@ -12,5 +19,14 @@ end
 have_header('sys/statvfs.h')
 have_header('sys/statfs.h')
 have_header('linux/stat.h')
+have_header('linux/fuse.h')
+have_struct_member('struct stat', 'st_atim', 'sys/stat.h')
+have_header('sys/epoll.h')
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_interned_str', 'ruby.h')
+have_header('ruby/fiber/scheduler.h')
+have_header('ruby/io/buffer.h')
+have_func('rb_io_buffer_get_bytes_for_reading', 'ruby/io/buffer.h')
 
 create_makefile('rfuse_ng')
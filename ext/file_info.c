@@ -1,26 +1,81 @@
 #include "file_info.h"
+#include "passthrough.h"
 #include <fuse.h>
+#include <unistd.h>
+#include <fcntl.h>
 
+static VALUE cFileInfo;
+static ID id_fileno;
 
-static void file_info_mark(struct fuse_file_info *ffi) {
-  if (TYPE(ffi->fh) != T_NONE) {
-     rb_gc_mark((VALUE) ffi->fh);
-  } 
+// RFuse::Fuse keeps fh on an open_file (handles set), LowLevel hands fh to
+// the kernel as it is and works on copies, where it is an Integer
+struct file_info {
+  struct fuse_file_info *ffi;
+  int handles;
+  int backing_fd; //copies: passthrough= for reply_open, -1 if none
+  struct fuse_file_info copy;
+};
+
+static void file_info_free(struct file_info *fi) {
+  if (fi->backing_fd >= 0) {
+    close(fi->backing_fd);
+  }
+  free(fi);
 }
 
-//creates a FileInfo object from an already allocated ffi
+//creates a FileInfo object from an already allocated ffi, whose fh is a
+//open_file or 0; the mount marks the handles. NULL makes one to be pointed
+//at calls later, see file_info_point.
 VALUE wrap_file_info(struct fuse_file_info *ffi) {
-  VALUE rRFuse;
-  VALUE rFileInfo;
-  rRFuse=rb_const_get(rb_cObject,rb_intern("RFuse"));
-  rFileInfo=rb_const_get(rRFuse,rb_intern("FileInfo"));
-  //TODO GG: we need a mark function here to ensure the ffi-fh value is not GC'd
-  //between open and release
-  return Data_Wrap_Struct(rFileInfo,file_info_mark,0,ffi); //shouldn't be freed!
-
+  struct file_info *fi;
+  VALUE self = Data_Make_Struct(cFileInfo,struct file_info,0,free,fi);
+  fi->ffi     = ffi;
+  fi->handles = 1;
+  fi->backing_fd = -1;
+  return self;
 };
 
 
+//re-points a FileInfo made by wrap_file_info at the next call's ffi, for
+//Fuse#reuse_objects; NULL when the call is over
+void file_info_point(VALUE self, struct fuse_file_info *ffi) {
+  struct file_info *fi;
+  Data_Get_Struct(self,struct file_info,fi);
+  fi->ffi = ffi;
+}
+
+//a copy that outlives the callback, for requests replied to later (LowLevel)
+VALUE file_info_copy(const struct fuse_file_info *ffi) {
+  struct file_info *fi;
+  VALUE self = Data_Make_Struct(cFileInfo,struct file_info,
+    0,file_info_free,fi);
+  fi->copy    = *ffi;
+  fi->ffi     = &fi->copy;
+  fi->handles = 0;
+  fi->backing_fd = -1;
+  return self;
+}
+
+static struct file_info *file_info_of(VALUE self) {
+  struct file_info *fi;
+  Data_Get_Struct(self,struct file_info,fi);
+  if (fi->ffi == NULL) {
+    rb_raise(rb_eRuntimeError,"no file info for this call");
+  }
+  return fi;
+}
+
+struct fuse_file_info *file_info_get(VALUE self) {
+  if (!rb_obj_is_kind_of(self,cFileInfo)) {
+    rb_raise(rb_eTypeError,"expected an RFuse::FileInfo");
+  }
+  return file_info_of(self)->ffi;
+}
+
+struct open_file *open_file_of(const struct fuse_file_info *ffi) {
+  return ffi == NULL ? NULL : (struct open_file *) (uintptr_t) ffi->fh;
+}
+
 VALUE file_info_initialize(VALUE self){
   return self;
 }
@@ -34,42 +89,135 @@ VALUE file_info_new(VALUE class){
 }
 
 VALUE file_info_writepage(VALUE self) {
-  struct fuse_file_info *f;
-  Data_Get_Struct(self,struct fuse_file_info,f);
-  return INT2FIX(f->writepage);
+  return INT2FIX(file_info_of(self)->ffi->writepage);
 }
 
 VALUE file_info_flags(VALUE self) {
-  struct fuse_file_info *f;
-  Data_Get_Struct(self,struct fuse_file_info,f);
-  return INT2FIX(f->flags);
+  return INT2FIX(file_info_of(self)->ffi->flags);
 }
 
-//fh is possibly a pointer to a ruby object and can be set
+//fh is any object with RFuse::Fuse, which keeps it on the open_file. On
+//LowLevel copies it goes to the kernel and comes back with later requests,
+//long after this object is gone: it can only be an Integer.
 VALUE file_info_fh(VALUE self) {
-   struct fuse_file_info *f;
-   Data_Get_Struct(self,struct fuse_file_info,f);
-  if (TYPE(f->fh) != T_NONE) {
-    return (VALUE) f->fh;
-  } else {
-    return Qnil;
+  struct file_info *fi = file_info_of(self);
+  struct open_file *h;
+  if (fi->handles) {
+    h = open_file_of(fi->ffi);
+    return h == NULL ? Qnil : h->value;
   }
+  return ULL2NUM(fi->ffi->fh);
 }
 
 VALUE file_info_fh_assign(VALUE self,VALUE value) {
-   struct fuse_file_info *f;
-   Data_Get_Struct(self,struct fuse_file_info,f);
-   f->fh = value;
-   return value;
+  struct file_info *fi = file_info_of(self);
+  struct open_file *h;
+  if (fi->handles) {
+    h = open_file_of(fi->ffi);
+    if (h == NULL) {
+      rb_raise(rb_eRuntimeError,"fh can only be set on an opened file");
+    }
+    h->value = value;
+  } else {
+    fi->ffi->fh = NIL_P(value) ? 0 : NUM2ULL(value);
+  }
+  return value;
+}
+
+//a private duplicate of io (an IO or a file descriptor), -1 for nil
+static int file_info_dup(VALUE io) {
+  int orig, fd;
+  if (NIL_P(io)) {
+    return -1;
+  }
+  orig = FIXNUM_P(io) ? FIX2INT(io) : NUM2INT(rb_funcall(io,id_fileno,0));
+  fd = fcntl(orig,F_DUPFD_CLOEXEC,0);
+  if (fd < 0) {
+    rb_sys_fail("dup");
+  }
+  return fd;
+}
+
+//fd = io (or a file descriptor): serve read, write, flush, fsync and
+//fgetattr of this open file from that file, in C. The descriptor is
+//duplicated, the handler may close its own; ours is closed on release.
+//nil unbinds.
+VALUE file_info_fd_assign(VALUE self,VALUE io) {
+  struct file_info *fi = file_info_of(self);
+  struct open_file *h = fi->handles ? open_file_of(fi->ffi) : NULL;
+  int fd;
+
+  if (h == NULL) {
+    rb_raise(rb_eRuntimeError,"fd can only be bound to a file opened through RFuse::Fuse");
+  }
+  fd = file_info_dup(io);
+  if (h->fd >= 0) {
+    close(h->fd);
+  }
+  h->fd = fd;
+  h->passthrough = 0;
+  return io;
+}
+
+//passthrough = io, in open or create: have the kernel read and write io
+//itself (kernel passthrough, Linux 6.9 and libfuse 3.16). Where that isn't
+//available the file is served as after fd = io with RFuse::Fuse; LowLevel
+//handlers keep getting read and write, see passthrough?
+VALUE file_info_passthrough_assign(VALUE self,VALUE io) {
+  struct file_info *fi = file_info_of(self);
+  int fd;
+
+  if (fi->handles) {
+    file_info_fd_assign(self,io);
+    open_file_of(fi->ffi)->passthrough = !NIL_P(io);
+    return io;
+  }
+  fd = file_info_dup(io);
+  if (fi->backing_fd >= 0) {
+    close(fi->backing_fd);
+  }
+  fi->backing_fd = fd;
+  return io;
+}
+
+//whether the kernel serves reads and writes on this file itself
+VALUE file_info_passthrough_p(VALUE self) {
+#ifdef RFUSE_PASSTHROUGH
+  return file_info_of(self)->ffi->backing_id > 0 ? Qtrue : Qfalse;
+#else
+  file_info_of(self);
+  return Qfalse;
+#endif
+}
+
+//the descriptor passthrough= left for reply_open and reply_create, the
+//caller closes it
+int file_info_take_backing_fd(VALUE self) {
+  struct file_info *fi = file_info_of(self);
+  int fd = fi->backing_fd;
+  fi->backing_fd = -1;
+  return fd;
+}
+
+VALUE file_info_fd(VALUE self) {
+  struct file_info *fi = file_info_of(self);
+  struct open_file *h = fi->handles ? open_file_of(fi->ffi) : NULL;
+  return h == NULL || h->fd < 0 ? Qnil : INT2NUM(h->fd);
 }
 
 VALUE file_info_init(VALUE module) {
-  VALUE cFileInfo=rb_define_class_under(module,"FileInfo",rb_cObject);
+  id_fileno = rb_intern("fileno");
+  cFileInfo=rb_define_class_under(module,"FileInfo",rb_cObject);
+  rb_global_variable(&cFileInfo);
   rb_define_alloc_func(cFileInfo,file_info_new);
   rb_define_method(cFileInfo,"initialize",file_info_initialize,0);
   rb_define_method(cFileInfo,"flags",file_info_flags,0);
   rb_define_method(cFileInfo,"writepage",file_info_writepage,0);
   rb_define_method(cFileInfo,"fh",file_info_fh,0);
   rb_define_method(cFileInfo,"fh=",file_info_fh_assign,1);
+  rb_define_method(cFileInfo,"fd",file_info_fd,0);
+  rb_define_method(cFileInfo,"fd=",file_info_fd_assign,1);
+  rb_define_method(cFileInfo,"passthrough=",file_info_passthrough_assign,1);
+  rb_define_method(cFileInfo,"passthrough?",file_info_passthrough_p,0);
   return cFileInfo;
 }
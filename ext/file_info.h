@@ -1,7 +1,32 @@
+#ifndef _FILE_INFO_H
+#define _FILE_INFO_H
+
 #include <fuse.h>
 #include <ruby.h>
 
+struct readahead;
+struct writebehind;
+
+// What fh points to for RFuse::Fuse, from open (create, opendir) until
+// release: libfuse keeps only 64 bits per open file. The mount keeps the
+// handles on a list and marks them.
+struct open_file {
+  VALUE value; //FileInfo#fh
+  int   fd;    //FileInfo#fd=, -1 if not bound
+  int   passthrough; //FileInfo#passthrough=, fd is to be the backing file
+  int   backing_id;  //> 0 once the kernel took it, see rf_handle_backing
+  struct readahead *ra; //Fuse#readahead=, NULL until read
+  struct writebehind *wb; //Fuse#write_behind=, NULL until written
+  struct open_file *prev;
+  struct open_file *next;
+};
+
 VALUE wrap_file_info(struct fuse_file_info *ffi);
+void file_info_point(VALUE self, struct fuse_file_info *ffi);
+VALUE file_info_copy(const struct fuse_file_info *ffi);
+struct fuse_file_info *file_info_get(VALUE self);
+struct open_file *open_file_of(const struct fuse_file_info *ffi);
+int file_info_take_backing_fd(VALUE self);
 
 VALUE file_info_initialize(VALUE self);
 VALUE file_info_new(VALUE class);
@@ -9,3 +34,5 @@ VALUE file_info_flags(VALUE self);
 VALUE file_info_writepage(VALUE self);
 
 VALUE file_info_init(VALUE module);
+
+#endif
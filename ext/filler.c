@@ -2,6 +2,15 @@
 #include <fuse.h>
 #include "helper.h"
 
+static VALUE cFiller;
+
+//libfuse 3 fillers take readdir flags, we never ask for readdirplus
+#ifdef RFUSE_FUSE3
+#define RF_FILL(f,name,st,off) (f)->filler((f)->buffer,name,st,off,0)
+#else
+#define RF_FILL(f,name,st,off) (f)->filler((f)->buffer,name,st,off)
+#endif
+
 VALUE rfiller_initialize(VALUE self){
   return self;
 }
@@ -13,34 +22,63 @@ VALUE rfiller_new(VALUE class){
   return self;
 }
 
-VALUE rfiller_push(VALUE self, VALUE name, VALUE stat, VALUE offset) {
+//creates a Filler without going through Filler.new, the trampoline fills
+//in the callback by hand
+VALUE rfiller_instance_new() {
+  return rfiller_new(cFiller);
+}
+
+//a reused Filler (Fuse#reuse_objects) is cleared when readdir returns
+void rfiller_release(VALUE self) {
   struct filler_t *f;
   Data_Get_Struct(self,struct filler_t,f);
+  memset(f,0,sizeof(struct filler_t));
+}
+
+static struct filler_t *rfiller_of(VALUE self) {
+  struct filler_t *f;
+  Data_Get_Struct(self,struct filler_t,f);
+  if (f->filler == NULL
+#ifndef RFUSE_FUSE3
+      && f->df == NULL
+#endif
+     ) {
+    rb_raise(rb_eRuntimeError,"filler used after its callback returned");
+  }
+  return f;
+}
+
+VALUE rfiller_push(VALUE self, VALUE name, VALUE stat, VALUE offset) {
+  struct filler_t *f = rfiller_of(self);
   //Allow nil return instead of a stat
   if (NIL_P(stat)) {
-    f->filler(f->buffer,STR2CSTR(name),NULL,NUM2LONG(offset));
+    RF_FILL(f,STR2CSTR(name),NULL,NUM2LONG(offset));
   } else {
     struct stat st;
     memset(&st, 0, sizeof(st));
     rstat2stat(stat,&st);
-    f->filler(f->buffer,STR2CSTR(name),&st,NUM2LONG(offset));
+    RF_FILL(f,STR2CSTR(name),&st,NUM2LONG(offset));
   }
   return self;
 }
 
 VALUE rfiller_push_old(VALUE self, VALUE name, VALUE type, VALUE inode) {
+#ifdef RFUSE_FUSE3
+  rb_raise(rb_eNotImpError, "getdir is gone in libfuse 3, use readdir");
+#else
   printf("Called rfilter_push_old\n");
-  struct filler_t *f;
-  Data_Get_Struct(self,struct filler_t,f);
+  struct filler_t *f = rfiller_of(self);
   // TODO: architecture dependent int types
   printf("Before df\n");
   f->df(f->dh, STR2CSTR(name), NUM2INT(type), NUM2INT(inode));
   printf("After df\n");
+#endif
   return self;
 }
 
 VALUE rfiller_init(VALUE module) {
-  VALUE cFiller=rb_define_class_under(module,"Filler",rb_cObject);
+  cFiller=rb_define_class_under(module,"Filler",rb_cObject);
+  rb_global_variable(&cFiller);
   rb_define_alloc_func(cFiller,rfiller_new);
   rb_define_method(cFiller,"initialize",rfiller_initialize,0);
   rb_define_method(cFiller,"push",rfiller_push,3);
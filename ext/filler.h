@@ -4,12 +4,16 @@
 struct filler_t {
   fuse_fill_dir_t filler;
   void            *buffer;
+#ifndef RFUSE_FUSE3
   fuse_dirh_t     dh;
   fuse_dirfil_t   df;
+#endif
 };
 
 VALUE rfiller_initialize(VALUE self);
 VALUE rfiller_new(VALUE class);
+VALUE rfiller_instance_new();
+void rfiller_release(VALUE self);
 VALUE rfiller_push(VALUE self, VALUE name, VALUE stat, VALUE offset);
 VALUE rfiller_push_old(VALUE self, VALUE name, VALUE type, VALUE inode);
 
@@ -1,23 +1,13 @@
 #include "helper.h"
+#include "rstat.h"
 
+// An RFuse::Stat is copied as it is, Arrays, Hashes and other objects go
+// field by field
 void rstat2stat(VALUE rstat, struct stat *statbuf)
 {
-  statbuf->st_dev     = FIX2ULONG(rb_funcall(rstat,rb_intern("dev"),0));
-  statbuf->st_ino     = FIX2ULONG(rb_funcall(rstat,rb_intern("ino"),0));
-  statbuf->st_mode    = FIX2UINT(rb_funcall(rstat,rb_intern("mode"),0));
-  statbuf->st_nlink   = FIX2UINT(rb_funcall(rstat,rb_intern("nlink"),0));
-  statbuf->st_uid     = FIX2UINT(rb_funcall(rstat,rb_intern("uid"),0));
-  statbuf->st_gid     = FIX2UINT(rb_funcall(rstat,rb_intern("gid"),0));
-  statbuf->st_rdev    = FIX2ULONG(rb_funcall(rstat,rb_intern("rdev"),0));
-  statbuf->st_size    = FIX2ULONG(rb_funcall(rstat,rb_intern("size"),0));
-  statbuf->st_blksize = NUM2ULONG(rb_funcall(rstat,rb_intern("blksize"),0));
-  statbuf->st_blocks  = NUM2ULONG(rb_funcall(rstat,rb_intern("blocks"),0));
-  statbuf->st_atime   =
-    NUM2ULONG(rb_funcall(rb_funcall(rstat,rb_intern("atime"),0),rb_intern("to_i"),0));
-  statbuf->st_mtime   =
-    NUM2ULONG(rb_funcall(rb_funcall(rstat,rb_intern("mtime"),0),rb_intern("to_i"),0));
-  statbuf->st_ctime   =
-    NUM2ULONG(rb_funcall(rb_funcall(rstat,rb_intern("ctime"),0),rb_intern("to_i"),0));
+  if (!rstat_copy(rstat, statbuf)) {
+    rstat_convert(rstat, statbuf);
+  }
 }
 
 void rstatvfs2statvfs(VALUE rstatvfs,struct statvfs *statvfsbuf) {
@@ -37,7 +27,9 @@ void rstatvfs2statvfs(VALUE rstatvfs,struct statvfs *statvfsbuf) {
 void rfuseconninfo2fuseconninfo(VALUE rfuseconninfo,struct fuse_conn_info *fuseconninfo) {
   fuseconninfo->proto_major   = FIX2UINT(rb_funcall(rfuseconninfo,rb_intern("proto_major"),0));
   fuseconninfo->proto_minor   = FIX2UINT(rb_funcall(rfuseconninfo,rb_intern("proto_minor"),0));
+#ifndef RFUSE_FUSE3
   fuseconninfo->async_read    = FIX2UINT(rb_funcall(rfuseconninfo,rb_intern("async_read"),0));
+#endif
   fuseconninfo->max_write     = FIX2UINT(rb_funcall(rfuseconninfo,rb_intern("max_write"),0));
   fuseconninfo->max_readahead = FIX2UINT(rb_funcall(rfuseconninfo,rb_intern("max_readahead"),0));
   fuseconninfo->capable       = FIX2UINT(rb_funcall(rfuseconninfo,rb_intern("capable"),0));
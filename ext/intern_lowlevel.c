@@ -0,0 +1,264 @@
+#include "intern_lowlevel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+struct intern_lowlevel *intern_lowlevel_new() {
+  struct intern_lowlevel *ll;
+  ll = (struct intern_lowlevel *) malloc(sizeof(struct intern_lowlevel));
+  memset(ll, 0, sizeof(struct intern_lowlevel));
+
+  if (pipe(ll->wake) == 0) {
+    fcntl(ll->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(ll->wake[1], F_SETFL, O_NONBLOCK);
+  } else {
+    ll->wake[0] = ll->wake[1] = -1;
+  }
+  return ll;
+}
+
+int intern_lowlevel_destroy(struct intern_lowlevel *ll) {
+  //takes the channel with it, if it hasn't been unmounted
+  if (ll->se != NULL) {
+    fuse_session_destroy(ll->se);
+  }
+  if (ll->wake[0] >= 0) {
+    close(ll->wake[0]);
+    close(ll->wake[1]);
+  }
+#ifdef RFUSE_FUSE3
+  free(ll->fbuf.mem);
+#else
+  free(ll->buf);
+#endif
+  free(ll);
+  return 0;
+}
+
+#ifdef RFUSE_FUSE3
+
+int intern_lowlevel_init(
+  struct intern_lowlevel *ll,
+  const char *mountpoint,
+  struct fuse_args *kernelopts,
+  struct fuse_args *libopts)
+{
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  int i, fd;
+
+  if (strlen(mountpoint) >= MOUNTNAME_MAX) {
+    return -1;
+  }
+
+  //one set of options for both, as in intern_fuse_init
+  for (i = 0; i < libopts->argc; i++) {
+    fuse_opt_add_arg(&args, libopts->argv[i]);
+  }
+  for (i = 1; i < kernelopts->argc; i++) {
+    fuse_opt_add_arg(&args, kernelopts->argv[i]);
+  }
+
+  //ll comes back as fuse_req_userdata() of every request
+  ll->se = fuse_session_new(&args, &(ll->ll_op),
+    sizeof(struct fuse_lowlevel_ops), ll);
+  fuse_opt_free_args(&args);
+  if (ll->se == NULL) {
+    return -1;
+  }
+  if (fuse_session_mount(ll->se, mountpoint) != 0) {
+    return -1;
+  }
+  ll->mounted = 1;
+  strncpy(ll->mountname, mountpoint, MOUNTNAME_MAX);
+
+  //commands are drained until EAGAIN, see intern_lowlevel_receive
+  fd = fuse_session_fd(ll->se);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+// Return the /dev/fuse file descriptor for use with IO.select
+int intern_lowlevel_fd(struct intern_lowlevel *ll)
+{
+  if (!ll->mounted) {
+    return -1;
+  }
+  return fuse_session_fd(ll->se);
+}
+
+int intern_lowlevel_exited(struct intern_lowlevel *ll)
+{
+  return !ll->mounted || fuse_session_exited(ll->se);
+}
+
+// Read one command into ll->fbuf, without blocking. Returns its length, 0 if
+// none is queued, -1 if we're not mounted (anymore).
+int intern_lowlevel_receive(struct intern_lowlevel *ll)
+{
+  int res;
+
+  if (intern_lowlevel_exited(ll)) {
+    return -1;
+  }
+
+  //0 after an unmount, which exits the session
+  res = fuse_session_receive_buf(ll->se, &(ll->fbuf));
+  if (res == -EAGAIN || res == -EINTR) {
+    return 0;
+  }
+  if (res <= 0) {
+    fuse_session_exit(ll->se);
+    return -1;
+  }
+  return res;
+}
+
+// Dispatch the command read by intern_lowlevel_receive() to the callbacks
+void intern_lowlevel_process(struct intern_lowlevel *ll, int len)
+{
+  fuse_session_process_buf(ll->se, &(ll->fbuf));
+}
+
+void intern_lowlevel_unmount(struct intern_lowlevel *ll)
+{
+  if (!ll->mounted) {
+    return;
+  }
+  fuse_session_exit(ll->se);
+  fuse_session_unmount(ll->se);
+  ll->mounted = 0;
+}
+
+#else
+
+int intern_lowlevel_init(
+  struct intern_lowlevel *ll,
+  const char *mountpoint,
+  struct fuse_args *kernelopts,
+  struct fuse_args *libopts)
+{
+  struct fuse_chan *fc;
+  int fd;
+
+  if (strlen(mountpoint) >= MOUNTNAME_MAX) {
+    return -1;
+  }
+
+  fc = fuse_mount(mountpoint, kernelopts);
+  if (fc == NULL) {
+    return -1;
+  }
+  strncpy(ll->mountname, mountpoint, MOUNTNAME_MAX);
+
+  //ll comes back as fuse_req_userdata() of every request
+  ll->se = fuse_lowlevel_new(libopts, &(ll->ll_op),
+    sizeof(struct fuse_lowlevel_ops), ll);
+  if (ll->se == NULL) {
+    fuse_unmount(mountpoint, fc);
+    return -1;
+  }
+  fuse_session_add_chan(ll->se, fc);
+  ll->fc = fc;
+
+  ll->bufsize = fuse_chan_bufsize(fc);
+  ll->buf     = malloc(ll->bufsize);
+
+  //commands are drained until EAGAIN, see intern_lowlevel_receive
+  fd = fuse_chan_fd(fc);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+// Return the /dev/fuse file descriptor for use with IO.select
+int intern_lowlevel_fd(struct intern_lowlevel *ll)
+{
+  if (ll->fc == NULL) {
+    return -1;
+  }
+  return fuse_chan_fd(ll->fc);
+}
+
+int intern_lowlevel_exited(struct intern_lowlevel *ll)
+{
+  return ll->fc == NULL || fuse_session_exited(ll->se);
+}
+
+// Read one command into ll->buf, without blocking. Returns its length, 0 if
+// none is queued, -1 if we're not mounted (anymore).
+int intern_lowlevel_receive(struct intern_lowlevel *ll)
+{
+  struct fuse_chan *ch = ll->fc;
+  int res;
+
+  if (intern_lowlevel_exited(ll)) {
+    return -1;
+  }
+
+  //0 after an unmount, which exits the session
+  res = fuse_chan_recv(&ch, ll->buf, ll->bufsize);
+  if (res == -EAGAIN || res == -EINTR) {
+    return 0;
+  }
+  if (res <= 0) {
+    fuse_session_exit(ll->se);
+    return -1;
+  }
+  return res;
+}
+
+// Dispatch the command read by intern_lowlevel_receive() to the callbacks
+void intern_lowlevel_process(struct intern_lowlevel *ll, int len)
+{
+  fuse_session_process(ll->se, ll->buf, len, ll->fc);
+}
+
+void intern_lowlevel_unmount(struct intern_lowlevel *ll)
+{
+  if (ll->fc == NULL) {
+    return;
+  }
+  //fuse_unmount() destroys the channel, which leaves the session
+  fuse_session_exit(ll->se);
+  fuse_unmount(ll->mountname, ll->fc);
+  ll->fc = NULL;
+}
+
+#endif
+
+// Block until the kernel has a command for us. Safe to call without holding
+// the ruby GVL. Returns 1 if a command can be read, 0 if we were woken up by
+// intern_lowlevel_exit() or a signal, -1 if we're not mounted.
+int intern_lowlevel_wait(struct intern_lowlevel *ll)
+{
+  struct pollfd fds[2];
+
+  if (intern_lowlevel_exited(ll)) {
+    return -1;
+  }
+
+  fds[0].fd     = intern_lowlevel_fd(ll);
+  fds[0].events = POLLIN;
+  fds[1].fd     = ll->wake[0];
+  fds[1].events = POLLIN;
+
+  if (poll(fds, 2, -1) < 0 || fds[1].revents != 0) {
+    return 0;
+  }
+  return fds[0].revents != 0 ? 1 : 0;
+}
+
+void intern_lowlevel_exit(struct intern_lowlevel *ll)
+{
+  if (ll->se != NULL) {
+    fuse_session_exit(ll->se);
+  }
+  if (ll->wake[1] >= 0) {
+    if (write(ll->wake[1], "x", 1) < 0) {
+      //full pipe means the loop is awake already
+    }
+  }
+}
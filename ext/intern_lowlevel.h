@@ -0,0 +1,52 @@
+#ifndef _INTERN_LOWLEVEL_H
+#define _INTERN_LOWLEVEL_H
+
+#include <fuse.h>
+#ifdef RFUSE_FUSE3
+#include <fuse_lowlevel.h>
+#else
+#include <fuse/fuse_lowlevel.h>
+#endif
+
+#include "intern_rfuse.h"
+
+struct request;
+
+struct intern_lowlevel {
+#ifdef RFUSE_FUSE3
+  int    mounted;
+  struct fuse_buf fbuf; //the command being processed, libfuse sizes it
+#else
+  struct fuse_chan *fc;
+  char   *buf;     //the command being processed, there is one loop per mount
+  size_t bufsize;
+#endif
+  struct fuse_session *se;
+  struct fuse_lowlevel_ops ll_op;
+  char   mountname[MOUNTNAME_MAX];
+  uint64_t ops;    //callbacks the handler responds to
+  int    passthrough; //the kernel agreed to FUSE_CAP_PASSTHROUGH, see ll_init
+  int    wake[2];  //self-pipe to wake up intern_lowlevel_wait
+  void   *handler; //the ruby LowLevel object serving this mount
+  struct request *pending; //requests not replied to yet, see request.c
+};
+
+struct intern_lowlevel *intern_lowlevel_new();
+
+int intern_lowlevel_init(
+  struct intern_lowlevel *ll,
+  const char *mountpoint,
+  struct fuse_args *args,
+  struct fuse_args *libopts
+);
+
+int intern_lowlevel_fd(struct intern_lowlevel *ll);
+int intern_lowlevel_exited(struct intern_lowlevel *ll);
+int intern_lowlevel_wait(struct intern_lowlevel *ll);
+int intern_lowlevel_receive(struct intern_lowlevel *ll);
+void intern_lowlevel_process(struct intern_lowlevel *ll, int len);
+void intern_lowlevel_exit(struct intern_lowlevel *ll);
+void intern_lowlevel_unmount(struct intern_lowlevel *ll);
+int intern_lowlevel_destroy(struct intern_lowlevel *ll);
+
+#endif
@@ -1,23 +1,174 @@
 #include "intern_rfuse.h"
+#ifdef RFUSE_FUSE3
+#include <fuse_lowlevel.h>
+#else
 #include <fuse/fuse_lowlevel.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 
 struct intern_fuse *intern_fuse_new() {
   struct intern_fuse *inf;
   inf = (struct intern_fuse *) malloc(sizeof(struct intern_fuse));
-  memset(&inf->fuse_op, 0, sizeof(struct fuse_operations));
+  memset(inf, 0, sizeof(struct intern_fuse));
+
+  if (pipe(inf->wake) == 0) {
+    fcntl(inf->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(inf->wake[1], F_SETFL, O_NONBLOCK);
+  } else {
+    //poll() ignores negative fds, we just can't be woken up
+    inf->wake[0] = inf->wake[1] = -1;
+  }
+#ifdef RFUSE_FUSE3
+  pthread_mutex_init(&inf->buf_lock, NULL);
+#endif
   return inf;
 }
 
 int intern_fuse_destroy(struct intern_fuse *inf){
   //you have to take care, that fuse is unmounted yourself!
-  fuse_destroy(inf->fuse);
+  if (inf->fuse != NULL) {
+    fuse_destroy(inf->fuse);
+  }
+  if (inf->wake[0] >= 0) {
+    close(inf->wake[0]);
+    close(inf->wake[1]);
+  }
+#ifdef RFUSE_FUSE3
+  while (inf->nspare > 0) {
+    intern_cmd_t *buf = inf->spare[--inf->nspare];
+    free(buf->mem);
+    free(buf);
+  }
+  pthread_mutex_destroy(&inf->buf_lock);
+#endif
   free(inf);
   return 0;
 }
 
+#ifdef RFUSE_FUSE3
+
+int intern_fuse_init(
+  struct intern_fuse *inf,
+  const char *mountpoint,
+  struct fuse_args *kernelopts,
+  struct fuse_args *libopts)
+{
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  int i;
+
+  if (strlen(mountpoint) >= MOUNTNAME_MAX) {
+    return -1;
+  }
+
+  //libfuse 3 takes the mount options along with the library ones, the first
+  //element of each array is the (ignored) program name
+  for (i = 0; i < libopts->argc; i++) {
+    fuse_opt_add_arg(&args, libopts->argv[i]);
+  }
+  for (i = 1; i < kernelopts->argc; i++) {
+    fuse_opt_add_arg(&args, kernelopts->argv[i]);
+  }
+
+  //inf comes back as fuse_get_context()->private_data in every callback
+  inf->fuse = fuse_new(&args, &(inf->fuse_op), sizeof(struct fuse_operations), inf);
+  fuse_opt_free_args(&args);
+
+  if (inf->fuse == NULL || fuse_mount(inf->fuse, mountpoint) != 0) {
+    return -1;
+  }
+  inf->mounted = 1;
+
+  strncpy(inf->mountname, mountpoint, MOUNTNAME_MAX);
+  return 0;
+}
+
+// Return the /dev/fuse file descriptor for use with IO.select
+int intern_fuse_fd(struct intern_fuse *inf)
+{
+  if (inf->fuse == NULL || !inf->mounted) {
+    return -1;
+  }
+  return fuse_session_fd(fuse_get_session(inf->fuse));
+}
+
+int intern_fuse_exited(struct intern_fuse *inf)
+{
+  return inf->fuse == NULL || fuse_session_exited(fuse_get_session(inf->fuse));
+}
+
+// libfuse allocates the memory of an empty fuse_buf when receiving into
+// it, the session's bufsize (about 1 MiB). Processed buffers go back to the
+// mount and are received into again, as libfuse's own loops do: one per
+// loop_mt worker, and as many as loop_fiber has commands in flight.
+static intern_cmd_t *intern_fuse_buf_get(struct intern_fuse *inf)
+{
+  intern_cmd_t *buf = NULL;
+  pthread_mutex_lock(&inf->buf_lock);
+  if (inf->nspare > 0) {
+    buf = inf->spare[--inf->nspare];
+  }
+  pthread_mutex_unlock(&inf->buf_lock);
+  return buf != NULL ? buf : calloc(1, sizeof(intern_cmd_t));
+}
+
+static void intern_fuse_buf_put(struct intern_fuse *inf, intern_cmd_t *buf)
+{
+  pthread_mutex_lock(&inf->buf_lock);
+  if (inf->nspare < INTERN_FUSE_SPARE_BUFS) {
+    inf->spare[inf->nspare++] = buf;
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&inf->buf_lock);
+  if (buf != NULL) {
+    free(buf->mem);
+    free(buf);
+  }
+}
+
+// Read one command, NULL if there is none (EAGAIN, EINTR) or the session is
+// over. The buffer goes back to the mount in intern_fuse_dispatch.
+intern_cmd_t *intern_fuse_read(struct intern_fuse *inf)
+{
+  struct fuse_session *se = fuse_get_session(inf->fuse);
+  intern_cmd_t *buf = intern_fuse_buf_get(inf);
+  int res;
+
+  //0 after an unmount, which exits the session
+  res = fuse_session_receive_buf(se, buf);
+  if (res <= 0) {
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+      fuse_session_exit(se);
+    }
+    intern_fuse_buf_put(inf, buf);
+    return NULL;
+  }
+  return buf;
+}
+
+void intern_fuse_dispatch(struct intern_fuse *inf, intern_cmd_t *cmd)
+{
+  fuse_session_process_buf(fuse_get_session(inf->fuse), cmd);
+  intern_fuse_buf_put(inf, cmd);
+}
+
+void intern_fuse_unmount(struct intern_fuse *inf)
+{
+  if (inf->fuse != NULL && inf->mounted) {
+    fuse_unmount(inf->fuse);
+    inf->mounted = 0;
+  }
+}
+
+#else
+
 int intern_fuse_init(
   struct intern_fuse *inf,
   const char *mountpoint, 
@@ -32,7 +183,8 @@ int intern_fuse_init(
     return -1;
   }
 
-  inf->fuse=fuse_new(fc, libopts, &(inf->fuse_op), sizeof(struct fuse_operations), NULL);
+  //inf comes back as fuse_get_context()->private_data in every callback
+  inf->fuse=fuse_new(fc, libopts, &(inf->fuse_op), sizeof(struct fuse_operations), inf);
   inf->fc = fc;
 
   if (strlen(inf->mountname) > MOUNTNAME_MAX) {
@@ -54,24 +206,208 @@ int intern_fuse_fd(struct intern_fuse *inf)
   return fuse_chan_fd(fc);
 }
 
+int intern_fuse_exited(struct intern_fuse *inf)
+{
+  return inf->fuse == NULL || fuse_exited(inf->fuse);
+}
+
+// Read one command, NULL if there is none (EAGAIN, EINTR) or the session is
+// over (an unmount exits it)
+intern_cmd_t *intern_fuse_read(struct intern_fuse *inf)
+{
+  return fuse_read_cmd(inf->fuse);
+}
+
+void intern_fuse_dispatch(struct intern_fuse *inf, intern_cmd_t *cmd)
+{
+  fuse_process_cmd(inf->fuse, cmd);
+}
+
+// fuse_unmount() destroys the channel
+void intern_fuse_unmount(struct intern_fuse *inf)
+{
+  if (inf->fc != NULL) {
+    fuse_unmount(inf->mountname, inf->fc);
+    inf->fc = NULL;
+  }
+}
+
+#endif
+
+// Kernel protocol opcodes (linux/fuse.h) of the commands for which libfuse
+// write-locks the path: it waits until no other request is using it.
+#define INTERN_FUSE_UNLINK  10
+#define INTERN_FUSE_RMDIR   11
+#define INTERN_FUSE_RENAME  12
+#define INTERN_FUSE_RENAME2 45
+
+#ifndef RFUSE_FUSE3
+//libfuse 2 doesn't export it, it has been the same since 2.6
+struct fuse_cmd {
+  char *buf;
+  size_t buflen;
+  struct fuse_chan *ch;
+};
+#endif
+
+// Whether processing cmd makes libfuse wait for the requests in flight on
+// the same path (unlink, rmdir, rename), and those that come after wait for
+// it. The command header holds len and opcode, both 32 bits.
+int intern_fuse_write_locks(intern_cmd_t *cmd)
+{
+  uint32_t opcode;
+#ifdef RFUSE_FUSE3
+  //spliced into a pipe only when large, a write
+  if ((cmd->flags & FUSE_BUF_IS_FD) || cmd->size < 2 * sizeof(uint32_t)) {
+    return 0;
+  }
+  memcpy(&opcode, (char *) cmd->mem + sizeof(uint32_t), sizeof(opcode));
+#else
+  if (cmd->buflen < 2 * sizeof(uint32_t)) {
+    return 0;
+  }
+  memcpy(&opcode, cmd->buf + sizeof(uint32_t), sizeof(opcode));
+#endif
+  return opcode == INTERN_FUSE_UNLINK || opcode == INTERN_FUSE_RMDIR ||
+    opcode == INTERN_FUSE_RENAME || opcode == INTERN_FUSE_RENAME2;
+}
+
 //Process one fuse command (ie after IO.select)
 int intern_fuse_process(struct intern_fuse *inf)
 {
-  if (inf->fuse == NULL) {
+  intern_cmd_t *cmd;
+
+  if (intern_fuse_exited(inf)) {
+    return -1;
+  }
+
+  cmd = intern_fuse_read(inf);
+
+  if (cmd != NULL) {
+    intern_fuse_dispatch(inf, cmd);
+  }
+
+  return 0;
+}
+
+// Make reads from the channel return EAGAIN instead of blocking
+static void intern_fuse_set_nonblock(struct intern_fuse *inf, int fd)
+{
+  if (!inf->nonblock) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    inf->nonblock = 1;
+  }
+}
+
+static long long intern_fuse_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Process up to max commands the kernel has queued, without blocking. With
+// budget_ns >= 0 we also stop once that much time has been spent; at least
+// one command is processed anyway. Returns the number of commands processed,
+// 0 if none was queued (EAGAIN), -1 if we're not mounted or exited before
+// anything could be processed.
+int intern_fuse_process_many(struct intern_fuse *inf, int max,
+  long long budget_ns)
+{
+  intern_cmd_t *cmd;
+  long long deadline = 0;
+  int count = 0;
+  int fd = intern_fuse_fd(inf);
+
+  if (fd < 0 || intern_fuse_exited(inf)) {
     return -1;
   }
 
+  intern_fuse_set_nonblock(inf, fd);
+  if (budget_ns >= 0) {
+    deadline = intern_fuse_now_ns() + budget_ns;
+  }
+
+  while (count < max) {
+    //NULL on EAGAIN, EINTR, and after an unmount which exits the session
+    cmd = intern_fuse_read(inf);
+    if (cmd == NULL) {
+      break;
+    }
+    intern_fuse_dispatch(inf, cmd);
+    count++;
+
+    if (intern_fuse_exited(inf) ||
+        (budget_ns >= 0 && intern_fuse_now_ns() >= deadline)) {
+      break;
+    }
+  }
 
-  if (fuse_exited(inf->fuse)) {
+  if (count == 0 && intern_fuse_exited(inf)) {
     return -1;
   }
+  return count;
+}
 
-  struct fuse_cmd *cmd;
-  cmd = fuse_read_cmd(inf->fuse);
+// Get ready to be driven by intern_fuse_wait(). The channel becomes
+// non-blocking: with several threads waiting for the same command only one
+// of them gets it, the others must not block in read(). Returns -1 if we're
+// not mounted.
+int intern_fuse_prepare_loop(struct intern_fuse *inf)
+{
+  char buf[64];
+  int fd = intern_fuse_fd(inf);
 
-  if (cmd != NULL) {
-    fuse_process_cmd(inf->fuse, cmd);
+  if (fd < 0 || inf->fuse == NULL) {
+    return -1;
   }
 
+  intern_fuse_set_nonblock(inf, fd);
+
+  //leftovers of a previous loop_mt shutdown
+  inf->stopping = 0;
+  while (inf->wake[0] >= 0 && read(inf->wake[0], buf, sizeof(buf)) > 0);
+
   return 0;
 }
+
+// Block until the kernel has a command for us. Safe to call without holding
+// the ruby GVL. Returns 1 if a command can be read, 0 if we were woken up by
+// intern_fuse_wake() or a signal, -1 if we're not mounted.
+int intern_fuse_wait(struct intern_fuse *inf)
+{
+  struct pollfd fds[2];
+  int fd = intern_fuse_fd(inf);
+
+  if (fd < 0 || inf->fuse == NULL) {
+    return -1;
+  }
+
+  fds[0].fd     = fd;
+  fds[0].events = POLLIN;
+  fds[1].fd     = inf->wake[0];
+  fds[1].events = POLLIN;
+
+  if (poll(fds, 2, -1) < 0) {
+    //EINTR, let the caller look at why
+    return 0;
+  }
+
+  if (fds[1].revents != 0) {
+    return 0;
+  }
+
+  //POLLERR after an external unmount is picked up by intern_fuse_read
+  return fds[0].revents != 0 ? 1 : 0;
+}
+
+// Wake up everybody sitting in intern_fuse_wait(). The pipe is never drained,
+// the waiters are expected to look at intern_fuse_exited() and leave.
+void intern_fuse_wake(struct intern_fuse *inf)
+{
+  if (inf->wake[1] >= 0) {
+    if (write(inf->wake[1], "x", 1) < 0) {
+      //full pipe means they are awake already
+    }
+  }
+}
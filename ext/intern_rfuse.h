@@ -1,14 +1,68 @@
+#ifndef _INTERN_RFUSE_H
+#define _INTERN_RFUSE_H
+
 #include <fuse.h>
+#include <pthread.h>
+
+#include "readahead.h"
+#include "writebehind.h"
 
 #define MOUNTNAME_MAX 1024
 
+struct open_file;
+struct attrcache;
+struct pathcache;
+
+// With libfuse 3 a command is a fuse_buf received from the session, with
+// libfuse 2 the opaque fuse_cmd
+#ifdef RFUSE_FUSE3
+typedef struct fuse_buf intern_cmd_t;
+#define INTERN_FUSE_SPARE_BUFS 16 //kept for reuse, see intern_fuse_read
+#else
+typedef struct fuse_cmd intern_cmd_t;
+#endif
+
 struct intern_fuse {
+#ifndef RFUSE_FUSE3
   struct fuse_chan *fc;
+#else
+  int mounted;
+  pthread_mutex_t buf_lock;
+  intern_cmd_t *spare[INTERN_FUSE_SPARE_BUFS]; //received into and processed
+  int nspare;
+#endif
   struct fuse *fuse;
   struct fuse_operations fuse_op;
   struct fuse_context *fuse_ctx;
   char   mountname[MOUNTNAME_MAX];
   int state; //created,mounted,running
+  uint64_t ops; //callbacks the handler responds to, see rf_initialize
+  uint64_t noctx; //of which those called without ctx, see RF_FUNCALL
+  uint64_t noffi; //and without the FileInfo
+  int    wake[2]; //self-pipe to wake up intern_fuse_wait, see Fuse#exit
+  volatile int stopping; //tells the loop_mt workers to leave
+  int    loopers; //loops serving the mount, see rfuse_loop_enter
+  int    unmount_pending; //Fuse#unmount came while they were
+  int    nonblock;  //the channel has been made non-blocking
+  int    borrow_writes; //write() gets an IO::Buffer, see Fuse#borrow_writes=
+  int    reuse_objects; //a Context, FileInfo and Filler per fiber, see rf_wrappers
+  int    fibers; //served by loop_fiber, a fiber per request: no reuse_objects
+  long   fiber_busy; //loop_fiber: commands scheduled and not done yet
+  void   *fiber_idle; //loop_fiber: a Queue waiting for fiber_busy to be 0
+  int    passthrough; //the kernel agreed to FUSE_CAP_PASSTHROUGH, see rf_init
+  void   *handler;   //the ruby Fuse object serving this mount
+  void   *init_data; //whatever its init() returned, handed to destroy()
+  struct open_file *handles; //open files, see rf_handle_open
+  struct attrcache *attrs; //Fuse#attr_cache=, NULL until turned on
+  struct attrcache *misses; //Fuse#negative_cache=, ENOENTs from getattr
+  struct pathcache *paths;  //Fuse#path_cache=, NULL when off
+  size_t readahead; //Fuse#readahead=, the largest prefetch, 0: off
+  struct readahead_stats ra_stats;
+  size_t ra_count; //open files reading ahead
+  size_t write_behind; //Fuse#write_behind=, the most held back, 0: off
+  int64_t write_behind_age; //ns, Fuse#write_behind_age=
+  size_t wb_pending; //open files with writes held back
+  struct writebehind_stats wb_stats;
 };
 
 struct intern_fuse *intern_fuse_new();
@@ -21,5 +75,17 @@ int intern_fuse_init(
 );
 
 int intern_fuse_fd(struct intern_fuse *inf);
+int intern_fuse_exited(struct intern_fuse *inf);
+intern_cmd_t *intern_fuse_read(struct intern_fuse *inf);
+void intern_fuse_dispatch(struct intern_fuse *inf, intern_cmd_t *cmd);
+void intern_fuse_unmount(struct intern_fuse *inf);
 int intern_fuse_process(struct intern_fuse *inf);
+int intern_fuse_process_many(struct intern_fuse *inf, int max,
+  long long budget_ns);
+int intern_fuse_prepare_loop(struct intern_fuse *inf);
+int intern_fuse_wait(struct intern_fuse *inf);
+void intern_fuse_wake(struct intern_fuse *inf);
+int intern_fuse_write_locks(intern_cmd_t *cmd);
 int intern_fuse_destroy(struct intern_fuse *inf);
+
+#endif
@@ -0,0 +1,638 @@
+// RFuse::LowLevel binds the FUSE low-level interface. Handlers get inode
+// numbers instead of paths, and an RFuse::Request to reply to instead of
+// returning a result: the reply may be sent later, from any thread, after
+// the callback has returned. Slow requests then don't hold up the loop.
+//
+//   class MyFS < RFuse::LowLevel
+//     def getattr(req, ino, fi)
+//       backend.stat_async(ino) { |st| req.reply_attr(st, 1.0) }
+//     end
+//   end
+//
+// Callbacks run with the GVL held; only waiting for the kernel releases it.
+// A handler that raises before replying gets its errno (EIO if none) sent
+// back. A request garbage collected without a reply is answered with EIO.
+
+#include <ruby.h>
+#include <fuse.h>
+#include <errno.h>
+
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+#include "lowlevel.h"
+#include "intern_lowlevel.h"
+#include "request.h"
+#include "helper.h"
+#include "file_info.h"
+#include "rfuse.h"
+#include "passthrough.h"
+#include "rstat.h"
+
+#define LL_LOOP_MAX 64
+
+enum ll_op {
+  LL_OP_LOOKUP, LL_OP_FORGET, LL_OP_GETATTR, LL_OP_READLINK, LL_OP_MKNOD,
+  LL_OP_MKDIR, LL_OP_UNLINK, LL_OP_RMDIR, LL_OP_SYMLINK, LL_OP_RENAME,
+  LL_OP_LINK, LL_OP_OPEN, LL_OP_READ, LL_OP_WRITE, LL_OP_FLUSH,
+  LL_OP_RELEASE, LL_OP_FSYNC, LL_OP_OPENDIR, LL_OP_READDIR,
+  LL_OP_RELEASEDIR, LL_OP_STATFS, LL_OP_ACCESS, LL_OP_CREATE,
+  LL_OP_SETATTR,
+  LL_OP_MAX
+};
+
+static const char *ll_op_names[LL_OP_MAX] = {
+  "lookup", "forget", "getattr", "readlink", "mknod",
+  "mkdir", "unlink", "rmdir", "symlink", "rename",
+  "link", "open", "read", "write", "flush",
+  "release", "fsync", "opendir", "readdir",
+  "releasedir", "statfs", "access", "create",
+  "setattr"
+};
+
+static ID ll_op_ids[LL_OP_MAX];
+
+#define LL_OP_BIT(op) (((uint64_t) 1) << (op))
+
+struct ll_call {
+  VALUE handler;
+  ID    id;
+  int   argc;
+  VALUE *argv;
+};
+
+static VALUE unsafe_ll_call(VALUE data)
+{
+  struct ll_call *c = (struct ll_call *) data;
+  return rb_funcall2(c->handler, c->id, c->argc, c->argv);
+}
+
+// argv[0] is the Request, the handler's return value doesn't matter
+static void ll_dispatch(fuse_req_t req, enum ll_op op, int argc, VALUE *argv)
+{
+  struct intern_lowlevel *ll = fuse_req_userdata(req);
+  struct ll_call c;
+  int error = 0;
+
+  c.handler = (VALUE) ll->handler;
+  c.id      = ll_op_ids[op];
+  c.argc    = argc;
+  c.argv    = argv;
+
+  rb_protect(unsafe_ll_call, (VALUE) &c, &error);
+  if (error && request_pending(argv[0])) {
+    request_reply_err(argv[0], return_error(EIO));
+  }
+}
+
+static VALUE ll_request(fuse_req_t req)
+{
+  return wrap_request(fuse_req_userdata(req), req);
+}
+
+static VALUE ll_file_info(struct fuse_file_info *fi)
+{
+  return fi == NULL ? Qnil : file_info_copy(fi);
+}
+
+//----------------------CALLBACKS
+
+#ifdef RFUSE_PASSTHROUGH
+// Not a ruby callback: asks for kernel passthrough, used by handlers that
+// open files with FileInfo#passthrough=, see request_reply_open
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+  struct intern_lowlevel *ll = userdata;
+  if ((conn->capable & FUSE_CAP_PASSTHROUGH) &&
+      (ll->ops & (LL_OP_BIT(LL_OP_OPEN) | LL_OP_BIT(LL_OP_CREATE))))
+  {
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+    if (conn->max_backing_stack_depth == 0)
+      conn->max_backing_stack_depth = 1;
+  }
+  ll->passthrough = (conn->want & FUSE_CAP_PASSTHROUGH) != 0;
+}
+#endif
+
+// Entries are replied to with req.reply_entry, which is where the lookup
+// count of an inode goes up. forget() brings it down again; it gets no
+// request, there's nothing to reply.
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(parent);
+  args[2] = rb_str_new2(name);
+  ll_dispatch(req, LL_OP_LOOKUP, 3, args);
+}
+
+static VALUE unsafe_ll_forget(VALUE *args)
+{
+  struct intern_lowlevel *ll = (struct intern_lowlevel *) args[0];
+  return rb_funcall((VALUE) ll->handler, ll_op_ids[LL_OP_FORGET], 2,
+    args[1], args[2]);
+}
+
+#ifdef RFUSE_FUSE3
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+#else
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+#endif
+{
+  VALUE args[3];
+  int error = 0;
+
+  args[0] = (VALUE) fuse_req_userdata(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = ULL2NUM(nlookup);
+  rb_protect((VALUE (*)())unsafe_ll_forget, (VALUE) args, &error);
+  fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+  struct fuse_file_info *fi)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_GETATTR, 3, args);
+}
+
+// chmod, chown, truncate, utimens and open(O_TRUNC). attr is an RFuse::Stat
+// of which only the fields flagged in to_set (SET_ATTR_*) matter. The reply
+// is reply_attr with the new attributes.
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+  int to_set, struct fuse_file_info *fi)
+{
+  VALUE args[5];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = rstat_new(attr);
+  args[3] = INT2NUM(to_set);
+  args[4] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_SETATTR, 5, args);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+  VALUE args[2];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  ll_dispatch(req, LL_OP_READLINK, 2, args);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+  mode_t mode, dev_t rdev)
+{
+  VALUE args[5];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(parent);
+  args[2] = rb_str_new2(name);
+  args[3] = UINT2NUM(mode);
+  args[4] = ULL2NUM(rdev);
+  ll_dispatch(req, LL_OP_MKNOD, 5, args);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+  mode_t mode)
+{
+  VALUE args[4];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(parent);
+  args[2] = rb_str_new2(name);
+  args[3] = UINT2NUM(mode);
+  ll_dispatch(req, LL_OP_MKDIR, 4, args);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(parent);
+  args[2] = rb_str_new2(name);
+  ll_dispatch(req, LL_OP_UNLINK, 3, args);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(parent);
+  args[2] = rb_str_new2(name);
+  ll_dispatch(req, LL_OP_RMDIR, 3, args);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+  const char *name)
+{
+  VALUE args[4];
+  args[0] = ll_request(req);
+  args[1] = rb_str_new2(link);
+  args[2] = ULL2NUM(parent);
+  args[3] = rb_str_new2(name);
+  ll_dispatch(req, LL_OP_SYMLINK, 4, args);
+}
+
+#ifdef RFUSE_FUSE3
+//RENAME_EXCHANGE and RENAME_NOREPLACE aren't passed on to the handler
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+  fuse_ino_t newparent, const char *newname, unsigned int flags)
+#else
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+  fuse_ino_t newparent, const char *newname)
+#endif
+{
+  VALUE args[5];
+#ifdef RFUSE_FUSE3
+  if (flags != 0) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+#endif
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(parent);
+  args[2] = rb_str_new2(name);
+  args[3] = ULL2NUM(newparent);
+  args[4] = rb_str_new2(newname);
+  ll_dispatch(req, LL_OP_RENAME, 5, args);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+  const char *newname)
+{
+  VALUE args[4];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = ULL2NUM(newparent);
+  args[3] = rb_str_new2(newname);
+  ll_dispatch(req, LL_OP_LINK, 4, args);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino,
+  struct fuse_file_info *fi)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_OPEN, 3, args);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+  struct fuse_file_info *fi)
+{
+  VALUE args[5];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = SIZET2NUM(size);
+  args[3] = OFFT2NUM(off);
+  args[4] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_READ, 5, args);
+}
+
+// The data is copied, the reply may come after buf is gone
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+  size_t size, off_t off, struct fuse_file_info *fi)
+{
+  VALUE args[5];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = rb_str_new(buf, size);
+  args[3] = OFFT2NUM(off);
+  args[4] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_WRITE, 5, args);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino,
+  struct fuse_file_info *fi)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_FLUSH, 3, args);
+}
+
+// Also there to drop the backing ids of passthrough files, handlers
+// without release get their files released silently
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+  struct fuse_file_info *fi)
+{
+  struct intern_lowlevel *ll = fuse_req_userdata(req);
+  VALUE args[3];
+#ifdef RFUSE_PASSTHROUGH
+  if (fi->backing_id > 0) {
+    passthrough_close(intern_lowlevel_fd(ll), fi->backing_id);
+  }
+#endif
+  if (!(ll->ops & LL_OP_BIT(LL_OP_RELEASE))) {
+    fuse_reply_err(req, 0);
+    return;
+  }
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_RELEASE, 3, args);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+  struct fuse_file_info *fi)
+{
+  VALUE args[4];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = INT2NUM(datasync);
+  args[3] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_FSYNC, 4, args);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+  struct fuse_file_info *fi)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_OPENDIR, 3, args);
+}
+
+// Replied to with req.reply_dir, which fills up to size bytes
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+  off_t off, struct fuse_file_info *fi)
+{
+  VALUE args[5];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = SIZET2NUM(size);
+  args[3] = OFFT2NUM(off);
+  args[4] = ll_file_info(fi);
+  request_set_size(args[0], size);
+  ll_dispatch(req, LL_OP_READDIR, 5, args);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+  struct fuse_file_info *fi)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_RELEASEDIR, 3, args);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+  VALUE args[3];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  args[2] = INT2NUM(mask);
+  ll_dispatch(req, LL_OP_ACCESS, 3, args);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+  mode_t mode, struct fuse_file_info *fi)
+{
+  VALUE args[5];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(parent);
+  args[2] = rb_str_new2(name);
+  args[3] = UINT2NUM(mode);
+  args[4] = ll_file_info(fi);
+  ll_dispatch(req, LL_OP_CREATE, 5, args);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  VALUE args[2];
+  args[0] = ll_request(req);
+  args[1] = ULL2NUM(ino);
+  ll_dispatch(req, LL_OP_STATFS, 2, args);
+}
+
+//----------------------LOOP
+
+// Process up to max queued commands. Returns the number processed, -1 if
+// we're not mounted.
+static int ll_drain(struct intern_lowlevel *ll, int max)
+{
+  int count = 0;
+  int len;
+
+  while (count < max) {
+    len = intern_lowlevel_receive(ll);
+    if (len < 0) {
+      return count > 0 ? count : -1;
+    }
+    if (len == 0) {
+      break;
+    }
+    intern_lowlevel_process(ll, len);
+    count++;
+  }
+  return count;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void *ll_wait_nogvl(void *data)
+{
+  return (void *) (long) intern_lowlevel_wait(data);
+}
+#endif
+
+static VALUE ll_loop(VALUE self)
+{
+  struct intern_lowlevel *ll;
+  long res;
+  Data_Get_Struct(self, struct intern_lowlevel, ll);
+
+  while (!intern_lowlevel_exited(ll)) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    res = (long) rb_thread_call_without_gvl(ll_wait_nogvl, ll,
+      RUBY_UBF_IO, NULL);
+#else
+    res = intern_lowlevel_wait(ll);
+#endif
+    if (res < 0 || ll_drain(ll, LL_LOOP_MAX) < 0) {
+      break;
+    }
+  }
+  return Qnil;
+}
+
+// process_many(max): see Fuse#process_many
+static VALUE ll_process_many(VALUE self, VALUE rmax)
+{
+  struct intern_lowlevel *ll;
+  int max = NUM2INT(rmax);
+  int res;
+
+  if (max < 1) {
+    rb_raise(rb_eArgError, "max must be at least 1");
+  }
+  Data_Get_Struct(self, struct intern_lowlevel, ll);
+
+  res = ll_drain(ll, max);
+  if (res < 0) {
+    return Qnil;
+  }
+  if (res == 0) {
+    return ID2SYM(rb_intern("wait_readable"));
+  }
+  return INT2NUM(res);
+}
+
+static VALUE ll_fd(VALUE self)
+{
+  struct intern_lowlevel *ll;
+  Data_Get_Struct(self, struct intern_lowlevel, ll);
+  return INT2NUM(intern_lowlevel_fd(ll));
+}
+
+static VALUE ll_exit(VALUE self)
+{
+  struct intern_lowlevel *ll;
+  Data_Get_Struct(self, struct intern_lowlevel, ll);
+  intern_lowlevel_exit(ll);
+  return Qnil;
+}
+
+static VALUE ll_unmount(VALUE self)
+{
+  struct intern_lowlevel *ll;
+  Data_Get_Struct(self, struct intern_lowlevel, ll);
+  //libfuse 2 frees the channel the pending requests would reply through
+  request_detach_all(ll);
+  intern_lowlevel_unmount(ll);
+  return Qnil;
+}
+
+static VALUE ll_mountname(VALUE self)
+{
+  struct intern_lowlevel *ll;
+  Data_Get_Struct(self, struct intern_lowlevel, ll);
+  return rb_str_new2(ll->mountname);
+}
+
+//----------------------RUBY
+
+static VALUE ll_initialize(
+  VALUE self,
+  VALUE mountpoint,
+  VALUE kernelopts,
+  VALUE libopts)
+{
+  struct intern_lowlevel *ll;
+  struct fuse_args *kargs, *largs;
+  int op;
+
+  Check_Type(mountpoint, T_STRING);
+  Check_Type(kernelopts, T_ARRAY);
+  Check_Type(libopts, T_ARRAY);
+
+  Data_Get_Struct(self, struct intern_lowlevel, ll);
+
+  ll->ops = 0;
+  for (op = 0; op < LL_OP_MAX; op++) {
+    if (rb_respond_to(self, ll_op_ids[op]))
+      ll->ops |= LL_OP_BIT(op);
+  }
+
+#define LL_SET_OP(op, name) \
+  if (ll->ops & LL_OP_BIT(op)) ll->ll_op.name = ll_##name
+
+  LL_SET_OP(LL_OP_LOOKUP,     lookup);
+  LL_SET_OP(LL_OP_FORGET,     forget);
+  LL_SET_OP(LL_OP_GETATTR,    getattr);
+  LL_SET_OP(LL_OP_READLINK,   readlink);
+  LL_SET_OP(LL_OP_MKNOD,      mknod);
+  LL_SET_OP(LL_OP_MKDIR,      mkdir);
+  LL_SET_OP(LL_OP_UNLINK,     unlink);
+  LL_SET_OP(LL_OP_RMDIR,      rmdir);
+  LL_SET_OP(LL_OP_SYMLINK,    symlink);
+  LL_SET_OP(LL_OP_RENAME,     rename);
+  LL_SET_OP(LL_OP_LINK,       link);
+  LL_SET_OP(LL_OP_OPEN,       open);
+  LL_SET_OP(LL_OP_READ,       read);
+  LL_SET_OP(LL_OP_WRITE,      write);
+  LL_SET_OP(LL_OP_FLUSH,      flush);
+  LL_SET_OP(LL_OP_RELEASE,    release);
+  LL_SET_OP(LL_OP_FSYNC,      fsync);
+  LL_SET_OP(LL_OP_OPENDIR,    opendir);
+  LL_SET_OP(LL_OP_READDIR,    readdir);
+  LL_SET_OP(LL_OP_RELEASEDIR, releasedir);
+  LL_SET_OP(LL_OP_STATFS,     statfs);
+  LL_SET_OP(LL_OP_ACCESS,     access);
+  LL_SET_OP(LL_OP_CREATE,     create);
+  LL_SET_OP(LL_OP_SETATTR,    setattr);
+
+#undef LL_SET_OP
+
+#ifdef RFUSE_PASSTHROUGH
+  ll->ll_op.init = ll_init;
+  if (ll->ops & (LL_OP_BIT(LL_OP_OPEN) | LL_OP_BIT(LL_OP_CREATE)))
+    ll->ll_op.release = ll_release;
+#endif
+
+  kargs = rarray2fuseargs(kernelopts);
+  largs = rarray2fuseargs(libopts);
+
+  ll->handler = (void *) self;
+
+  if (intern_lowlevel_init(ll, STR2CSTR(mountpoint), kargs, largs) < 0) {
+    rb_raise(rb_eRuntimeError, "can't mount %s", STR2CSTR(mountpoint));
+  }
+  return self;
+}
+
+// Pending requests must not reply through the destroyed session
+static void ll_free(struct intern_lowlevel *ll)
+{
+  request_detach_all(ll);
+  intern_lowlevel_destroy(ll);
+}
+
+static VALUE ll_new(VALUE class)
+{
+  struct intern_lowlevel *ll = intern_lowlevel_new();
+  return Data_Wrap_Struct(class, 0, ll_free, ll);
+}
+
+VALUE lowlevel_init(VALUE module)
+{
+  VALUE cLowLevel = rb_define_class_under(module, "LowLevel", rb_cObject);
+  int op;
+
+  for (op = 0; op < LL_OP_MAX; op++) {
+    ll_op_ids[op] = rb_intern(ll_op_names[op]);
+  }
+
+  rb_define_alloc_func(cLowLevel, ll_new);
+  rb_define_method(cLowLevel, "initialize", ll_initialize, 3);
+  rb_define_method(cLowLevel, "loop", ll_loop, 0);
+  rb_define_method(cLowLevel, "process_many", ll_process_many, 1);
+  rb_define_method(cLowLevel, "fd", ll_fd, 0);
+  rb_define_method(cLowLevel, "exit", ll_exit, 0);
+  rb_define_method(cLowLevel, "unmount", ll_unmount, 0);
+  rb_define_method(cLowLevel, "mountname", ll_mountname, 0);
+
+  //the to_set bits of setattr
+#define LL_SET_ATTR(name) \
+  rb_define_const(cLowLevel, "SET_ATTR_" #name, INT2FIX(FUSE_SET_ATTR_##name))
+  LL_SET_ATTR(MODE);
+  LL_SET_ATTR(UID);
+  LL_SET_ATTR(GID);
+  LL_SET_ATTR(SIZE);
+  LL_SET_ATTR(ATIME);
+  LL_SET_ATTR(MTIME);
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+  LL_SET_ATTR(ATIME_NOW);
+#endif
+#ifdef FUSE_SET_ATTR_MTIME_NOW
+  LL_SET_ATTR(MTIME_NOW);
+#endif
+#undef LL_SET_ATTR
+  return cLowLevel;
+}
@@ -0,0 +1,3 @@
+#include <ruby.h>
+
+VALUE lowlevel_init(VALUE module);
@@ -0,0 +1,49 @@
+// Backing files for kernel passthrough. The kernel reads and writes a
+// file opened with a backing id straight from the backing file, those
+// requests never get to us. libfuse only registers them through a
+// fuse_req_t, which the high-level callbacks don't see, so the ioctls are
+// issued here on the device fd. fuse.h stays out: linux/fuse.h and
+// libfuse define some of the same names.
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#ifdef HAVE_LINUX_FUSE_H
+#include <linux/fuse.h>
+#endif
+
+#include "passthrough.h"
+
+// Registers fd with the fuse device, returns the backing id (> 0) to put
+// into fuse_file_info.backing_id, or -errno
+int passthrough_open(int devfd, int fd)
+{
+#ifdef FUSE_DEV_IOC_BACKING_OPEN
+  struct fuse_backing_map map;
+  int id;
+
+  memset(&map, 0, sizeof(map));
+  map.fd = fd;
+  id = ioctl(devfd, FUSE_DEV_IOC_BACKING_OPEN, &map);
+  if (id < 0) {
+    return -errno;
+  }
+  return id > 0 ? id : -EIO;
+#else
+  return -ENOSYS;
+#endif
+}
+
+// The kernel keeps the backing file for the files opened with it, the id
+// may go once they are released
+int passthrough_close(int devfd, int backing_id)
+{
+#ifdef FUSE_DEV_IOC_BACKING_CLOSE
+  uint32_t id = backing_id;
+  return ioctl(devfd, FUSE_DEV_IOC_BACKING_CLOSE, &id) < 0 ? -errno : 0;
+#else
+  return -ENOSYS;
+#endif
+}
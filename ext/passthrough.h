@@ -0,0 +1,15 @@
+#ifndef _PASSTHROUGH_H
+#define _PASSTHROUGH_H
+
+// Kernel passthrough needs libfuse 3.16 (fuse_file_info.backing_id) and a
+// Linux 6.9 kernel; passthrough_open fails with ENOSYS or EPERM otherwise
+// and the open file is served by rfuse as before.
+#if defined(RFUSE_FUSE3) && defined(FUSE_CAP_PASSTHROUGH) && \
+  defined(HAVE_STRUCT_FUSE_FILE_INFO_BACKING_ID)
+#define RFUSE_PASSTHROUGH
+#endif
+
+int passthrough_open(int devfd, int fd);
+int passthrough_close(int devfd, int backing_id);
+
+#endif
@@ -0,0 +1,183 @@
+// The path Strings handed to handlers, by path, for Fuse#path_cache=:
+// frozen, deduplicated (interned) and the same object every time a path
+// comes back, so a handler keying a Hash on it doesn't have it copied and
+// hashed over and over. Everything in here runs with the GVL held.
+//
+// The least recently used path goes when the cache is full. unlink, rmdir
+// and rename drop the paths that went away, see rf_path_forget. The mount
+// marks the Strings.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pathcache.h"
+
+#define PATHCACHE_BUCKETS 4096 //a power of two
+
+struct pathcache_entry {
+  struct pathcache_entry *chain; //same bucket
+  struct pathcache_entry *prev;  //lru, most recent first
+  struct pathcache_entry *next;
+  uint64_t hash;
+  VALUE str;
+  size_t len;
+  char path[];
+};
+
+//FNV-1a
+static uint64_t pathcache_hash(const char *path, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) path[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static VALUE pathcache_str(const char *path, size_t len)
+{
+#ifdef HAVE_RB_INTERNED_STR
+  return rb_interned_str(path, len);
+#else
+  VALUE str = rb_str_new(path, len);
+  OBJ_FREEZE(str);
+  return str;
+#endif
+}
+
+struct pathcache *pathcache_new(size_t max)
+{
+  struct pathcache *pc = malloc(sizeof(struct pathcache));
+  memset(pc, 0, sizeof(struct pathcache));
+  pc->buckets = calloc(PATHCACHE_BUCKETS, sizeof(struct pathcache_entry *));
+  pc->max = max > 0 ? max : 1;
+  return pc;
+}
+
+static void pathcache_unlink(struct pathcache *pc, struct pathcache_entry *e)
+{
+  struct pathcache_entry **p = &pc->buckets[e->hash & (PATHCACHE_BUCKETS - 1)];
+  while (*p != e) {
+    p = &(*p)->chain;
+  }
+  *p = e->chain;
+
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    pc->head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    pc->tail = e->prev;
+  }
+  pc->count--;
+  free(e);
+}
+
+void pathcache_free(struct pathcache *pc)
+{
+  while (pc->head != NULL) {
+    pathcache_unlink(pc, pc->head);
+  }
+  free(pc->buckets);
+  free(pc);
+}
+
+// At least one entry, the least recently used go if there are more
+void pathcache_set_max(struct pathcache *pc, size_t max)
+{
+  pc->max = max > 0 ? max : 1;
+  while (pc->count > pc->max) {
+    pathcache_unlink(pc, pc->tail);
+  }
+}
+
+static void pathcache_push(struct pathcache *pc, struct pathcache_entry *e)
+{
+  e->prev = NULL;
+  e->next = pc->head;
+  if (pc->head != NULL)
+    pc->head->prev = e;
+  else
+    pc->tail = e;
+  pc->head = e;
+}
+
+// The String for path, made and kept if it isn't there yet
+VALUE pathcache_get(struct pathcache *pc, const char *path)
+{
+  size_t len = strlen(path);
+  uint64_t hash = pathcache_hash(path, len);
+  struct pathcache_entry **bucket = &pc->buckets[hash & (PATHCACHE_BUCKETS - 1)];
+  struct pathcache_entry *e;
+
+  for (e = *bucket; e != NULL; e = e->chain) {
+    if (e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0)
+      break;
+  }
+  if (e != NULL) {
+    pc->hits++;
+    if (e->prev != NULL) {
+      //to the front of the lru
+      e->prev->next = e->next;
+      if (e->next != NULL)
+        e->next->prev = e->prev;
+      else
+        pc->tail = e->prev;
+      pathcache_push(pc, e);
+    }
+    return e->str;
+  }
+
+  pc->misses++;
+  while (pc->count >= pc->max && pc->tail != NULL) {
+    pathcache_unlink(pc, pc->tail);
+  }
+  e = malloc(sizeof(struct pathcache_entry) + len + 1);
+  memcpy(e->path, path, len + 1);
+  e->len   = len;
+  e->hash  = hash;
+  e->str   = pathcache_str(path, len);
+  e->chain = *bucket;
+  *bucket  = e;
+  pathcache_push(pc, e);
+  pc->count++;
+  return e->str;
+}
+
+// Drops path, and with tree everything below it
+void pathcache_forget(struct pathcache *pc, const char *path, int tree)
+{
+  struct pathcache_entry *e, *next;
+  size_t len = strlen(path);
+  uint64_t hash;
+
+  if (!tree) {
+    hash = pathcache_hash(path, len);
+    for (e = pc->buckets[hash & (PATHCACHE_BUCKETS - 1)]; e != NULL; e = e->chain) {
+      if (e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0) {
+        pathcache_unlink(pc, e);
+        return;
+      }
+    }
+    return;
+  }
+  for (e = pc->head; e != NULL; e = next) {
+    next = e->next;
+    if (e->len >= len && memcmp(e->path, path, len) == 0 &&
+        (e->len == len || e->path[len] == '/' || (len > 0 && path[len - 1] == '/')))
+      pathcache_unlink(pc, e);
+  }
+}
+
+void pathcache_mark(struct pathcache *pc)
+{
+  struct pathcache_entry *e;
+  for (e = pc->head; e != NULL; e = e->next) {
+    rb_gc_mark(e->str);
+  }
+}
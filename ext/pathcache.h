@@ -0,0 +1,27 @@
+#ifndef _PATHCACHE_H
+#define _PATHCACHE_H
+
+#include <ruby.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct pathcache_entry;
+
+struct pathcache {
+  struct pathcache_entry **buckets;
+  struct pathcache_entry *head; //lru list
+  struct pathcache_entry *tail;
+  size_t count;
+  size_t max;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct pathcache *pathcache_new(size_t max);
+void pathcache_free(struct pathcache *pc);
+void pathcache_set_max(struct pathcache *pc, size_t max);
+VALUE pathcache_get(struct pathcache *pc, const char *path);
+void pathcache_forget(struct pathcache *pc, const char *path, int tree);
+void pathcache_mark(struct pathcache *pc);
+
+#endif
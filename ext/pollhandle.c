@@ -3,6 +3,8 @@
 
 #include "pollhandle.h"
 
+static VALUE cPollHandle;
+
 static int pollhandle_destroy(struct fuse_pollhandle *ph)
 {
   fuse_pollhandle_destroy(ph);
@@ -29,21 +31,16 @@ VALUE pollhandle_notify_poll(VALUE self)
 
 VALUE wrap_pollhandle(struct fuse_pollhandle *ph)
 {
-  VALUE rRFuse;
-  VALUE rPollHandle;
-
-  rRFuse      = rb_const_get(rb_cObject,rb_intern("RFuse"));
-  rPollHandle = rb_const_get(rRFuse,rb_intern("PollHandle"));
-
   // We need a mark function here to ensure the ph is not GC'd
   // between poll and notify_poll
-  return Data_Wrap_Struct(rPollHandle, NULL, pollhandle_destroy, ph);
+  return Data_Wrap_Struct(cPollHandle, NULL, pollhandle_destroy, ph);
 
 }
 
 VALUE pollhandle_init(VALUE module)
 {
-  VALUE cPollHandle = rb_define_class_under(module,"PollHandle",rb_cObject);
+  cPollHandle = rb_define_class_under(module,"PollHandle",rb_cObject);
+  rb_global_variable(&cPollHandle);
 
   rb_define_alloc_func(cPollHandle,pollhandle_new);
 
@@ -0,0 +1,391 @@
+// RFuse::Reactor serves many mounts from one ruby thread. The channels of
+// all registered RFuse::Fuse instances are watched with a single epoll set;
+// when one becomes readable, up to max_per_fd queued commands are drained
+// from it before going back to epoll_wait(). Waiting and draining happen
+// with the GVL released, handlers take it back as in Fuse#loop.
+//
+//   reactor = RFuse::Reactor.new
+//   fuses.each { |f| reactor.register(f) }
+//   reactor.run
+//
+// Each mount's wake pipe is in the set too, so a Fuse#exit on an idle mount
+// is noticed and the mount unregistered.
+//
+// Linux only, and needs rb_thread_call_without_gvl().
+
+#include <ruby.h>
+#include <fuse.h>
+
+#include "reactor.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+
+#include <ruby/thread.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "rfuse.h"
+#include "intern_rfuse.h"
+
+#define RF_REACTOR_EVENTS 64
+#define RF_REACTOR_MAX_PER_FD 64
+
+//epoll data of a mount's wake pipe: the intern_fuse with the low bit set
+#define RF_REACTOR_WAKE_TAG ((uintptr_t) 1)
+
+static VALUE cReactor;
+static VALUE cFuse;
+
+struct reactor {
+  int epfd;
+  int wake[2];           //self-pipe, see Reactor#stop
+  volatile int stopping;
+  VALUE mounts;          //registered Fuse objects
+  VALUE retired;         //unregistered while run was draining, see below
+};
+
+// One epoll_wait() and the draining that follows, run without the GVL
+struct reactor_step {
+  struct reactor *r;
+  int timeout;
+  int max;
+  int count;
+  int nexited;
+  struct intern_fuse *exited[RF_REACTOR_EVENTS];
+  struct epoll_event events[RF_REACTOR_EVENTS];
+};
+
+static void reactor_mark(struct reactor *r)
+{
+  rb_gc_mark(r->mounts);
+  rb_gc_mark(r->retired);
+}
+
+static void reactor_free(struct reactor *r)
+{
+  if (r->epfd >= 0) close(r->epfd);
+  if (r->wake[0] >= 0) close(r->wake[0]);
+  if (r->wake[1] >= 0) close(r->wake[1]);
+  free(r);
+}
+
+static VALUE reactor_alloc(VALUE class)
+{
+  struct reactor *r;
+  VALUE self = Data_Make_Struct(class, struct reactor,
+    reactor_mark, reactor_free, r);
+
+  r->epfd    = -1;
+  r->wake[0] = r->wake[1] = -1;
+  r->mounts  = rb_ary_new();
+  r->retired = rb_ary_new();
+  return self;
+}
+
+static VALUE reactor_initialize(VALUE self)
+{
+  struct reactor *r;
+  struct epoll_event ev;
+  Data_Get_Struct(self, struct reactor, r);
+
+  r->epfd = epoll_create(RF_REACTOR_EVENTS);
+  if (r->epfd < 0) {
+    rb_sys_fail("epoll_create");
+  }
+  fcntl(r->epfd, F_SETFD, FD_CLOEXEC);
+
+  if (pipe(r->wake) < 0) {
+    rb_sys_fail("pipe");
+  }
+  fcntl(r->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(r->wake[1], F_SETFL, O_NONBLOCK);
+
+  //data.ptr NULL is the wake pipe, anything else an intern_fuse or its
+  //wake pipe, see RF_REACTOR_WAKE_TAG
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wake[0], &ev) < 0) {
+    rb_sys_fail("epoll_ctl");
+  }
+  return self;
+}
+
+static struct intern_fuse *reactor_get_fuse(VALUE fuse)
+{
+  struct intern_fuse *inf;
+  if (!rb_obj_is_kind_of(fuse, cFuse)) {
+    rb_raise(rb_eTypeError, "expected an RFuse::Fuse");
+  }
+  Data_Get_Struct(fuse, struct intern_fuse, inf);
+  return inf;
+}
+
+// Stop watching a mount. Its Fuse object is kept alive until the current
+// step is over: a run in another thread may be draining it right now.
+static void reactor_forget(struct reactor *r, VALUE fuse,
+  struct intern_fuse *inf)
+{
+  int fd = intern_fuse_fd(inf);
+  if (fd >= 0) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+  }
+  if (inf->wake[0] >= 0) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, inf->wake[0], NULL);
+  }
+  rfuse_write_deliver_all(inf);
+  rb_ary_delete(r->mounts, fuse);
+  rb_ary_push(r->retired, fuse);
+}
+
+// Reactor#register(fuse): watch a mounted RFuse::Fuse. Its channel is made
+// non-blocking. Returns self.
+static VALUE reactor_register(VALUE self, VALUE fuse)
+{
+  struct reactor *r;
+  struct intern_fuse *inf;
+  struct epoll_event ev;
+  Data_Get_Struct(self, struct reactor, r);
+  inf = reactor_get_fuse(fuse);
+
+  if (rb_ary_includes(r->mounts, fuse) == Qtrue) {
+    return self;
+  }
+
+  if (intern_fuse_prepare_loop(inf) < 0) {
+    rb_raise(rb_eArgError, "%s is not mounted", inf->mountname);
+  }
+
+  ev.events   = EPOLLIN;
+  ev.data.ptr = inf;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, intern_fuse_fd(inf), &ev) < 0) {
+    rb_sys_fail("epoll_ctl");
+  }
+
+  //Fuse#exit writes to it, see reactor_step_nogvl
+  if (inf->wake[0] >= 0) {
+    ev.data.ptr = (void *) ((uintptr_t) inf | RF_REACTOR_WAKE_TAG);
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, inf->wake[0], &ev) < 0) {
+      int e = errno;
+      epoll_ctl(r->epfd, EPOLL_CTL_DEL, intern_fuse_fd(inf), NULL);
+      errno = e;
+      rb_sys_fail("epoll_ctl");
+    }
+    //prepare_loop drained an exit that came before
+    if (intern_fuse_exited(inf)) {
+      intern_fuse_wake(inf);
+    }
+  }
+  rb_ary_push(r->mounts, fuse);
+  return self;
+}
+
+// Reactor#unregister(fuse): stop watching a mount. Returns the Fuse object,
+// or nil if it wasn't registered.
+static VALUE reactor_unregister(VALUE self, VALUE fuse)
+{
+  struct reactor *r;
+  struct intern_fuse *inf;
+  Data_Get_Struct(self, struct reactor, r);
+  inf = reactor_get_fuse(fuse);
+
+  if (rb_ary_includes(r->mounts, fuse) != Qtrue) {
+    return Qnil;
+  }
+  reactor_forget(r, fuse, inf);
+  return fuse;
+}
+
+// Reactor#mounts: the registered Fuse objects
+static VALUE reactor_mounts(VALUE self)
+{
+  struct reactor *r;
+  Data_Get_Struct(self, struct reactor, r);
+  return rb_ary_dup(r->mounts);
+}
+
+static void *reactor_step_nogvl(void *data)
+{
+  struct reactor_step *s = data;
+  struct intern_fuse *inf;
+  uintptr_t tagged;
+  char buf[64];
+  int i, n, res;
+
+  n = epoll_wait(s->r->epfd, s->events, RF_REACTOR_EVENTS, s->timeout);
+  if (n < 0) {
+    //EINTR, the caller checks for interrupts
+    return NULL;
+  }
+
+  for (i = 0; i < n && !s->r->stopping; i++) {
+    inf = s->events[i].data.ptr;
+    if (inf == NULL) {
+      continue;
+    }
+    tagged = (uintptr_t) inf;
+    if (tagged & RF_REACTOR_WAKE_TAG) {
+      inf = (struct intern_fuse *) (tagged & ~RF_REACTOR_WAKE_TAG);
+      if (intern_fuse_exited(inf)) {
+        s->exited[s->nexited++] = inf;
+      } else {
+        //a stale wakeup, don't spin on it
+        while (read(inf->wake[0], buf, sizeof(buf)) > 0);
+      }
+      continue;
+    }
+    res = rfuse_process_nogvl(inf, s->max);
+    if (res > 0) {
+      s->count += res;
+    }
+    if (res < 0 || intern_fuse_exited(inf)) {
+      s->exited[s->nexited++] = inf;
+    }
+  }
+  return NULL;
+}
+
+// Wait up to timeout ms (-1: forever) and drain the ready channels. Mounts
+// that went away are unregistered. Returns the number of commands processed.
+// The mounts count as being served throughout (see rfuse_loop_enter), so a
+// Fuse#unmount meanwhile waits for the step to be over.
+static int reactor_step(struct reactor *r, int timeout, int max)
+{
+  struct reactor_step s;
+  struct intern_fuse *inf;
+  VALUE entered, fuse;
+  long i;
+
+  s.r       = r;
+  s.timeout = timeout;
+  s.max     = max;
+  s.count   = 0;
+  s.nexited = 0;
+
+  entered = rb_ary_dup(r->mounts);
+  for (i = 0; i < RARRAY_LEN(entered); i++) {
+    rfuse_loop_enter(reactor_get_fuse(RARRAY_PTR(entered)[i]));
+  }
+
+  //no interrupt may be raised before the mounts are left again
+  rb_thread_call_without_gvl2(reactor_step_nogvl, &s, RUBY_UBF_IO, NULL);
+
+  for (i = 0; i < s.nexited; i++) {
+    fuse = (VALUE) s.exited[i]->handler;
+    if (rb_ary_includes(r->mounts, fuse) == Qtrue) {
+      reactor_forget(r, fuse, s.exited[i]);
+    }
+  }
+  for (i = 0; i < RARRAY_LEN(entered); i++) {
+    fuse = RARRAY_PTR(entered)[i];
+    inf  = reactor_get_fuse(fuse);
+    if (intern_fuse_exited(inf) && rb_ary_includes(r->mounts, fuse) == Qtrue) {
+      reactor_forget(r, fuse, inf);
+    }
+    rfuse_loop_leave(inf);
+  }
+  rb_ary_clear(r->retired);
+  RB_GC_GUARD(entered);
+
+  rb_thread_check_ints();
+  return s.count;
+}
+
+static int reactor_max_per_fd(VALUE rmax)
+{
+  int max = NIL_P(rmax) ? RF_REACTOR_MAX_PER_FD : NUM2INT(rmax);
+  if (max < 1) {
+    rb_raise(rb_eArgError, "max_per_fd must be at least 1");
+  }
+  return max;
+}
+
+static void reactor_drain_wake(struct reactor *r)
+{
+  char buf[64];
+  while (read(r->wake[0], buf, sizeof(buf)) > 0);
+}
+
+// Reactor#run(max_per_fd = 64): serve the registered mounts until all of
+// them are gone or Reactor#stop is called
+static VALUE reactor_run(int argc, VALUE *argv, VALUE self)
+{
+  struct reactor *r;
+  VALUE rmax;
+  int max;
+
+  rb_scan_args(argc, argv, "01", &rmax);
+  max = reactor_max_per_fd(rmax);
+  Data_Get_Struct(self, struct reactor, r);
+
+  r->stopping = 0;
+  reactor_drain_wake(r);
+
+  while (!r->stopping && RARRAY_LEN(r->mounts) > 0) {
+    reactor_step(r, -1, max);
+  }
+  return Qnil;
+}
+
+// Reactor#run_once(timeout = nil, max_per_fd = 64): wait at most timeout
+// seconds (nil: until something happens) and drain whatever is ready.
+// Returns the number of commands processed.
+static VALUE reactor_run_once(int argc, VALUE *argv, VALUE self)
+{
+  struct reactor *r;
+  VALUE rtimeout, rmax;
+  int timeout, max;
+
+  rb_scan_args(argc, argv, "02", &rtimeout, &rmax);
+  timeout = NIL_P(rtimeout) ? -1 : (int) (NUM2DBL(rtimeout) * 1000);
+  max = reactor_max_per_fd(rmax);
+  Data_Get_Struct(self, struct reactor, r);
+
+  r->stopping = 0;
+  reactor_drain_wake(r);
+
+  return INT2NUM(reactor_step(r, timeout, max));
+}
+
+// Reactor#stop: make run return, may be called from any thread or handler
+static VALUE reactor_stop(VALUE self)
+{
+  struct reactor *r;
+  Data_Get_Struct(self, struct reactor, r);
+
+  r->stopping = 1;
+  if (write(r->wake[1], "x", 1) < 0) {
+    //full pipe, it is awake already
+  }
+  return self;
+}
+
+VALUE reactor_init(VALUE module)
+{
+  cFuse    = rb_const_get(module, rb_intern("Fuse"));
+  cReactor = rb_define_class_under(module, "Reactor", rb_cObject);
+  rb_global_variable(&cReactor);
+  rb_global_variable(&cFuse);
+
+  rb_define_alloc_func(cReactor, reactor_alloc);
+  rb_define_method(cReactor, "initialize", reactor_initialize, 0);
+  rb_define_method(cReactor, "register", reactor_register, 1);
+  rb_define_method(cReactor, "unregister", reactor_unregister, 1);
+  rb_define_method(cReactor, "mounts", reactor_mounts, 0);
+  rb_define_method(cReactor, "run", reactor_run, -1);
+  rb_define_method(cReactor, "run_once", reactor_run_once, -1);
+  rb_define_method(cReactor, "stop", reactor_stop, 0);
+  return cReactor;
+}
+
+#else
+
+// No epoll or no way to release the GVL: RFuse::Reactor isn't defined
+VALUE reactor_init(VALUE module)
+{
+  return Qnil;
+}
+
+#endif
@@ -0,0 +1,3 @@
+#include <ruby.h>
+
+VALUE reactor_init(VALUE module);
@@ -0,0 +1,134 @@
+// Read-ahead for Fuse#readahead=. Once an open file is read sequentially,
+// read asks the handler for more than the kernel did, twice as much on
+// every further miss up to the mount's maximum, and serves the next reads
+// from what came back. A seek starts over with no prefetch.
+//
+// Nothing in here touches ruby; everything runs with the GVL held, except
+// that the handler may let it go while a prefetch runs (busy).
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "readahead.h"
+
+struct readahead *readahead_new()
+{
+  struct readahead *ra = malloc(sizeof(struct readahead));
+  memset(ra, 0, sizeof(struct readahead));
+  return ra;
+}
+
+// Whatever is left unread is wasted
+void readahead_drop(struct readahead *ra, struct readahead_stats *st)
+{
+  off_t end = ra->start + (off_t) ra->len;
+  if (ra->buf != NULL) {
+    if (ra->seen < end)
+      st->wasted += end - (ra->seen > ra->start ? ra->seen : ra->start);
+    free(ra->buf);
+  }
+  ra->buf = NULL;
+  ra->len = 0;
+  ra->eof = 0;
+  ra->gen++;
+}
+
+void readahead_free(struct readahead *ra, struct readahead_stats *st)
+{
+  readahead_drop(ra, st);
+  free(ra->path);
+  free(ra);
+}
+
+// The file is read as path: writes through other handles find it by that
+void readahead_path(struct readahead *ra, const char *path)
+{
+  if (ra->path == NULL || strcmp(ra->path, path) != 0) {
+    free(ra->path);
+    ra->path = strdup(path);
+  }
+}
+
+// ra was read as path, or with tree as something below it
+int readahead_match(struct readahead *ra, const char *path, int tree)
+{
+  size_t len = strlen(path);
+  if (ra->path == NULL) {
+    return 0;
+  }
+  if (!tree) {
+    return strcmp(ra->path, path) == 0;
+  }
+  return strncmp(ra->path, path, len) == 0 &&
+    (ra->path[len] == '\0' || ra->path[len] == '/' ||
+     (len > 0 && path[len - 1] == '/'));
+}
+
+// Copies [offset, offset + size) from the buffer, less at end of file.
+// -1 if it isn't all there: the caller reads from the handler.
+long readahead_get(struct readahead *ra, char *buf, size_t size,
+  off_t offset, struct readahead_stats *st)
+{
+  off_t end = ra->start + (off_t) ra->len;
+  size_t n;
+
+  if (ra->buf == NULL || offset < ra->start || offset > end ||
+      (offset + (off_t) size > end && !ra->eof)) {
+    st->misses++;
+    return -1;
+  }
+  n = offset + (off_t) size > end ? (size_t) (end - offset) : size;
+  memcpy(buf, ra->buf + (offset - ra->start), n);
+  ra->next = offset + n;
+  if (ra->next > ra->seen)
+    ra->seen = ra->next;
+  st->hits++;
+  return n;
+}
+
+// How much to ask the handler for a read of size at offset: size after a
+// seek or while another prefetch runs, twice the last window otherwise
+size_t readahead_window(struct readahead *ra, off_t offset, size_t size,
+  size_t max)
+{
+  size_t window;
+
+  if (ra->busy) {
+    return size;
+  }
+  if (offset != ra->next) {
+    ra->window = 0;
+    ra->next   = offset + size;
+    return size;
+  }
+  window = ra->window > 0 ? ra->window * 2 : size * 2;
+  if (window > max)
+    window = max;
+  if (window < size)
+    window = size;
+  ra->window = window;
+  return window;
+}
+
+// The handler answered len of the asked bytes at offset into buf (malloc'ed,
+// taken over), of which used went to the kernel. Dropped if the file was
+// written meanwhile (gen).
+void readahead_fill(struct readahead *ra, char *buf, size_t len,
+  size_t asked, off_t offset, size_t used, unsigned gen,
+  struct readahead_stats *st)
+{
+  ra->next = offset + used;
+  if (len > used)
+    st->prefetched += len - used;
+  if (gen != ra->gen) {
+    st->wasted += len > used ? len - used : 0;
+    free(buf);
+    return;
+  }
+  readahead_drop(ra, st);
+  ra->buf   = buf;
+  ra->start = offset;
+  ra->len   = len;
+  ra->seen  = offset + used;
+  ra->eof   = len < asked;
+}
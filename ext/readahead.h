@@ -0,0 +1,43 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// What an open file read ahead, see readahead.c
+struct readahead {
+  char   *buf;
+  off_t  start;  //buf holds [start, start + len)
+  size_t len;
+  off_t  seen;   //end of what was read from buf, the rest is wasted
+  off_t  next;   //where a sequential read starts
+  size_t window; //what the last prefetch asked for, 0 after a seek
+  int    eof;    //the handler had nothing past start + len
+  int    busy;   //a prefetch is running
+  unsigned gen;  //bumped by readahead_drop
+  char   *path;  //of the last read, see readahead_match
+};
+
+// Per mount, Fuse#readahead_stats
+struct readahead_stats {
+  uint64_t hits;       //reads served from a buffer
+  uint64_t misses;     //and not
+  uint64_t prefetched; //bytes read beyond what was asked for
+  uint64_t wasted;     //of those, never read
+};
+
+struct readahead *readahead_new();
+void readahead_free(struct readahead *ra, struct readahead_stats *st);
+long readahead_get(struct readahead *ra, char *buf, size_t size,
+  off_t offset, struct readahead_stats *st);
+size_t readahead_window(struct readahead *ra, off_t offset, size_t size,
+  size_t max);
+void readahead_fill(struct readahead *ra, char *buf, size_t len,
+  size_t asked, off_t offset, size_t used, unsigned gen,
+  struct readahead_stats *st);
+void readahead_drop(struct readahead *ra, struct readahead_stats *st);
+void readahead_path(struct readahead *ra, const char *path);
+int readahead_match(struct readahead *ra, const char *path, int tree);
+
+#endif
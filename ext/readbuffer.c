@@ -0,0 +1,205 @@
+// RFuse::ReadBuffer is what read_into() fills. It points straight at the
+// buffer libfuse replies from, so the data doesn't go through a ruby String
+// on its way to the kernel. It is only valid while read_into runs; every
+// fiber keeps one instance and points it at the next request.
+
+#include <ruby.h>
+#include <fuse.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include <ruby/io/buffer.h>
+#endif
+
+#include "readbuffer.h"
+
+static VALUE cReadBuffer;
+static ID id_readbuffer;
+static ID id_fileno;
+
+struct readbuffer {
+  char   *ptr;  //NULL outside of read_into
+  size_t size;
+  VALUE  view;  //IO::Buffer handed out by io_buffer, or nil
+};
+
+static void readbuffer_mark(struct readbuffer *rb)
+{
+  rb_gc_mark(rb->view);
+}
+
+static VALUE readbuffer_new(VALUE class)
+{
+  rb_raise(rb_eNotImpError, "new() not implemented (it has no use), and should not be called");
+  return Qnil;
+}
+
+// The calling fiber's ReadBuffer, pointed at buf
+VALUE readbuffer_get(char *buf, size_t size)
+{
+  struct readbuffer *rb;
+  VALUE self = rb_thread_local_aref(rb_thread_current(), id_readbuffer);
+
+  if (NIL_P(self)) {
+    self = Data_Make_Struct(cReadBuffer, struct readbuffer,
+      readbuffer_mark, free, rb);
+    rb->view = Qnil;
+    rb_thread_local_aset(rb_thread_current(), id_readbuffer, self);
+  }
+  Data_Get_Struct(self, struct readbuffer, rb);
+  rb->ptr  = buf;
+  rb->size = size;
+  return self;
+}
+
+// The request is over, libfuse may reuse the memory
+void readbuffer_release(VALUE self)
+{
+  struct readbuffer *rb;
+  Data_Get_Struct(self, struct readbuffer, rb);
+  rb->ptr  = NULL;
+  rb->size = 0;
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  if (!NIL_P(rb->view)) {
+    rb_io_buffer_free(rb->view);
+    rb->view = Qnil;
+  }
+#endif
+}
+
+static struct readbuffer *readbuffer_check(VALUE self)
+{
+  struct readbuffer *rb;
+  Data_Get_Struct(self, struct readbuffer, rb);
+  if (rb->ptr == NULL) {
+    rb_raise(rb_eRuntimeError, "read buffer used outside of read_into");
+  }
+  return rb;
+}
+
+static size_t readbuffer_offset(struct readbuffer *rb, VALUE roffset)
+{
+  long offset = NIL_P(roffset) ? 0 : NUM2LONG(roffset);
+  if (offset < 0 || (size_t) offset > rb->size) {
+    rb_raise(rb_eArgError, "offset %ld outside of the buffer", offset);
+  }
+  return offset;
+}
+
+VALUE readbuffer_size(VALUE self)
+{
+  return SIZET2NUM(readbuffer_check(self)->size);
+}
+
+// write(data, offset = 0): copy as much of data as fits at offset, returns
+// the number of bytes copied
+VALUE readbuffer_write(int argc, VALUE *argv, VALUE self)
+{
+  struct readbuffer *rb = readbuffer_check(self);
+  VALUE data, roffset;
+  size_t offset, len;
+
+  rb_scan_args(argc, argv, "11", &data, &roffset);
+  StringValue(data);
+  offset = readbuffer_offset(rb, roffset);
+
+  len = RSTRING_LEN(data);
+  if (len > rb->size - offset) {
+    len = rb->size - offset;
+  }
+  memcpy(rb->ptr + offset, RSTRING_PTR(data), len);
+  return SIZET2NUM(len);
+}
+
+struct readbuffer_pread {
+  int     fd;
+  char    *ptr;
+  size_t  len;
+  off_t   from;
+  ssize_t res;
+  int     err;
+};
+
+static void *readbuffer_pread_nogvl(void *data)
+{
+  struct readbuffer_pread *p = data;
+  p->res = pread(p->fd, p->ptr, p->len, p->from);
+  p->err = errno;
+  return NULL;
+}
+
+// pread(io, from, offset = 0): fill the buffer from io (an IO or a file
+// descriptor) at position from, without the GVL. Stops at end of file,
+// returns the number of bytes read.
+VALUE readbuffer_pread(int argc, VALUE *argv, VALUE self)
+{
+  struct readbuffer *rb = readbuffer_check(self);
+  struct readbuffer_pread p;
+  VALUE io, from, roffset;
+  size_t offset, total = 0;
+
+  rb_scan_args(argc, argv, "21", &io, &from, &roffset);
+  offset = readbuffer_offset(rb, roffset);
+  p.fd   = FIXNUM_P(io) ? FIX2INT(io) : NUM2INT(rb_funcall(io, id_fileno, 0));
+  p.from = NUM2OFFT(from);
+
+  while (offset + total < rb->size) {
+    p.ptr = rb->ptr + offset + total;
+    p.len = rb->size - offset - total;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(readbuffer_pread_nogvl, &p, RUBY_UBF_IO, NULL);
+#else
+    readbuffer_pread_nogvl(&p);
+#endif
+    if (p.res < 0) {
+      if (p.err == EINTR) {
+        rb_thread_check_ints();
+        continue;
+      }
+      errno = p.err;
+      rb_sys_fail("pread");
+    }
+    if (p.res == 0) {
+      break;
+    }
+    total  += p.res;
+    p.from += p.res;
+  }
+  return SIZET2NUM(total);
+}
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+// io_buffer: the same memory as an IO::Buffer, e.g. for IO#pread or
+// IO::Buffer#set_string. Freed when read_into returns.
+VALUE readbuffer_io_buffer(VALUE self)
+{
+  struct readbuffer *rb = readbuffer_check(self);
+  if (NIL_P(rb->view)) {
+    rb->view = rb_io_buffer_new(rb->ptr, rb->size, RB_IO_BUFFER_EXTERNAL);
+  }
+  return rb->view;
+}
+#endif
+
+VALUE readbuffer_init(VALUE module)
+{
+  id_readbuffer = rb_intern("__rfuse_readbuffer");
+  id_fileno     = rb_intern("fileno");
+
+  cReadBuffer = rb_define_class_under(module, "ReadBuffer", rb_cObject);
+  rb_global_variable(&cReadBuffer);
+  rb_define_alloc_func(cReadBuffer, readbuffer_new);
+
+  rb_define_method(cReadBuffer, "size", readbuffer_size, 0);
+  rb_define_method(cReadBuffer, "write", readbuffer_write, -1);
+  rb_define_method(cReadBuffer, "pread", readbuffer_pread, -1);
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  rb_define_method(cReadBuffer, "io_buffer", readbuffer_io_buffer, 0);
+#endif
+  return cReadBuffer;
+}
@@ -0,0 +1,7 @@
+#include <fuse.h>
+#include <ruby.h>
+
+VALUE readbuffer_get(char *buf, size_t size);
+void readbuffer_release(VALUE self);
+
+VALUE readbuffer_init(VALUE module);
@@ -0,0 +1,361 @@
+#include <ruby.h>
+#include <fuse.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "request.h"
+#include "helper.h"
+#include "context.h"
+#include "file_info.h"
+#include "passthrough.h"
+
+static VALUE cRequest;
+
+static void request_unlink(struct request *r)
+{
+  if (r->ll == NULL) {
+    return;
+  }
+  if (r->prev != NULL) {
+    r->prev->next = r->next;
+  } else {
+    r->ll->pending = r->next;
+  }
+  if (r->next != NULL) {
+    r->next->prev = r->prev;
+  }
+  r->ll   = NULL;
+  r->prev = r->next = NULL;
+}
+
+// A request dropped without a reply would leave the calling process hanging
+static void request_free(struct request *r)
+{
+  if (r->req != NULL) {
+    fuse_reply_err(r->req, EIO);
+  }
+  request_unlink(r);
+  free(r);
+}
+
+VALUE wrap_request(struct intern_lowlevel *ll, fuse_req_t req)
+{
+  struct request *r;
+  VALUE self = Data_Make_Struct(cRequest, struct request, 0, request_free, r);
+
+  r->req  = req;
+  r->size = 0;
+  r->ll   = ll;
+  r->prev = NULL;
+  r->next = ll->pending;
+  if (ll->pending != NULL) {
+    ll->pending->prev = r;
+  }
+  ll->pending = r;
+  return self;
+}
+
+void request_set_size(VALUE self, size_t size)
+{
+  struct request *r;
+  Data_Get_Struct(self, struct request, r);
+  r->size = size;
+}
+
+// The mount goes away: the requests that weren't replied to get ENODEV
+// while the channel is still there, a reply later on raises
+void request_detach_all(struct intern_lowlevel *ll)
+{
+  struct request *r;
+  while ((r = ll->pending) != NULL) {
+    fuse_reply_err(r->req, ENODEV);
+    r->req = NULL;
+    request_unlink(r);
+  }
+}
+
+static struct request *request_get(VALUE self)
+{
+  struct request *r;
+  Data_Get_Struct(self, struct request, r);
+  if (r->req == NULL) {
+    rb_raise(rb_eRuntimeError, "request has been replied to already");
+  }
+  return r;
+}
+
+// Take the fuse_req_t out for the one reply it gets
+static fuse_req_t request_done(struct request *r)
+{
+  fuse_req_t req = r->req;
+  r->req = NULL;
+  request_unlink(r);
+  return req;
+}
+
+int request_pending(VALUE self)
+{
+  struct request *r;
+  Data_Get_Struct(self, struct request, r);
+  return r->req != NULL;
+}
+
+void request_reply_err(VALUE self, int err)
+{
+  struct request *r;
+  Data_Get_Struct(self, struct request, r);
+  if (r->req != NULL) {
+    fuse_reply_err(request_done(r), err);
+  }
+}
+
+// fi.passthrough = io was set: register io as backing file, if the kernel
+// agreed to passthrough in init. Otherwise the handler keeps getting read
+// and write for this file, fi.passthrough? tells.
+static void request_backing(struct request *r, VALUE rfi,
+  struct fuse_file_info *fi)
+{
+  int fd = file_info_take_backing_fd(rfi);
+#ifdef RFUSE_PASSTHROUGH
+  int id;
+  if (fd >= 0 && r->ll->passthrough) {
+    id = passthrough_open(intern_lowlevel_fd(r->ll), fd);
+    if (id > 0) {
+      fi->backing_id = id;
+    }
+  }
+#endif
+  //the backing id holds on to the file
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+static VALUE request_new(VALUE class)
+{
+  rb_raise(rb_eNotImpError, "new() not implemented (it has no use), and should not be called");
+  return Qnil;
+}
+
+VALUE request_reply_err_m(VALUE self, VALUE err)
+{
+  int e = NUM2INT(err);
+  struct request *r = request_get(self);
+  fuse_reply_err(request_done(r), e < 0 ? -e : e);
+  return Qnil;
+}
+
+VALUE request_reply_none(VALUE self)
+{
+  struct request *r = request_get(self);
+  fuse_reply_none(request_done(r));
+  return Qnil;
+}
+
+// reply_attr(stat, timeout = 1.0): timeout is how long, in seconds, the
+// kernel may cache the attributes
+VALUE request_reply_attr(int argc, VALUE *argv, VALUE self)
+{
+  struct request *r = request_get(self);
+  struct stat st;
+  VALUE rstat, rtimeout;
+
+  rb_scan_args(argc, argv, "11", &rstat, &rtimeout);
+  memset(&st, 0, sizeof(struct stat));
+  rstat2stat(rstat, &st);
+
+  fuse_reply_attr(request_done(r), &st,
+    NIL_P(rtimeout) ? 1.0 : NUM2DBL(rtimeout));
+  return Qnil;
+}
+
+// stat nil makes a negative entry: the kernel remembers for entry_timeout
+// that the name doesn't exist
+static void request_entry_param(struct fuse_entry_param *e, VALUE rstat,
+  VALUE rentry_timeout, VALUE rattr_timeout)
+{
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  if (!NIL_P(rstat)) {
+    rstat2stat(rstat, &e->attr);
+    e->ino = e->attr.st_ino;
+  }
+  e->entry_timeout = NIL_P(rentry_timeout) ? 1.0 : NUM2DBL(rentry_timeout);
+  e->attr_timeout  = NIL_P(rattr_timeout)  ? 1.0 : NUM2DBL(rattr_timeout);
+}
+
+// reply_entry(stat, entry_timeout = 1.0, attr_timeout = 1.0): answers
+// lookup, mknod, mkdir, symlink and link. stat.ino is the inode number the
+// kernel will use from now on, it counts one lookup for forget().
+VALUE request_reply_entry(int argc, VALUE *argv, VALUE self)
+{
+  struct request *r = request_get(self);
+  struct fuse_entry_param e;
+  VALUE rstat, rentry_timeout, rattr_timeout;
+
+  rb_scan_args(argc, argv, "12", &rstat, &rentry_timeout, &rattr_timeout);
+  request_entry_param(&e, rstat, rentry_timeout, rattr_timeout);
+
+  fuse_reply_entry(request_done(r), &e);
+  return Qnil;
+}
+
+// reply_create(stat, fi, entry_timeout = 1.0, attr_timeout = 1.0)
+VALUE request_reply_create(int argc, VALUE *argv, VALUE self)
+{
+  struct request *r = request_get(self);
+  struct fuse_entry_param e;
+  struct fuse_file_info *fi;
+  VALUE rstat, rfi, rentry_timeout, rattr_timeout;
+
+  rb_scan_args(argc, argv, "22", &rstat, &rfi,
+    &rentry_timeout, &rattr_timeout);
+  fi = file_info_get(rfi);
+  if (NIL_P(rstat)) {
+    rb_raise(rb_eArgError, "create needs a stat");
+  }
+  request_entry_param(&e, rstat, rentry_timeout, rattr_timeout);
+  request_backing(r, rfi, fi);
+
+  fuse_reply_create(request_done(r), &e, fi);
+  return Qnil;
+}
+
+// reply_dir(entries): answers readdir with [name, ino, mode, next_offset]
+// arrays, the kernel asks again from the last next_offset. Entries that
+// don't fit into the requested size are left out. Returns how many were
+// sent.
+VALUE request_reply_dir(VALUE self, VALUE entries)
+{
+  struct request *r = request_get(self);
+  struct stat st;
+  VALUE rbuf;
+  char *buf;
+  size_t len = 0, entlen;
+  long i;
+
+  Check_Type(entries, T_ARRAY);
+  if (r->size == 0) {
+    rb_raise(rb_eRuntimeError, "not a readdir request");
+  }
+  rbuf = rb_str_buf_new(r->size);
+  buf  = RSTRING_PTR(rbuf);
+  memset(&st, 0, sizeof(struct stat));
+
+  for (i = 0; i < RARRAY_LEN(entries); i++) {
+    VALUE ent = rb_ary_entry(entries, i);
+    VALUE name;
+
+    Check_Type(ent, T_ARRAY);
+    name = rb_ary_entry(ent, 0);
+    st.st_ino  = NUM2ULL(rb_ary_entry(ent, 1));
+    st.st_mode = NUM2UINT(rb_ary_entry(ent, 2));
+
+    entlen = fuse_add_direntry(r->req, buf + len, r->size - len,
+      StringValueCStr(name), &st, NUM2OFFT(rb_ary_entry(ent, 3)));
+    if (entlen > r->size - len) {
+      break;
+    }
+    len += entlen;
+  }
+
+  fuse_reply_buf(request_done(r), buf, len);
+  RB_GC_GUARD(rbuf);
+  return INT2NUM(i);
+}
+
+VALUE request_reply_readlink(VALUE self, VALUE link)
+{
+  struct request *r = request_get(self);
+  fuse_reply_readlink(request_done(r), StringValueCStr(link));
+  return Qnil;
+}
+
+// reply_open(fi): fi.fh is handed back with every request on the file, it
+// has to be an Integer. A file bound with fi.passthrough = io is handed to
+// the kernel, release drops it again.
+VALUE request_reply_open(VALUE self, VALUE rfi)
+{
+  struct request *r = request_get(self);
+  struct fuse_file_info *fi = file_info_get(rfi);
+  request_backing(r, rfi, fi);
+  fuse_reply_open(request_done(r), fi);
+  return Qnil;
+}
+
+VALUE request_reply_data(VALUE self, VALUE data)
+{
+  struct request *r = request_get(self);
+  StringValue(data);
+  fuse_reply_buf(request_done(r), RSTRING_PTR(data), RSTRING_LEN(data));
+  return Qnil;
+}
+
+VALUE request_reply_write(VALUE self, VALUE count)
+{
+  struct request *r = request_get(self);
+  fuse_reply_write(request_done(r), NUM2SIZET(count));
+  return Qnil;
+}
+
+VALUE request_reply_statfs(VALUE self, VALUE rstatvfs)
+{
+  struct request *r = request_get(self);
+  struct statvfs st;
+
+  memset(&st, 0, sizeof(struct statvfs));
+  rstatvfs2statvfs(rstatvfs, &st);
+  fuse_reply_statfs(request_done(r), &st);
+  return Qnil;
+}
+
+VALUE request_replied(VALUE self)
+{
+  return request_pending(self) ? Qfalse : Qtrue;
+}
+
+VALUE request_interrupted(VALUE self)
+{
+  struct request *r;
+  Data_Get_Struct(self, struct request, r);
+  if (r->req == NULL) {
+    return Qfalse;
+  }
+  return fuse_req_interrupted(r->req) ? Qtrue : Qfalse;
+}
+
+// The caller's uid, gid and pid
+VALUE request_context(VALUE self)
+{
+  struct request *r = request_get(self);
+  const struct fuse_ctx *rctx = fuse_req_ctx(r->req);
+  struct fuse_context ctx;
+
+  memset(&ctx, 0, sizeof(struct fuse_context));
+  ctx.uid = rctx->uid;
+  ctx.gid = rctx->gid;
+  ctx.pid = rctx->pid;
+  return wrap_context(&ctx);
+}
+
+VALUE request_init(VALUE module)
+{
+  cRequest = rb_define_class_under(module, "Request", rb_cObject);
+  rb_global_variable(&cRequest);
+  rb_define_alloc_func(cRequest, request_new);
+  rb_define_method(cRequest, "reply_err", request_reply_err_m, 1);
+  rb_define_method(cRequest, "reply_none", request_reply_none, 0);
+  rb_define_method(cRequest, "reply_attr", request_reply_attr, -1);
+  rb_define_method(cRequest, "reply_entry", request_reply_entry, -1);
+  rb_define_method(cRequest, "reply_create", request_reply_create, -1);
+  rb_define_method(cRequest, "reply_dir", request_reply_dir, 1);
+  rb_define_method(cRequest, "reply_readlink", request_reply_readlink, 1);
+  rb_define_method(cRequest, "reply_open", request_reply_open, 1);
+  rb_define_method(cRequest, "reply_data", request_reply_data, 1);
+  rb_define_method(cRequest, "reply_write", request_reply_write, 1);
+  rb_define_method(cRequest, "reply_statfs", request_reply_statfs, 1);
+  rb_define_method(cRequest, "replied?", request_replied, 0);
+  rb_define_method(cRequest, "interrupted?", request_interrupted, 0);
+  rb_define_method(cRequest, "context", request_context, 0);
+  return cRequest;
+}
@@ -0,0 +1,24 @@
+#include <fuse.h>
+#include <ruby.h>
+
+#include "intern_lowlevel.h"
+
+// A request handed to a LowLevel handler. It stays on its mount's pending
+// list until it is replied to; the mount answers and detaches the leftovers
+// when it is unmounted or goes away, so that nothing replies through a
+// destroyed channel or session.
+struct request {
+  fuse_req_t req; //NULL once replied to or detached
+  size_t size;    //readdir: how much the reply may hold
+  struct intern_lowlevel *ll;
+  struct request *prev;
+  struct request *next;
+};
+
+VALUE wrap_request(struct intern_lowlevel *ll, fuse_req_t req);
+void request_set_size(VALUE self, size_t size);
+int request_pending(VALUE self);
+void request_reply_err(VALUE self, int err);
+void request_detach_all(struct intern_lowlevel *ll);
+
+VALUE request_init(VALUE module);
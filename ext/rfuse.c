@@ -10,6 +10,10 @@
 #include <ruby.h>
 #include <fuse.h>
 #include <errno.h>
+#include <unistd.h>
+#include <utime.h>
+#include <time.h>
+#include <stdarg.h>
 #ifdef HAVE_SYS_STATFS_H
 #include <sys/statfs.h>
 #endif
@@ -28,9 +32,202 @@
 #include "file_info.h"
 #include "pollhandle.h"
 #include "bufferwrapper.h"
+#include "readbuffer.h"
+#include "passthrough.h"
+#include "attrcache.h"
+#include "pathcache.h"
+#include "readahead.h"
+#include "writebehind.h"
+#include "rstat.h"
+
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include <ruby/fiber/scheduler.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include <ruby/io/buffer.h>
+#endif
+
+//----------------------DISPATCH TABLE
+// Everything the trampolines used to look up on each request. The method
+// ids and the Struct classes are built once in rfuse_init(), the per-handler
+// op mask is filled in rf_initialize().
+
+enum rf_op {
+  RF_OP_GETATTR, RF_OP_READLINK, RF_OP_GETDIR, RF_OP_MKNOD, RF_OP_MKDIR,
+  RF_OP_UNLINK, RF_OP_RMDIR, RF_OP_SYMLINK, RF_OP_RENAME, RF_OP_LINK,
+  RF_OP_CHMOD, RF_OP_CHOWN, RF_OP_TRUNCATE, RF_OP_UTIME, RF_OP_OPEN,
+  RF_OP_READ, RF_OP_WRITE, RF_OP_STATFS, RF_OP_FLUSH, RF_OP_RELEASE,
+  RF_OP_FSYNC, RF_OP_SETXATTR, RF_OP_GETXATTR, RF_OP_LISTXATTR,
+  RF_OP_REMOVEXATTR, RF_OP_OPENDIR, RF_OP_READDIR, RF_OP_RELEASEDIR,
+  RF_OP_FSYNCDIR, RF_OP_INIT, RF_OP_DESTROY, RF_OP_ACCESS, RF_OP_CREATE,
+  RF_OP_FTRUNCATE, RF_OP_FGETATTR, RF_OP_LOCK, RF_OP_UTIMENS, RF_OP_BMAP,
+  RF_OP_IOCTL, RF_OP_POLL, RF_OP_READ_INTO, RF_OP_READ_BUF, RF_OP_WRITE_BUF,
+  RF_OP_MAX
+};
+
+// Same order as enum rf_op
+static const char *rf_op_names[RF_OP_MAX] = {
+  "getattr", "readlink", "getdir", "mknod", "mkdir",
+  "unlink", "rmdir", "symlink", "rename", "link",
+  "chmod", "chown", "truncate", "utime", "open",
+  "read", "write", "statfs", "flush", "release",
+  "fsync", "setxattr", "getxattr", "listxattr",
+  "removexattr", "opendir", "readdir", "releasedir",
+  "fsyncdir", "init", "destroy", "access", "create",
+  "ftruncate", "fgetattr", "lock", "utimens", "bmap",
+  "ioctl", "poll", "read_into", "read_buf", "write_buf"
+};
+
+// The arguments each callback gets, ctx included, and where the FileInfo
+// is among them (-1: none). Same order as enum rf_op.
+static const signed char rf_op_argc[RF_OP_MAX] = {
+  2, 3, 3, 4, 3,
+  2, 2, 3, 3, 3,
+  3, 4, 3, 4, 3,
+  5, 5, 2, 3, 3,
+  4, 6, 4, 3,
+  3, 3, 5, 3,
+  4, 2, 2, 3, 4,
+  4, 3, 5, 4, 4,
+  7, 5, 6, 5, 5
+};
+
+static const signed char rf_op_ffi[RF_OP_MAX] = {
+  -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, 2,
+  4, 4, -1, 2, 2,
+  3, -1, -1, -1,
+  -1, 2, 4, 2,
+  3, -1, -1, -1, 3,
+  3, 2, 2, -1, -1,
+  4, 2, 5, 4, 4
+};
+
+static ID rf_op_ids[RF_OP_MAX];
+
+static ID id_errno;
+static ID id_backtrace;
+
+// Struct classes handed to init() and lock()
+static VALUE cConnInfo;
+static VALUE cFlock;
+
+// Every mount passes its intern_fuse to fuse_new() as user_data, libfuse
+// hands it back in the context of each callback. Outside of one libfuse 3
+// may have no context for the thread, see rf_serve.
+static __thread struct intern_fuse *rf_serving;
+
+static struct intern_fuse *rf_current()
+{
+  struct fuse_context *ctx = fuse_get_context();
+  return ctx != NULL ? (struct intern_fuse *) ctx->private_data : rf_serving;
+}
+
+// Calls handlers for inf outside of a libfuse callback (rf_write_deliver_all):
+// the thread's context is pointed at inf until rf_serve_end
+struct rf_serve {
+  struct fuse_context *ctx;
+  struct fuse_context saved;
+  struct intern_fuse *serving;
+};
+
+static void rf_serve(struct rf_serve *sv, struct intern_fuse *inf)
+{
+  sv->ctx     = fuse_get_context();
+  sv->serving = rf_serving;
+  rf_serving  = inf;
+  if (sv->ctx != NULL) {
+    sv->saved = *sv->ctx;
+    memset(sv->ctx, 0, sizeof(struct fuse_context));
+    sv->ctx->fuse         = inf->fuse;
+    sv->ctx->private_data = inf;
+  }
+}
+
+static void rf_serve_end(struct rf_serve *sv)
+{
+  if (sv->ctx != NULL)
+    *sv->ctx = sv->saved;
+  rf_serving = sv->serving;
+}
+
+#define RF_OP_BIT(op) (((uint64_t) 1) << (op))
+#define RESPOND_TO(inf,op) ((inf)->ops & RF_OP_BIT(op))
+
+// Calls the handler's op with the full argument list, ctx first. A handler
+// written without ctx, or without ctx and the FileInfo (getattr(path),
+// read(path, size, offset)), gets called without them; rf_initialize
+// found out from its arity. What it doesn't take isn't built: the ctx
+// argument of RF_FUNCALL isn't evaluated, rf_file_info returns nil.
+#define RF_FUNCALL(op,argc,context,...) \
+  rf_funcall(op,argc, \
+    rf_current()->noctx & RF_OP_BIT(op) ? Qnil : (context),__VA_ARGS__)
+
+static VALUE rf_funcall(int op, int argc, ...)
+{
+  struct intern_fuse *inf = rf_current();
+  VALUE argv[8];
+  VALUE arg;
+  va_list ap;
+  int i, n = 0;
+
+  va_start(ap, argc);
+  for (i = 0; i < argc; i++) {
+    arg = va_arg(ap, VALUE);
+    if (i == 0 && (inf->noctx & RF_OP_BIT(op)))
+      continue;
+    if (i == rf_op_ffi[op] && (inf->noffi & RF_OP_BIT(op)))
+      continue;
+    argv[n++] = arg;
+  }
+  va_end(ap);
+  return rb_funcall2((VALUE) inf->handler, rf_op_ids[op], n, argv);
+}
+
+// Something changed path, what the attribute cache knows about it goes.
+// An entry that came or went changes its directory as well.
+#define RF_ATTR_PATH  0
+#define RF_ATTR_ENTRY 1
+#define RF_ATTR_TREE  2 //and everything below it
+
+static void rf_attr_changed(const char *path, int how)
+{
+  struct intern_fuse *inf = rf_current();
+  if (inf->attrs != NULL) {
+    attrcache_invalidate(inf->attrs, path, how & RF_ATTR_TREE);
+    if (how & RF_ATTR_ENTRY)
+      attrcache_invalidate_parent(inf->attrs, path);
+  }
+  //an entry that came may have been missing
+  if (inf->misses != NULL && (how & RF_ATTR_ENTRY))
+    attrcache_invalidate(inf->misses, path, how & RF_ATTR_TREE);
+}
+
+// The String handlers get for path: the one Fuse#path_cache keeps for it,
+// or a new one
+static VALUE rf_path(const char *path)
+{
+  struct pathcache *pc = rf_current()->paths;
+  return pc != NULL ? pathcache_get(pc, path) : rb_str_new2(path);
+}
 
-//this is a global variable where we store the fuse object
-static VALUE fuse_object;
+// path (and with tree what was below it) is gone
+static void rf_path_forget(const char *path, int tree)
+{
+  struct pathcache *pc = rf_current()->paths;
+  if (pc != NULL)
+    pathcache_forget(pc, path, tree);
+}
 
 #if !defined(STR2CSTR)
   #define STR2CSTR(X) StringValuePtr(X) 
@@ -47,15 +244,15 @@ static VALUE fuse_object;
 static int unsafe_return_error(VALUE *args)
 {
  
-  if (rb_respond_to(ruby_errinfo(),rb_intern("errno"))) {
+  if (rb_respond_to(ruby_errinfo(),id_errno)) {
     //We expect these and they get passed on the fuse so be quiet...
-    return rb_funcall(ruby_errinfo(),rb_intern("errno"),0);
+    return rb_funcall(ruby_errinfo(),id_errno,0);
   } else {
     VALUE info;
     info = rb_inspect(ruby_errinfo());
     printf ("ERROR: Exception %s not an Errno:: !respond_to?(:errno) \n",STR2CSTR(info)); 
     //We need the ruby_errinfo backtrace not fuse.loop ... rb_backtrace();
-    VALUE bt_ary = rb_funcall(ruby_errinfo(), rb_intern("backtrace"),0);
+    VALUE bt_ary = rb_funcall(ruby_errinfo(), id_backtrace,0);
     int c;
     for (c=0;c<RARRAY_LEN(bt_ary);c++) {
       printf("%s\n",RSTRING_PTR(RARRAY_PTR(bt_ary)[c]));
@@ -64,7 +261,7 @@ static int unsafe_return_error(VALUE *args)
   }
 }
 
-static int return_error(int def_error)
+int return_error(int def_error)
 {
   /*if the raised error has a method errno the return that value else
     return def(ault)_error */
@@ -83,6 +280,156 @@ static int return_error(int def_error)
   }
 }
 
+// Fuse#reuse_objects = true: rather than new ones for every call, handlers
+// get the calling fiber's own Context, FileInfo and Filler, pointed at the
+// request and cleared when the callback returns. Handlers mustn't keep them.
+// That pays off for loop, loop_mt and the reactor, whose fibers serve one
+// request after the other. Under loop_fiber every request is a fiber of its
+// own, a set per fiber would be garbage after one call: rf_reusing() says no.
+struct rf_wrappers {
+  VALUE context;
+  VALUE file_info;
+  VALUE filler;
+};
+
+static ID id_wrappers;
+
+static void rf_wrappers_mark(struct rf_wrappers *w)
+{
+  rb_gc_mark(w->context);
+  rb_gc_mark(w->file_info);
+  rb_gc_mark(w->filler);
+}
+
+static struct rf_wrappers *rf_wrappers()
+{
+  struct rf_wrappers *w;
+  VALUE self = rb_thread_local_aref(rb_thread_current(), id_wrappers);
+
+  if (NIL_P(self)) {
+    self = Data_Make_Struct(rb_cObject, struct rf_wrappers,
+      rf_wrappers_mark, free, w);
+    w->context   = wrap_context(NULL);
+    w->file_info = wrap_file_info(NULL);
+    w->filler    = rfiller_instance_new();
+    rb_thread_local_aset(rb_thread_current(), id_wrappers, self);
+  }
+  Data_Get_Struct(self, struct rf_wrappers, w);
+  return w;
+}
+
+static int rf_reusing()
+{
+  struct intern_fuse *inf = rf_current();
+  return inf->reuse_objects && !inf->fibers;
+}
+
+static VALUE rf_context(struct fuse_context *ctx)
+{
+  VALUE context;
+  if (!rf_reusing())
+    return wrap_context(ctx);
+  context = rf_wrappers()->context;
+  context_point(context, ctx);
+  return context;
+}
+
+static VALUE rf_file_info(int op, struct fuse_file_info *ffi)
+{
+  VALUE fi;
+  if (rf_current()->noffi & RF_OP_BIT(op))
+    return Qnil; //rf_funcall leaves it out
+  if (!rf_reusing())
+    return wrap_file_info(ffi);
+  fi = rf_wrappers()->file_info;
+  file_info_point(fi, ffi);
+  return fi;
+}
+
+static VALUE rf_filler()
+{
+  if (!rf_reusing())
+    return rfiller_instance_new();
+  return rf_wrappers()->filler;
+}
+
+// The callback is over
+static void rf_wrappers_release()
+{
+  struct rf_wrappers *w;
+  if (!rf_reusing())
+    return;
+  w = rf_wrappers();
+  context_point(w->context, NULL);
+  file_info_point(w->file_info, NULL);
+  rfiller_release(w->filler);
+}
+
+// Handlers may also fail without raising: returning -errno or an Errno
+// class (Errno::ENOENT) costs no exception to build and unwind. Each
+// class's errno is looked up once.
+static VALUE rf_errnos; //class => errno, 0 for classes that aren't Errno
+static ID id_Errno;
+
+// errno > 0 if res is a failure, 0 otherwise
+static int rf_errno_of(VALUE res)
+{
+  VALUE e;
+  if (FIXNUM_P(res))
+    return FIX2LONG(res) < 0 && FIX2LONG(res) > INT_MIN ? (int) -FIX2LONG(res) : 0;
+  if (!RB_TYPE_P(res,T_CLASS))
+    return 0;
+  e = rb_hash_lookup2(rf_errnos,res,Qundef);
+  if (e == Qundef)
+  {
+    e = INT2FIX(0);
+    if (RTEST(rb_class_inherited_p(res,rb_eSystemCallError)) &&
+        rb_const_defined(res,id_Errno))
+    {
+      e = rb_const_get(res,id_Errno);
+      if (!FIXNUM_P(e))
+        e = INT2FIX(0);
+    }
+    rb_hash_aset(rf_errnos,res,e);
+  }
+  return FIX2INT(e);
+}
+
+// rb_protect for the callbacks. A handler returning an errno failed too:
+// *error is then -errno. Releases what rf_wrappers handed out.
+//
+// The handler may suspend its fiber (loop_fiber), and the thread serve
+// requests of this mount or another one meanwhile: the thread's fuse
+// context, which rf_current and the rest of the callback go by, is put
+// back as it was before ruby was called.
+static VALUE rf_protect(VALUE (*func)(VALUE),VALUE args,int *error)
+{
+  struct fuse_context *ctx = fuse_get_context();
+  struct fuse_context saved;
+  struct intern_fuse *serving = rf_serving;
+  VALUE res;
+  int e;
+
+  if (ctx != NULL)
+    saved = *ctx;
+  res = rb_protect(func,args,error);
+  if (ctx != NULL)
+    *fuse_get_context() = saved;
+  rf_serving = serving;
+
+  rf_wrappers_release();
+  if (*error == 0 && (e = rf_errno_of(res)) != 0)
+    *error = -e;
+  return res;
+}
+
+// The errno of a call rf_protect said failed: the one returned, or the
+// exception's (def_error if it has none)
+static int rf_error(int error,int def_error)
+{
+  return error < 0 ? -error : return_error(def_error);
+}
+
 //----------------------READDIR
 
 static VALUE unsafe_readdir(VALUE *args)
@@ -94,7 +441,7 @@ static VALUE unsafe_readdir(VALUE *args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("readdir"),5,wrap_context(ctx),path,filler,
+  return RF_FUNCALL(RF_OP_READDIR,5,rf_context(ctx),path,filler,
         offset,ffi);
 }
 
@@ -102,8 +449,6 @@ static VALUE unsafe_readdir(VALUE *args)
 static int rf_readdir(const char *path, void *buf,
   fuse_fill_dir_t filler, off_t offset,struct fuse_file_info *ffi)
 {
-  VALUE fuse_module;
-  VALUE rfiller_class;
   VALUE rfiller_instance;
   VALUE args[4];
   VALUE res;
@@ -111,25 +456,22 @@ static int rf_readdir(const char *path, void *buf,
   int error = 0;
 
   //create a filler object
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
 
-  fuse_module = rb_const_get(rb_cObject, rb_intern("RFuse"));
-
-  rfiller_class=rb_const_get(fuse_module,rb_intern("Filler"));
-  rfiller_instance=rb_funcall(rfiller_class,rb_intern("new"),0);
+  rfiller_instance=rf_filler();
   Data_Get_Struct(rfiller_instance,struct filler_t,fillerc);
 
   fillerc->filler=filler;//Init the filler by hand.... TODO: cleaner
   fillerc->buffer=buf;
   args[1]=rfiller_instance;
   args[2]=INT2NUM(offset);
-  args[3]=wrap_file_info(ffi);
+  args[3]=rf_file_info(RF_OP_READDIR,ffi);
 
-  res=rb_protect((VALUE (*)())unsafe_readdir,(VALUE)args,&error);
+  res=rf_protect((VALUE (*)())unsafe_readdir,(VALUE)args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -146,7 +488,7 @@ static VALUE unsafe_readlink(VALUE *args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("readlink"),3,wrap_context(ctx),path,size);
+  return RF_FUNCALL(RF_OP_READLINK,3,rf_context(ctx),path,size);
 }
 
 static int rf_readlink(const char *path, char *buf, size_t size)
@@ -154,13 +496,13 @@ static int rf_readlink(const char *path, char *buf, size_t size)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2NUM(size);
   char *rbuf;
-  res=rb_protect((VALUE (*)())unsafe_readlink,(VALUE)args,&error);  
+  res=rf_protect((VALUE (*)())unsafe_readlink,(VALUE)args,&error);  
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -171,7 +513,9 @@ static int rf_readlink(const char *path, char *buf, size_t size)
 }
 
 //----------------------GETDIR
+// libfuse 3 dropped getdir, readdir is all there is
 
+#ifndef RFUSE_FUSE3
 static VALUE unsafe_getdir(VALUE *args)
 {
   VALUE path   = args[0];
@@ -179,17 +523,14 @@ static VALUE unsafe_getdir(VALUE *args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(
-    fuse_object,rb_intern("getdir"),3,
-    wrap_context(ctx),path,filler
+  return RF_FUNCALL(RF_OP_GETDIR,3,
+    rf_context(ctx),path,filler
   );
 }
 
 //call getdir with an Filler object
 static int rf_getdir(const char *path, fuse_dirh_t dh, fuse_dirfil_t df)
 {
-  VALUE fuse_module;
-  VALUE rfiller_class;
   VALUE rfiller_instance;
   VALUE args[2];
   VALUE res;
@@ -197,12 +538,9 @@ static int rf_getdir(const char *path, fuse_dirh_t dh, fuse_dirfil_t df)
   int error = 0;
 
   //create a filler object
-  args[0]=rb_str_new2(path);
-
-  fuse_module = rb_const_get(rb_cObject, rb_intern("RFuse"));
+  args[0]=rf_path(path);
 
-  rfiller_class    = rb_const_get(fuse_module,rb_intern("Filler"));
-  rfiller_instance = rb_funcall(rfiller_class,rb_intern("new"),0);
+  rfiller_instance = rf_filler();
 
   Data_Get_Struct(rfiller_instance,struct filler_t,fillerc);
 
@@ -211,17 +549,18 @@ static int rf_getdir(const char *path, fuse_dirh_t dh, fuse_dirfil_t df)
 
   args[1]=rfiller_instance;
 
-  res = rb_protect((VALUE (*)())unsafe_getdir, (VALUE)args, &error);
+  res = rf_protect((VALUE (*)())unsafe_getdir, (VALUE)args, &error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
     return 0;
   }
 }
+#endif
 
 //----------------------MKNOD
 
@@ -231,7 +570,7 @@ static VALUE unsafe_mknod(VALUE *args)
   VALUE mode = args[1];
   VALUE dev  = args[2];
   struct fuse_context *ctx=fuse_get_context();
-  return rb_funcall(fuse_object,rb_intern("mknod"),4,wrap_context(ctx),path,mode,dev);
+  return RF_FUNCALL(RF_OP_MKNOD,4,rf_context(ctx),path,mode,dev);
 }
 
 static int rf_mknod(const char *path, mode_t mode,dev_t dev)
@@ -239,16 +578,17 @@ static int rf_mknod(const char *path, mode_t mode,dev_t dev)
   VALUE args[3];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2FIX(mode);
   args[2]=INT2FIX(dev);
-  res=rb_protect((VALUE (*)())unsafe_mknod,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_mknod,(VALUE) args,&error);
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(path,RF_ATTR_ENTRY);
     return 0;
   }
 }
@@ -261,25 +601,41 @@ static VALUE unsafe_getattr(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("getattr"),2,wrap_context(ctx),path);
+  return RF_FUNCALL(RF_OP_GETATTR,2,rf_context(ctx),path);
 }
 
+static void rf_write_deliver_path(const char *path, int tree,
+  struct open_file *except); //HANDLES
+
 //calls getattr with path and expects something like FuseStat back
 static int rf_getattr(const char *path, struct stat *stbuf)
 {
   VALUE args[1];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  res=rb_protect((VALUE (*)())unsafe_getattr,(VALUE) args,&error);
+  struct intern_fuse *inf = rf_current();
+  struct attrcache *ac;
+  uint64_t gen, mgen;
+
+  rf_write_deliver_path(path,0,NULL);
+  ac   = inf->attrs;
+  gen  = ac != NULL ? attrcache_generation(ac) : 0;
+  mgen = inf->misses != NULL ? attrcache_generation(inf->misses) : 0;
+  args[0]=rf_path(path);
+  res=rf_protect((VALUE (*)())unsafe_getattr,(VALUE) args,&error);
 
   if (error || (res == Qnil))
   {
-    return -(return_error(ENOENT));
+    error = rf_error(error,ENOENT);
+    if (error == ENOENT && inf->misses != NULL)
+      attrcache_put(inf->misses,path,NULL,-1,mgen);
+    return -error;
   }
   else
   {
     rstat2stat(res,stbuf);
+    if (ac != NULL)
+      attrcache_put(ac,path,stbuf,rstat_ttl(res),gen);
     return 0;
   }
 }
@@ -293,7 +649,7 @@ static VALUE unsafe_mkdir(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("mkdir"),3,wrap_context(ctx),path,mode);
+  return RF_FUNCALL(RF_OP_MKDIR,3,rf_context(ctx),path,mode);
 }
 
 //calls getattr with path and expects something like FuseStat back
@@ -302,20 +658,263 @@ static int rf_mkdir(const char *path, mode_t mode)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2FIX(mode);
-  res=rb_protect((VALUE (*)())unsafe_mkdir,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_mkdir,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(path,RF_ATTR_ENTRY);
+    return 0;
+  }
+}
+
+//----------------------HANDLES
+// Every file opened through open, create or opendir gets an open_file
+// as fh until it is released, holding FileInfo#fh and the bound fd. They
+// hang off the mount, which marks them: the ffi libfuse hands us is a
+// different struct on every call, it can't be registered with the GC.
+
+static void rf_handle_open(struct fuse_file_info *ffi)
+{
+  struct intern_fuse *inf = rf_current();
+  struct open_file *h = malloc(sizeof(struct open_file));
+
+  h->value = Qnil;
+  h->fd    = -1;
+  h->passthrough = 0;
+  h->backing_id  = 0;
+  h->ra    = NULL;
+  h->wb    = NULL;
+  h->prev  = NULL;
+  h->next  = inf->handles;
+  if (inf->handles != NULL)
+    inf->handles->prev = h;
+  inf->handles = h;
+  ffi->fh = (uintptr_t) h;
+}
+
+static void rf_handle_free(struct intern_fuse *inf, struct open_file *h)
+{
+  if (h->prev != NULL)
+    h->prev->next = h->next;
+  else
+    inf->handles = h->next;
+  if (h->next != NULL)
+    h->next->prev = h->prev;
+  if (h->fd >= 0)
+    close(h->fd);
+  h->fd = -1;
+  if (h->backing_id > 0 && inf->passthrough)
+    passthrough_close(intern_fuse_fd(inf), h->backing_id);
+  h->backing_id = 0;
+  if (h->ra != NULL) {
+    readahead_free(h->ra, &inf->ra_stats);
+    inf->ra_count--;
+  }
+  h->ra = NULL;
+  if (h->wb != NULL) {
+    if (h->wb->len > 0)
+      inf->wb_pending--;
+    //a write() of what it held is running and still sees h through its
+    //ffi, rf_write_deliver frees
+    if (h->wb->delivering > 0) {
+      h->wb->released = 1;
+      return;
+    }
+    writebehind_free(h->wb);
+  }
+  free(h);
+}
+
+static void rf_handle_release(struct fuse_file_info *ffi)
+{
+  struct open_file *h = open_file_of(ffi);
+  if (h != NULL) {
+    rf_handle_free(rf_current(), h);
+    ffi->fh = 0;
+  }
+}
+
+// open or create went through: hand a file bound with passthrough= to
+// the kernel. If it won't take it (no kernel or libfuse support, no
+// CAP_SYS_ADMIN) reads and writes come to us and are served from h->fd.
+static void rf_handle_backing(struct fuse_file_info *ffi)
+{
+#ifdef RFUSE_PASSTHROUGH
+  struct intern_fuse *inf = rf_current();
+  struct open_file *h = open_file_of(ffi);
+  int id;
+
+  if (h == NULL || !h->passthrough || h->fd < 0 || !inf->passthrough)
+    return;
+  id = passthrough_open(intern_fuse_fd(inf), h->fd);
+  if (id > 0) {
+    h->backing_id   = id;
+    ffi->backing_id = id;
+  }
+#endif
+}
+
+//the file changed through this handle (ffi may be NULL), or path was
+//renamed: what was read ahead of it through any handle is stale
+static void rf_readahead_drop(const char *path, int tree,
+  struct fuse_file_info *ffi)
+{
+  struct intern_fuse *inf = rf_current();
+  struct open_file *own = open_file_of(ffi);
+  struct open_file *h;
+
+  if (own != NULL && own->ra != NULL)
+    readahead_drop(own->ra,&inf->ra_stats);
+  //nobody else reads ahead
+  if (inf->ra_count == 0 ||
+      (inf->ra_count == 1 && own != NULL && own->ra != NULL))
+    return;
+  for (h = inf->handles; h != NULL; h = h->next) {
+    if (h != own && h->ra != NULL && readahead_match(h->ra,path,tree))
+      readahead_drop(h->ra,&inf->ra_stats);
+  }
+}
+
+//pt_write wrote a bound file without the GVL, see GVL(readahead_written)
+static int rf_readahead_written(const char *path, struct fuse_file_info *ffi)
+{
+  rf_readahead_drop(path,0,ffi);
+  return 0;
+}
+
+//truncate names a path, not a handle: any open file may be that one
+static void rf_readahead_drop_all()
+{
+  struct intern_fuse *inf = rf_current();
+  struct open_file *h;
+  for (h = inf->handles; h != NULL; h = h->next) {
+    if (h->ra != NULL)
+      readahead_drop(h->ra,&inf->ra_stats);
+  }
+}
+
+//Fuse#write_behind = size, see writebehind.c
+static int rf_write_handler(const char *path,const char *buf,size_t size,
+  off_t offset,struct fuse_file_info *ffi); //WRITE, below
+
+// Hands what h holds back to write(). If that fails the next flush or
+// fsync says so; with error, the errno that is to be reported now is taken
+// there instead. Returns 1 if h was released meanwhile and is gone.
+static int rf_write_deliver(struct open_file *h, int *error)
+{
+  struct intern_fuse *inf = rf_current();
+  struct writebehind *wb = h->wb;
+  struct fuse_file_info ffi;
+  VALUE fh = h->value; //h may be released while write() runs
+  char *path, *buf;
+  size_t len;
+  off_t start;
+  int res;
+
+  if (wb == NULL || wb->len == 0)
+    goto done;
+  buf  = writebehind_take(wb,&len,&start);
+  path = strdup(wb->path);
+  ffi  = wb->ffi;
+  inf->wb_pending--;
+
+  wb->delivering++;
+  res = rf_write_handler(path,buf,len,start,&ffi);
+  wb->delivering--;
+  free(buf);
+  free(path);
+  RB_GC_GUARD(fh);
+
+  inf->wb_stats.deliveries++;
+  if (res > 0)
+    inf->wb_stats.bytes += res;
+  if ((res < 0 || (size_t) res < len) && wb->error == 0)
+    wb->error = res < 0 ? -res : EIO;
+
+done:
+  if (wb != NULL && error != NULL) {
+    *error = wb->error;
+    wb->error = 0;
+  }
+  if (wb != NULL && wb->released && wb->delivering == 0) {
+    writebehind_free(wb);
+    free(h);
+    return 1;
+  }
+  return 0;
+}
+
+// flush, fsync and release: deliver, 0 or -errno of a write() that failed
+static int rf_write_flush(struct fuse_file_info *ffi)
+{
+  struct open_file *h = open_file_of(ffi);
+  int error = 0;
+  if (h == NULL || h->wb == NULL)
     return 0;
+  rf_write_deliver(h,&error);
+  return -error;
+}
+
+// read, write_buf, ftruncate and fgetattr come after the writes of this
+// handle, and of any other open on path
+static void rf_write_settle(const char *path, struct fuse_file_info *ffi)
+{
+  struct open_file *h = open_file_of(ffi);
+  if (h != NULL && h->wb != NULL)
+    rf_write_deliver(h,NULL);
+  rf_write_deliver_path(path,0,NULL);
+}
+
+// Without the GVL, whether flush and fsync have something to deliver
+static int rf_write_pending(struct fuse_file_info *ffi)
+{
+  struct open_file *h = open_file_of(ffi);
+  return h != NULL && h->wb != NULL && (h->wb->len > 0 || h->wb->error);
+}
+
+// getattr, truncate, unlink and rename name a path: the writes pending for
+// it, or with tree below it, go first. Those of except stay, NULL path
+// delivers everything.
+static void rf_write_deliver_path(const char *path, int tree,
+  struct open_file *except)
+{
+  struct intern_fuse *inf = rf_current();
+  struct open_file *h;
+
+  if (inf->wb_pending == 0)
+    return;
+  //only except holds anything back, the usual case for rf_write
+  if (inf->wb_pending == 1 && except != NULL && except->wb != NULL &&
+      except->wb->len > 0)
+    return;
+  for (h = inf->handles; h != NULL; ) {
+    if (h != except && h->wb != NULL && writebehind_match(h->wb,path,tree)) {
+      rf_write_deliver(h,NULL);
+      h = inf->handles; //the list may have changed meanwhile
+    } else {
+      h = h->next;
+    }
   }
 }
 
+// The mount isn't served any more (its loop returned, it is unmounted):
+// no flush will come for what is held back, it goes to write() now
+void rfuse_write_deliver_all(struct intern_fuse *inf)
+{
+  struct rf_serve sv;
+  if (inf->wb_pending == 0 || inf->fuse == NULL)
+    return;
+  rf_serve(&sv, inf);
+  rf_write_deliver_path(NULL,1,NULL);
+  rf_serve_end(&sv);
+}
+
 //----------------------OPEN
 
 static VALUE unsafe_open(VALUE *args)
@@ -323,7 +922,7 @@ static VALUE unsafe_open(VALUE *args)
   VALUE path = args[0];
   VALUE ffi  =  args[1];
   struct fuse_context *ctx=fuse_get_context();
-  return rb_funcall(fuse_object,rb_intern("open"),3,wrap_context(ctx),path,ffi);
+  return RF_FUNCALL(RF_OP_OPEN,3,rf_context(ctx),path,ffi);
 }
 
 //calls getattr with path and expects something like FuseStat back
@@ -332,20 +931,18 @@ static int rf_open(const char *path,struct fuse_file_info *ffi)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  //GG: is args[1] kept on the stack and thus referenced from the GC's perspective?
-  args[1]=wrap_file_info(ffi);
-  res=rb_protect((VALUE (*)())unsafe_open,(VALUE) args,&error);
+  args[0]=rf_path(path);
+  rf_handle_open(ffi);
+  args[1]=rf_file_info(RF_OP_OPEN,ffi);
+  res=rf_protect((VALUE (*)())unsafe_open,(VALUE) args,&error);
   if (error)
   {
-    return -(return_error(ENOENT));
+    rf_handle_release(ffi);
+    return -(rf_error(error,ENOENT));
   }
   else
   {
-    if (TYPE(ffi->fh) != T_NONE) {
-       //Make sure the GC doesn't collect our FileHandle
-       rb_gc_register_address((VALUE*) &ffi->fh);
-    }
+    rf_handle_backing(ffi);
     return 0;
   }
 }
@@ -359,7 +956,7 @@ static VALUE unsafe_release(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("release"),3,wrap_context(ctx),path,ffi);
+  return RF_FUNCALL(RF_OP_RELEASE,3,rf_context(ctx),path,ffi);
 }
 
 static int rf_release(const char *path, struct fuse_file_info *ffi)
@@ -367,19 +964,22 @@ static int rf_release(const char *path, struct fuse_file_info *ffi)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  args[1]=wrap_file_info(ffi);
-  res=rb_protect((VALUE (*)())unsafe_release,(VALUE) args,&error);
-  if (TYPE(ffi->fh) != T_NONE) {
-     rb_gc_unregister_address((VALUE*) &ffi->fh);
+  int written = rf_write_flush(ffi);
+  //release is also there to free handles of handlers without one
+  if (RESPOND_TO(rf_current(),RF_OP_RELEASE))
+  {
+    args[0]=rf_path(path);
+    args[1]=rf_file_info(RF_OP_RELEASE,ffi);
+    res=rf_protect((VALUE (*)())unsafe_release,(VALUE) args,&error);
   }
+  rf_handle_release(ffi);
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
-    return 0;
+    return written;
   }
 }
 
@@ -391,7 +991,7 @@ static VALUE unsafe_fsync(VALUE *args) {
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("fsync"), 4, wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_FSYNC,4, rf_context(ctx),
     path, datasync, ffi);
 }
 
@@ -400,20 +1000,24 @@ static int rf_fsync(const char *path, int datasync, struct fuse_file_info *ffi)
   VALUE args[3];
   VALUE res;
   int error = 0;
+  int written = rf_write_flush(ffi);
 
-  args[0] = rb_str_new2(path);
-  args[1] = INT2NUM(datasync);
-  args[2] = wrap_file_info(ffi);
+  if (RESPOND_TO(rf_current(),RF_OP_FSYNC))
+  {
+    args[0] = rf_path(path);
+    args[1] = INT2NUM(datasync);
+    args[2] = rf_file_info(RF_OP_FSYNC,ffi);
 
-  res = rb_protect((VALUE (*)())unsafe_fsync,(VALUE) args,&error);
+    res = rf_protect((VALUE (*)())unsafe_fsync,(VALUE) args,&error);
+  }
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
-    return 0;
+    return written;
   }
 }
 
@@ -426,7 +1030,7 @@ static VALUE unsafe_flush(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("flush"),3,wrap_context(ctx),path,ffi);
+  return RF_FUNCALL(RF_OP_FLUSH,3,rf_context(ctx),path,ffi);
 }
 
 static int rf_flush(const char *path,struct fuse_file_info *ffi)
@@ -434,17 +1038,22 @@ static int rf_flush(const char *path,struct fuse_file_info *ffi)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  args[1]=wrap_file_info(ffi);
-  res=rb_protect((VALUE (*)())unsafe_flush,(VALUE) args,&error);
+  int written = rf_write_flush(ffi);
+  //flush is also there to deliver held back writes, see rf_write
+  if (RESPOND_TO(rf_current(),RF_OP_FLUSH))
+  {
+    args[0]=rf_path(path);
+    args[1]=rf_file_info(RF_OP_FLUSH,ffi);
+    res=rf_protect((VALUE (*)())unsafe_flush,(VALUE) args,&error);
+  }
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
-    return 0;
+    return written;
   }
 }
 
@@ -457,7 +1066,7 @@ static VALUE unsafe_truncate(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("truncate"),3,wrap_context(ctx),path,offset);
+  return RF_FUNCALL(RF_OP_TRUNCATE,3,rf_context(ctx),path,offset);
 }
 
 static int rf_truncate(const char *path,off_t offset)
@@ -465,16 +1074,19 @@ static int rf_truncate(const char *path,off_t offset)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  rf_write_deliver_path(path,0,NULL);
+  args[0]=rf_path(path);
   args[1]=INT2FIX(offset);
-  res=rb_protect((VALUE (*)())unsafe_truncate,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_truncate,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_readahead_drop_all();
+    rf_attr_changed(path,RF_ATTR_PATH);
     return 0;
   }
 }
@@ -489,7 +1101,7 @@ static VALUE unsafe_utime(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("utime"),4,wrap_context(ctx),path,actime,modtime);
+  return RF_FUNCALL(RF_OP_UTIME,4,rf_context(ctx),path,actime,modtime);
 }
 
 static int rf_utime(const char *path,struct utimbuf *utim)
@@ -497,17 +1109,18 @@ static int rf_utime(const char *path,struct utimbuf *utim)
   VALUE args[3];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2NUM(utim->actime);
   args[2]=INT2NUM(utim->modtime);
-  res=rb_protect((VALUE (*)())unsafe_utime,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_utime,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(path,RF_ATTR_PATH);
     return 0;
   }
 }
@@ -522,7 +1135,7 @@ static VALUE unsafe_chown(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("chown"),4,wrap_context(ctx),path,uid,gid);
+  return RF_FUNCALL(RF_OP_CHOWN,4,rf_context(ctx),path,uid,gid);
 }
 
 static int rf_chown(const char *path,uid_t uid,gid_t gid)
@@ -530,17 +1143,18 @@ static int rf_chown(const char *path,uid_t uid,gid_t gid)
   VALUE args[3];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2FIX(uid);
   args[2]=INT2FIX(gid);
-  res=rb_protect((VALUE (*)())unsafe_chown,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_chown,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(path,RF_ATTR_PATH);
     return 0;
   }
 }
@@ -554,7 +1168,7 @@ static VALUE unsafe_chmod(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("chmod"),3,wrap_context(ctx),path,mode);
+  return RF_FUNCALL(RF_OP_CHMOD,3,rf_context(ctx),path,mode);
 }
 
 static int rf_chmod(const char *path,mode_t mode)
@@ -562,16 +1176,17 @@ static int rf_chmod(const char *path,mode_t mode)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2FIX(mode);
-  res=rb_protect((VALUE (*)())unsafe_chmod,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_chmod,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(path,RF_ATTR_PATH);
     return 0;
   }
 }
@@ -584,7 +1199,7 @@ static VALUE unsafe_unlink(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("unlink"),2,wrap_context(ctx),path);
+  return RF_FUNCALL(RF_OP_UNLINK,2,rf_context(ctx),path);
 }
 
 static int rf_unlink(const char *path)
@@ -592,15 +1207,18 @@ static int rf_unlink(const char *path)
   VALUE args[1];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  res=rb_protect((VALUE (*)())unsafe_unlink,(VALUE) args,&error);
+  rf_write_deliver_path(path,0,NULL);
+  args[0]=rf_path(path);
+  res=rf_protect((VALUE (*)())unsafe_unlink,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_path_forget(path,0);
+    rf_attr_changed(path,RF_ATTR_ENTRY);
     return 0;
   }
 }
@@ -613,7 +1231,7 @@ static VALUE unsafe_rmdir(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("rmdir"),2,wrap_context(ctx),path);
+  return RF_FUNCALL(RF_OP_RMDIR,2,rf_context(ctx),path);
 }
 
 static int rf_rmdir(const char *path)
@@ -621,15 +1239,17 @@ static int rf_rmdir(const char *path)
   VALUE args[1];
   VALUE res;
   int error = 0;
-  args[0] = rb_str_new2(path);
-  res = rb_protect((VALUE (*)())unsafe_rmdir, (VALUE) args ,&error);
+  args[0] = rf_path(path);
+  res = rf_protect((VALUE (*)())unsafe_rmdir, (VALUE) args ,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_path_forget(path,1);
+    rf_attr_changed(path,RF_ATTR_ENTRY|RF_ATTR_TREE);
     return 0;
   }
 }
@@ -642,7 +1262,7 @@ static VALUE unsafe_symlink(VALUE *args){
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("symlink"),3,wrap_context(ctx),path,as);
+  return RF_FUNCALL(RF_OP_SYMLINK,3,rf_context(ctx),path,as);
 }
 
 static int rf_symlink(const char *path,const char *as)
@@ -650,16 +1270,17 @@ static int rf_symlink(const char *path,const char *as)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  args[1]=rb_str_new2(as);
-  res=rb_protect((VALUE (*)())unsafe_symlink,(VALUE) args,&error);
+  args[0]=rb_str_new2(path); //where the link points, not a path of ours
+  args[1]=rf_path(as);
+  res=rf_protect((VALUE (*)())unsafe_symlink,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(as,RF_ATTR_ENTRY);
     return 0;
   }
 }
@@ -673,7 +1294,7 @@ static VALUE unsafe_rename(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("rename"),3,wrap_context(ctx),path,as);
+  return RF_FUNCALL(RF_OP_RENAME,3,rf_context(ctx),path,as);
 }
 
 static int rf_rename(const char *path,const char *as)
@@ -681,16 +1302,21 @@ static int rf_rename(const char *path,const char *as)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  args[1]=rb_str_new2(as);
-  res=rb_protect((VALUE (*)())unsafe_rename,(VALUE) args,&error);
+  rf_write_deliver_path(path,1,NULL);
+  args[0]=rf_path(path);
+  args[1]=rf_path(as);
+  res=rf_protect((VALUE (*)())unsafe_rename,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_path_forget(path,1);
+    rf_readahead_drop(path,1,NULL);
+    rf_attr_changed(path,RF_ATTR_ENTRY|RF_ATTR_TREE);
+    rf_attr_changed(as,RF_ATTR_ENTRY|RF_ATTR_TREE);
     return 0;
   }
 }
@@ -704,7 +1330,7 @@ static VALUE unsafe_link(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("link"),3,wrap_context(ctx),path,as);
+  return RF_FUNCALL(RF_OP_LINK,3,rf_context(ctx),path,as);
 }
 
 static int rf_link(const char *path,const char * as)
@@ -712,20 +1338,73 @@ static int rf_link(const char *path,const char * as)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  args[1]=rb_str_new2(as);
-  res=rb_protect((VALUE (*)())unsafe_link,(VALUE) args,&error);
+  args[0]=rf_path(path);
+  args[1]=rf_path(as);
+  res=rf_protect((VALUE (*)())unsafe_link,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(path,RF_ATTR_PATH); //nlink
+    rf_attr_changed(as,RF_ATTR_ENTRY);
     return 0;
   }
 }
 
+//----------------------BYTES
+// read() and getxattr() may return a String, an IO::Buffer (mapped ones
+// too) or [buffer, offset, length] with buffer one of those. The bytes are
+// copied from there into the reply, no String is cut out first.
+
+struct rf_bytes {
+  const char *ptr;
+  long len;
+};
+
+static void rf_bytes_of(VALUE res, struct rf_bytes *b)
+{
+  VALUE buffer = res;
+  long offset = 0, length = -1, size;
+  const char *base;
+
+  if (RB_TYPE_P(res, T_ARRAY)) {
+    if (RARRAY_LEN(res) != 3) {
+      rb_raise(rb_eArgError, "expected [buffer, offset, length]");
+    }
+    buffer = rb_ary_entry(res, 0);
+    offset = NUM2LONG(rb_ary_entry(res, 1));
+    length = NUM2LONG(rb_ary_entry(res, 2));
+  }
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+  if (rb_obj_is_kind_of(buffer, rb_cIOBuffer)) {
+    const void *data;
+    size_t dsize;
+    rb_io_buffer_get_bytes_for_reading(buffer, &data, &dsize);
+    base = data;
+    size = dsize;
+  } else
+#endif
+  {
+    StringValue(buffer);
+    base = RSTRING_PTR(buffer);
+    size = RSTRING_LEN(buffer);
+  }
+
+  if (length < 0) {
+    length = size - offset;
+  }
+  if (offset < 0 || offset > size || length > size - offset) {
+    rb_raise(rb_eArgError, "offset %ld, length %ld outside of %ld bytes",
+      offset, length, size);
+  }
+  b->ptr = base + offset;
+  b->len = length;
+}
+
 //----------------------READ
 
 static VALUE unsafe_read(VALUE *args)
@@ -734,11 +1413,16 @@ static VALUE unsafe_read(VALUE *args)
   VALUE size   = args[1];
   VALUE offset = args[2];
   VALUE ffi    = args[3];
+  VALUE res;
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("read"),5,
-        wrap_context(ctx),path,size,offset,ffi);
+  res = RF_FUNCALL(RF_OP_READ,5,
+        rf_context(ctx),path,size,offset,ffi);
+  if (rf_errno_of(res))
+    return res;
+  rf_bytes_of(res, (struct rf_bytes *) args[4]);
+  return res;
 }
 
 
@@ -757,42 +1441,148 @@ rb_str2cstr(str, len)
 }
 
 
-static int rf_read(const char *path,char * buf, size_t size,off_t offset,struct fuse_file_info *ffi)
+//----------------------READ_INTO
+// read_into(ctx, path, buf, size, offset, ffi) fills an RFuse::ReadBuffer
+// over the reply buffer and returns the number of bytes it put there.
+// Handlers that have it get it instead of read().
+
+static VALUE unsafe_read_into(VALUE *args)
 {
-  VALUE args[4];
+  VALUE path   = args[0];
+  VALUE rbuf   = args[1];
+  VALUE size   = args[2];
+  VALUE offset = args[3];
+  VALUE ffi    = args[4];
+  VALUE res;
+  long length;
+
+  struct fuse_context *ctx=fuse_get_context();
+
+  res = RF_FUNCALL(RF_OP_READ_INTO,6,
+        rf_context(ctx),path,rbuf,size,offset,ffi);
+  if (rf_errno_of(res))
+    return res;
+
+  length = NUM2LONG(res);
+  if (length < 0 || (size_t) length > NUM2SIZET(size)) {
+    rb_raise(rb_eRangeError, "read_into returned %ld for a %lu byte buffer",
+      length, (unsigned long) NUM2SIZET(size));
+  }
+  return LONG2NUM(length);
+}
+
+static int rf_read_into(const char *path,char * buf, size_t size,off_t offset,struct fuse_file_info *ffi)
+{
+  VALUE args[5];
+  VALUE res;
+  int error = 0;
+
+  args[0]=rf_path(path);
+  args[1]=readbuffer_get(buf,size);
+  args[2]=SIZET2NUM(size);
+  args[3]=OFFT2NUM(offset);
+  args[4]=rf_file_info(RF_OP_READ_INTO,ffi);
+
+  res=rf_protect((VALUE (*)())unsafe_read_into,(VALUE) args,&error);
+  readbuffer_release(args[1]);
+
+  if (error)
+  {
+    return -(rf_error(error,ENOENT));
+  }
+  return NUM2LONG(res);
+}
+
+static int rf_read_handler(const char *path,char * buf, size_t size,off_t offset,struct fuse_file_info *ffi)
+{
+  VALUE args[5];
   VALUE res;
   int error = 0;
-  long length=0;
-  char* rbuf;
+  struct rf_bytes bytes;
+
+  if (RESPOND_TO(rf_current(),RF_OP_READ_INTO))
+  {
+    return rf_read_into(path,buf,size,offset,ffi);
+  }
 
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2NUM(size);
   args[2]=INT2NUM(offset);
-  args[3]=wrap_file_info(ffi);
+  args[3]=rf_file_info(RF_OP_READ,ffi);
+  args[4]=(VALUE) &bytes;
 
-  res=rb_protect((VALUE (*)())unsafe_read,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_read,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
-    length = NUM2LONG(rb_funcall(res, rb_intern("length"), 0));
-    rbuf = rb_str2cstr(res, &length);
-    if (length<=(long)size)
+    if (bytes.len<=(long)size)
     {
-      memcpy(buf,rbuf,length);
-      return length;
+      memcpy(buf,bytes.ptr,bytes.len);
+      RB_GC_GUARD(res);
+      return bytes.len;
     }
     else
     {
       //This cannot happen => IO error.
-      return -(return_error(ENOENT));
+      return -(rf_error(error,ENOENT));
     }
   }
 }
 
+//Fuse#readahead = max: sequential reads of a file opened through open or
+//create are served from what a larger read of the handler brought in,
+//see readahead.c. Writes to the file through any handle drop it.
+static int rf_read(const char *path,char * buf, size_t size,off_t offset,struct fuse_file_info *ffi)
+{
+  struct intern_fuse *inf = rf_current();
+  struct open_file *h = open_file_of(ffi);
+  struct readahead *ra;
+  size_t window;
+  unsigned gen;
+  char *tmp;
+  long n;
+  int res;
+
+  rf_write_settle(path,ffi);
+  if (inf->readahead == 0 || h == NULL)
+    return rf_read_handler(path,buf,size,offset,ffi);
+  if (h->ra == NULL) {
+    h->ra = readahead_new();
+    inf->ra_count++;
+  }
+  ra = h->ra;
+  readahead_path(ra,path);
+
+  n = readahead_get(ra,buf,size,offset,&inf->ra_stats);
+  if (n >= 0)
+    return n;
+
+  window = readahead_window(ra,offset,size,inf->readahead);
+  if (window <= size)
+    return rf_read_handler(path,buf,size,offset,ffi);
+
+  //the handler may let go of the GVL, reads of this file may come
+  //meanwhile: they are served from the old buffer or go to the handler
+  tmp = malloc(window);
+  gen = ra->gen;
+  ra->busy = 1;
+  res = rf_read_handler(path,tmp,window,offset,ffi);
+  ra->busy = 0;
+  if (res < 0) {
+    free(tmp);
+    ra->window = 0;
+    return res;
+  }
+  n = (size_t) res < size ? res : (long) size;
+  memcpy(buf,tmp,n);
+  readahead_fill(ra,tmp,res,window,offset,n,gen,&inf->ra_stats);
+  return n;
+}
+
 //----------------------WRITE
 
 static VALUE unsafe_write(VALUE *args)
@@ -804,104 +1594,380 @@ static VALUE unsafe_write(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("write"),5,
-        wrap_context(ctx),path,buffer,offset,ffi);
+  return RF_FUNCALL(RF_OP_WRITE,5,
+        rf_context(ctx),path,buffer,offset,ffi);
 }
 
-static int rf_write(const char *path,const char *buf,size_t size,
+static int rf_write_handler(const char *path,const char *buf,size_t size,
   off_t offset,struct fuse_file_info *ffi)
 {
   VALUE args[4];
   VALUE res;
   int error = 0;
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  int borrowed = rf_current()->borrow_writes;
+#endif
 
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  //a read-only view on the request, no copy
+  if (borrowed)
+    args[1]=rb_io_buffer_new((void *) buf, size,
+      RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+  else
+#endif
   args[1]=rb_str_new(buf, size);
   args[2]=INT2NUM(offset);
-  args[3]=wrap_file_info(ffi);
+  args[3]=rf_file_info(RF_OP_WRITE,ffi);
+
+  res = rf_protect((VALUE (*)())unsafe_write,(VALUE) args, &error);
 
-  res = rb_protect((VALUE (*)())unsafe_write,(VALUE) args, &error);
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  //libfuse reuses buf for the next request, a handler holding on to the
+  //view gets an error instead of stale data
+  if (borrowed)
+    rb_io_buffer_free(args[1]);
+#endif
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_readahead_drop(path,0,ffi);
+    rf_attr_changed(path,RF_ATTR_PATH);
     return NUM2INT(res);
   }
 }
 
-//----------------------STATFS
-static VALUE unsafe_statfs(VALUE *args)
+//with Fuse#write_behind, writes following each other are acknowledged
+//here and handed to the handler together, see rf_write_deliver
+static int rf_write(const char *path,const char *buf,size_t size,
+  off_t offset,struct fuse_file_info *ffi)
 {
-  VALUE path = args[0];
+  struct intern_fuse *inf = rf_current();
+  struct open_file *h = open_file_of(ffi);
+
+  //writes to the file through other handles came first
+  rf_write_deliver_path(path,0,h);
+  if (inf->write_behind == 0 || h == NULL) {
+    if (h != NULL && h->wb != NULL)
+      rf_write_deliver(h,NULL); //turned off meanwhile
+    return rf_write_handler(path,buf,size,offset,ffi);
+  }
+  if (h->wb == NULL)
+    h->wb = writebehind_new();
 
-  struct fuse_context *ctx = fuse_get_context();
+  if (!writebehind_fits(h->wb,size,offset,inf->write_behind,
+      inf->write_behind_age))
+  {
+    if (rf_write_deliver(h,NULL))
+      return -EBADF; //released meanwhile
+    //too large to be worth holding back
+    if (!writebehind_fits(h->wb,size,offset,inf->write_behind,
+        inf->write_behind_age))
+      return rf_write_handler(path,buf,size,offset,ffi);
+  }
+  if (h->wb->len == 0)
+    inf->wb_pending++;
+  writebehind_add(h->wb,path,buf,size,offset,ffi,inf->write_behind);
+  inf->wb_stats.writes++;
+  return size;
+}
+
+#if FUSE_VERSION >= 29
+//----------------------READ_BUF
+// read_buf(ctx, path, size, offset, ffi) may answer with where the data
+// lives instead of the data: [io, pos, length], io an IO or a file
+// descriptor. libfuse then moves the bytes from the file to the kernel
+// itself, with splice() if CAP_SPLICE_WRITE was asked for in init(). The
+// io has to stay open, it is read after read_buf returns (an IO is kept
+// from being collected until then). Anything read() may return works too.
+// Takes precedence over read and read_into.
+
+static int rf_fd_of(VALUE io)
+{
+  if (FIXNUM_P(io))
+    return FIX2INT(io);
+  return NUM2INT(rb_funcall(io,rb_intern("fileno"),0));
+}
 
-  return rb_funcall(fuse_object,rb_intern("statfs"),2,
-        wrap_context(ctx),path);
+static int rf_is_fd(VALUE io)
+{
+  return FIXNUM_P(io) || rb_obj_is_kind_of(io,rb_cIO);
 }
 
-static int rf_statfs(const char * path, struct statvfs * vfsinfo)
+// libfuse reads the io after read_buf returned, without the GVL: a
+// temporary one ([File.open(p), 0, n]) mustn't be collected and closed
+// before. The calling fiber keeps it until its next read_buf; the request
+// is replied to by then, or the fiber is gone (loop_fiber) which happens
+// after its reply.
+static ID id_read_buf_io;
+
+static VALUE unsafe_read_buf(VALUE *args)
 {
-  VALUE args[1];
+  VALUE path   = args[0];
+  VALUE size   = args[1];
+  VALUE offset = args[2];
+  VALUE ffi    = args[3];
+  struct fuse_bufvec **bufp = (struct fuse_bufvec **) args[4];
+  struct fuse_bufvec *bv;
+  struct rf_bytes bytes;
   VALUE res;
-  int error = 0;
 
-  args[0] = rb_str_new2(path);
+  struct fuse_context *ctx=fuse_get_context();
 
-  res = rb_protect((VALUE (*)())unsafe_statfs,(VALUE) args,&error);
+  res = RF_FUNCALL(RF_OP_READ_BUF,5,
+        rf_context(ctx),path,size,offset,ffi);
+  if (rf_errno_of(res))
+    return res;
 
-  if (error || (res == Qnil))
+  if (RB_TYPE_P(res,T_ARRAY) && RARRAY_LEN(res) == 3 &&
+      rf_is_fd(rb_ary_entry(res,0)))
   {
-    return -(return_error(ENOENT));
+    int fd    = rf_fd_of(rb_ary_entry(res,0));
+    off_t pos = NUM2OFFT(rb_ary_entry(res,1));
+    long len  = NUM2LONG(rb_ary_entry(res,2));
+
+    if (len < 0 || (size_t) len > NUM2SIZET(size))
+      rb_raise(rb_eRangeError,"read_buf returned %ld bytes",len);
+
+    bv  = malloc(sizeof(struct fuse_bufvec));
+    *bv = FUSE_BUFVEC_INIT(len);
+    bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    bv->buf[0].fd    = fd;
+    bv->buf[0].pos   = pos;
+    if (!FIXNUM_P(rb_ary_entry(res,0)))
+      rb_thread_local_aset(rb_thread_current(),id_read_buf_io,
+        rb_ary_entry(res,0));
   }
   else
   {
-    rstatvfs2statvfs(res,vfsinfo);
-    return 0;
+    rf_bytes_of(res,&bytes);
+    if ((size_t) bytes.len > NUM2SIZET(size))
+      rb_raise(rb_eRangeError,"read_buf returned %ld bytes",bytes.len);
+
+    //libfuse frees mem along with the bufvec
+    bv  = malloc(sizeof(struct fuse_bufvec));
+    *bv = FUSE_BUFVEC_INIT(bytes.len);
+    if (bytes.len > 0)
+    {
+      bv->buf[0].mem = malloc(bytes.len);
+      memcpy(bv->buf[0].mem,bytes.ptr,bytes.len);
+    }
   }
-}
-
-//----------------------SETXATTR
-
-static VALUE unsafe_setxattr(VALUE *args)
-{
-
-  VALUE path  = args[0];
-  VALUE name  = args[1];
-  VALUE value = args[2];
-  VALUE size  = args[3];
-  VALUE flags = args[4];
-
-  struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("setxattr"),6,
-        wrap_context(ctx),path,name,value,size,flags);
+  *bufp = bv;
+  return res;
 }
 
-static int rf_setxattr(const char *path,const char *name,
-           const char *value, size_t size, int flags)
+static int rf_read_buf(const char *path,struct fuse_bufvec **bufp,
+  size_t size,off_t offset,struct fuse_file_info *ffi)
 {
   VALUE args[5];
-  VALUE res;
   int error = 0;
 
-  args[0]=rb_str_new2(path);
-  args[1]=rb_str_new2(name);
-  args[2]=rb_str_new(value,size);
-  args[3]=INT2NUM(size);
-  args[4]=INT2NUM(flags);
+  rf_write_settle(path,ffi);
+  args[0]=rf_path(path);
+  args[1]=SIZET2NUM(size);
+  args[2]=OFFT2NUM(offset);
+  args[3]=rf_file_info(RF_OP_READ_BUF,ffi);
+  args[4]=(VALUE) bufp;
 
-  res=rb_protect((VALUE (*)())unsafe_setxattr,(VALUE) args,&error);
+  rf_protect((VALUE (*)())unsafe_read_buf,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
-  else
-  {
+  return 0;
+}
+
+//----------------------WRITE_BUF
+// write_buf(ctx, path, size, offset, ffi) returns where the data goes: an
+// IO or a file descriptor, written at offset, or [io, pos]. The request is
+// copied there without the GVL, spliced from /dev/fuse when libfuse
+// received it that way. nil passes the data on to write() as usual.
+
+struct rf_buf_dst {
+  int   fd;  //-1: nil, use write()
+  off_t pos;
+};
+
+static VALUE unsafe_write_buf(VALUE *args)
+{
+  VALUE path   = args[0];
+  VALUE size   = args[1];
+  VALUE offset = args[2];
+  VALUE ffi    = args[3];
+  struct rf_buf_dst *dst = (struct rf_buf_dst *) args[4];
+  VALUE res;
+
+  struct fuse_context *ctx=fuse_get_context();
+
+  res = RF_FUNCALL(RF_OP_WRITE_BUF,5,
+        rf_context(ctx),path,size,offset,ffi);
+
+  dst->fd  = -1;
+  dst->pos = NUM2OFFT(offset);
+  if (rf_errno_of(res))
+    return res;
+  if (RB_TYPE_P(res,T_ARRAY))
+  {
+    dst->fd  = rf_fd_of(rb_ary_entry(res,0));
+    dst->pos = NUM2OFFT(rb_ary_entry(res,1));
+  }
+  else if (!NIL_P(res))
+  {
+    dst->fd  = rf_fd_of(res);
+  }
+  return res;
+}
+
+struct rf_buf_copy {
+  struct fuse_bufvec *dst;
+  struct fuse_bufvec *src;
+  ssize_t res;
+};
+
+static void *rf_buf_copy_nogvl(void *data)
+{
+  struct rf_buf_copy *c = data;
+  c->res = fuse_buf_copy(c->dst,c->src,FUSE_BUF_SPLICE_NONBLOCK);
+  return NULL;
+}
+
+static int rf_write_buf(const char *path,struct fuse_bufvec *buf,
+  off_t offset,struct fuse_file_info *ffi)
+{
+  VALUE args[5];
+  VALUE res;
+  int error = 0;
+  size_t size = fuse_buf_size(buf);
+  struct fuse_bufvec dstv = FUSE_BUFVEC_INIT(size);
+  struct rf_buf_dst dst;
+  struct rf_buf_copy c;
+
+  rf_write_settle(path,ffi);
+  args[0]=rf_path(path);
+  args[1]=SIZET2NUM(size);
+  args[2]=OFFT2NUM(offset);
+  args[3]=rf_file_info(RF_OP_WRITE_BUF,ffi);
+  args[4]=(VALUE) &dst;
+
+  res=rf_protect((VALUE (*)())unsafe_write_buf,(VALUE) args,&error);
+
+  if (error)
+  {
+    return -(rf_error(error,ENOENT));
+  }
+
+  if (dst.fd < 0)
+  {
+    //into memory, and on to the plain write()
+    int ret;
+    if (!RESPOND_TO(rf_current(),RF_OP_WRITE))
+      return -ENOSYS;
+    dstv.buf[0].mem = malloc(size);
+    c.res = fuse_buf_copy(&dstv,buf,0);
+    ret = c.res < 0 ? (int) c.res :
+      rf_write(path,dstv.buf[0].mem,c.res,offset,ffi);
+    free(dstv.buf[0].mem);
+    return ret;
+  }
+
+  dstv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  dstv.buf[0].fd    = dst.fd;
+  dstv.buf[0].pos   = dst.pos;
+  c.dst = &dstv;
+  c.src = buf;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(rf_buf_copy_nogvl,&c,RUBY_UBF_IO,NULL);
+#else
+  rf_buf_copy_nogvl(&c);
+#endif
+  //the io write_buf returned may be all that holds dst.fd open
+  RB_GC_GUARD(res);
+  if (c.res > 0)
+  {
+    rf_readahead_drop(path,0,ffi);
+    rf_attr_changed(path,RF_ATTR_PATH);
+  }
+  return c.res;
+}
+#endif
+
+//----------------------STATFS
+static VALUE unsafe_statfs(VALUE *args)
+{
+  VALUE path = args[0];
+
+  struct fuse_context *ctx = fuse_get_context();
+
+  return RF_FUNCALL(RF_OP_STATFS,2,
+        rf_context(ctx),path);
+}
+
+static int rf_statfs(const char * path, struct statvfs * vfsinfo)
+{
+  VALUE args[1];
+  VALUE res;
+  int error = 0;
+
+  args[0] = rf_path(path);
+
+  res = rf_protect((VALUE (*)())unsafe_statfs,(VALUE) args,&error);
+
+  if (error || (res == Qnil))
+  {
+    return -(rf_error(error,ENOENT));
+  }
+  else
+  {
+    rstatvfs2statvfs(res,vfsinfo);
+    return 0;
+  }
+}
+
+//----------------------SETXATTR
+
+static VALUE unsafe_setxattr(VALUE *args)
+{
+
+  VALUE path  = args[0];
+  VALUE name  = args[1];
+  VALUE value = args[2];
+  VALUE size  = args[3];
+  VALUE flags = args[4];
+
+  struct fuse_context *ctx=fuse_get_context();
+
+  return RF_FUNCALL(RF_OP_SETXATTR,6,
+        rf_context(ctx),path,name,value,size,flags);
+}
+
+static int rf_setxattr(const char *path,const char *name,
+           const char *value, size_t size, int flags)
+{
+  VALUE args[5];
+  VALUE res;
+  int error = 0;
+
+  args[0]=rf_path(path);
+  args[1]=rb_str_new2(name);
+  args[2]=rb_str_new(value,size);
+  args[3]=INT2NUM(size);
+  args[4]=INT2NUM(flags);
+
+  res=rf_protect((VALUE (*)())unsafe_setxattr,(VALUE) args,&error);
+
+  if (error)
+  {
+    return -(rf_error(error,ENOENT));
+  }
+  else
+  {
     return 0;
   }
 }
@@ -913,39 +1979,48 @@ static VALUE unsafe_getxattr(VALUE *args)
   VALUE path = args[0];
   VALUE name = args[1];
   VALUE size = args[2];
+  VALUE res;
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("getxattr"),4,
-        wrap_context(ctx),path,name,size);
+  res = RF_FUNCALL(RF_OP_GETXATTR,4,
+        rf_context(ctx),path,name,size);
+  if (rf_errno_of(res))
+    return res;
+  rf_bytes_of(res, (struct rf_bytes *) args[3]);
+  return res;
 }
 
 static int rf_getxattr(const char *path,const char *name,char *buf,
            size_t size)
 {
-  VALUE args[3];
+  VALUE args[4];
   VALUE res;
-  char *rbuf;
-  long length = 0;
+  struct rf_bytes bytes;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=rb_str_new2(name);
   args[2]=INT2NUM(size);
-  res=rb_protect((VALUE (*)())unsafe_getxattr,(VALUE) args,&error);
+  args[3]=(VALUE) &bytes;
+  res=rf_protect((VALUE (*)())unsafe_getxattr,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
-    rbuf=rb_str2cstr(res,&length); //TODO protect this, too
-    if (buf != NULL)
+    //size 0 is just asking for the length
+    if (size != 0)
     {
-      memcpy(buf,rbuf,length); //First call is just to get the length
-      //TODO optimize
+      if (bytes.len > (long) size)
+      {
+        return -ERANGE;
+      }
+      memcpy(buf,bytes.ptr,bytes.len);
     }
-    return length;
+    RB_GC_GUARD(res);
+    return bytes.len;
   }
 }
 
@@ -958,8 +2033,8 @@ static VALUE unsafe_listxattr(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("listxattr"),3,
-        wrap_context(ctx),path,size);
+  return RF_FUNCALL(RF_OP_LISTXATTR,3,
+        rf_context(ctx),path,size);
 }
 
 static int rf_listxattr(const char *path,char *buf,
@@ -970,13 +2045,13 @@ static int rf_listxattr(const char *path,char *buf,
   char *rbuf;
   size_t length =0;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2NUM(size);
-  res=rb_protect((VALUE (*)())unsafe_listxattr,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_listxattr,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1011,8 +2086,8 @@ static VALUE unsafe_removexattr(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("removexattr"),3,
-        wrap_context(ctx),path,name);
+  return RF_FUNCALL(RF_OP_REMOVEXATTR,3,
+        rf_context(ctx),path,name);
 }
 
 static int rf_removexattr(const char *path,const char *name)
@@ -1020,13 +2095,13 @@ static int rf_removexattr(const char *path,const char *name)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=rb_str_new2(name);
-  res=rb_protect((VALUE (*)())unsafe_removexattr,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_removexattr,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1043,7 +2118,7 @@ static VALUE unsafe_opendir(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("opendir"),3,wrap_context(ctx),path,ffi);
+  return RF_FUNCALL(RF_OP_OPENDIR,3,rf_context(ctx),path,ffi);
 }
 
 static int rf_opendir(const char *path,struct fuse_file_info *ffi)
@@ -1051,13 +2126,15 @@ static int rf_opendir(const char *path,struct fuse_file_info *ffi)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  args[1]=wrap_file_info(ffi);
-  res=rb_protect((VALUE (*)())unsafe_opendir,(VALUE) args,&error);
+  args[0]=rf_path(path);
+  rf_handle_open(ffi);
+  args[1]=rf_file_info(RF_OP_OPENDIR,ffi);
+  res=rf_protect((VALUE (*)())unsafe_opendir,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    rf_handle_release(ffi);
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1074,7 +2151,7 @@ static VALUE unsafe_releasedir(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("releasedir"),3,wrap_context(ctx),path,ffi);
+  return RF_FUNCALL(RF_OP_RELEASEDIR,3,rf_context(ctx),path,ffi);
 }
 
 static int rf_releasedir(const char *path,struct fuse_file_info *ffi)
@@ -1082,13 +2159,17 @@ static int rf_releasedir(const char *path,struct fuse_file_info *ffi)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
-  args[1]=wrap_file_info(ffi);
-  res=rb_protect((VALUE (*)())unsafe_releasedir,(VALUE) args,&error);
+  if (RESPOND_TO(rf_current(),RF_OP_RELEASEDIR))
+  {
+    args[0]=rf_path(path);
+    args[1]=rf_file_info(RF_OP_RELEASEDIR,ffi);
+    res=rf_protect((VALUE (*)())unsafe_releasedir,(VALUE) args,&error);
+  }
+  rf_handle_release(ffi);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1106,7 +2187,7 @@ static VALUE unsafe_fsyncdir(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("fsyncdir"),4,wrap_context(ctx),path,
+  return RF_FUNCALL(RF_OP_FSYNCDIR,4,rf_context(ctx),path,
         meta,ffi);
 }
 
@@ -1115,14 +2196,14 @@ static int rf_fsyncdir(const char *path,int meta,struct fuse_file_info *ffi)
   VALUE args[3];
   VALUE res;
   int error = 0;
-  args[0]=rb_str_new2(path);
+  args[0]=rf_path(path);
   args[1]=INT2NUM(meta);
-  args[2]=wrap_file_info(ffi);
-  res=rb_protect((VALUE (*)())unsafe_fsyncdir,(VALUE) args,&error);
+  args[2]=rf_file_info(RF_OP_FSYNCDIR,ffi);
+  res=rf_protect((VALUE (*)())unsafe_fsyncdir,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1131,38 +2212,69 @@ static int rf_fsyncdir(const char *path,int meta,struct fuse_file_info *ffi)
 }
 
 //----------------------INIT
+
+// Kernel passthrough is asked for whenever files can be opened, it only
+// changes anything for files bound with FileInfo#passthrough=. It doesn't
+// go with the writeback cache.
+static void rf_want_passthrough(struct fuse_conn_info *conn)
+{
+#ifdef RFUSE_PASSTHROUGH
+  struct intern_fuse *inf = rf_current();
+
+  if ((conn->capable & FUSE_CAP_PASSTHROUGH) &&
+      !(conn->want & FUSE_CAP_WRITEBACK_CACHE) &&
+      (RESPOND_TO(inf,RF_OP_OPEN) || RESPOND_TO(inf,RF_OP_CREATE)))
+  {
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+    if (conn->max_backing_stack_depth == 0)
+      conn->max_backing_stack_depth = 1;
+  }
+  inf->passthrough = (conn->want & FUSE_CAP_PASSTHROUGH) != 0;
+#endif
+}
+
 static VALUE unsafe_init(VALUE* args)
 {
   VALUE rfuseconninfo = args[0];
+  struct fuse_conn_info *conn = (struct fuse_conn_info *) args[1];
+  VALUE res;
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("init"),2,wrap_context(ctx),
+  res = RF_FUNCALL(RF_OP_INIT,2,wrap_context(ctx),
     rfuseconninfo);
+
+  //The handler may have asked for more (or less), see RFuse::CAP_*. The
+  //kernel only gets what it offered.
+  conn->want = NUM2UINT(rb_struct_aref(rfuseconninfo,INT2FIX(6))) &
+    conn->capable;
+  return res;
 }
 
+// Registered without an init handler too when passthrough is compiled in:
+// the negotiation happens here, whatever the handler did
 static void *rf_init(struct fuse_conn_info *conn)
 {
-  VALUE args[1];
+  struct intern_fuse *inf = rf_current();
+  VALUE args[2];
   VALUE res;
   int error = 0;
 
-  //Create a struct for the conn_info
-  VALUE s  = rb_const_get(rb_cObject,rb_intern("Struct"));
-  VALUE fci = rb_funcall(s,rb_intern("new"),7,
-    ID2SYM(rb_intern("proto_major")),
-    ID2SYM(rb_intern("proto_minor")),
-    ID2SYM(rb_intern("async_read")),
-    ID2SYM(rb_intern("max_write")),
-    ID2SYM(rb_intern("max_readahead")),
-    ID2SYM(rb_intern("capable")),
-    ID2SYM(rb_intern("want"))
-  );
+  inf->init_data = (void *) Qnil;
+  if (!RESPOND_TO(inf,RF_OP_INIT)) {
+    rf_want_passthrough(conn);
+    return inf;
+  }
 
-  VALUE fcio = rb_funcall(fci,rb_intern("new"),7,
+  //Create a struct for the conn_info
+  VALUE fcio = rb_struct_new(cConnInfo,
     UINT2NUM(conn->proto_major),
     UINT2NUM(conn->proto_minor),
+#ifdef RFUSE_FUSE3
+    UINT2NUM((conn->want & FUSE_CAP_ASYNC_READ) != 0),
+#else
     UINT2NUM(conn->async_read),
+#endif
     UINT2NUM(conn->max_write),
     UINT2NUM(conn->max_readahead),
     UINT2NUM(conn->capable),
@@ -1170,17 +2282,15 @@ static void *rf_init(struct fuse_conn_info *conn)
   );
 
   args[0] = fcio;
+  args[1] = (VALUE) conn;
 
   res = rb_protect((VALUE (*)())unsafe_init,(VALUE) args,&error);
+  rf_want_passthrough(conn);
 
-  if (error)
-  {
-    return NULL;
-  }
-  else
-  {
-    return (void *)res;
-  }
+  //Whatever init returns becomes private_data, which has to stay our
+  //intern_fuse. Keep the result for destroy().
+  inf->init_data = (void *) (error ? Qnil : res);
+  return inf;
 }
 
 //----------------------DESTROY
@@ -1191,7 +2301,7 @@ static VALUE unsafe_destroy(VALUE* args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("destroy"),2,wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_DESTROY,2,wrap_context(ctx),
     user_data);
 }
 
@@ -1200,7 +2310,7 @@ static void rf_destroy(void *user_data)
   VALUE args[1];
   int error = 0;
 
-  args[0] = (VALUE)user_data;
+  args[0] = (VALUE)((struct intern_fuse *) user_data)->init_data;
 
   rb_protect((VALUE (*)())unsafe_destroy,(VALUE) args,&error);
   // TODO: some kind of logging would be nice here.
@@ -1215,7 +2325,7 @@ static VALUE unsafe_access(VALUE* args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("access"),3,wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_ACCESS,3,rf_context(ctx),
     path, mask);
 }
 
@@ -1224,13 +2334,13 @@ static int rf_access(const char *path, int mask)
   VALUE args[2];
   VALUE res;
   int error = 0;
-  args[0] = rb_str_new2(path);
+  args[0] = rf_path(path);
   args[1] = INT2NUM(mask);
-  res = rb_protect((VALUE (*)())unsafe_access,(VALUE) args,&error);
+  res = rf_protect((VALUE (*)())unsafe_access,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1248,7 +2358,7 @@ static VALUE unsafe_create(VALUE* args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("create"),4,wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_CREATE,4,rf_context(ctx),
     path, mode, ffi);
 }
 
@@ -1259,18 +2369,22 @@ static int rf_create(const char *path, mode_t mode,
   VALUE res;
   int error = 0;
 
-  args[0] = rb_str_new2(path);
+  args[0] = rf_path(path);
   args[1] = INT2NUM(mode);
-  args[2] = wrap_file_info(ffi);
+  rf_handle_open(ffi);
+  args[2] = rf_file_info(RF_OP_CREATE,ffi);
 
-  res = rb_protect((VALUE (*)())unsafe_create,(VALUE) args,&error);
+  res = rf_protect((VALUE (*)())unsafe_create,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    rf_handle_release(ffi);
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(path,RF_ATTR_ENTRY);
+    rf_handle_backing(ffi);
     return 0;
   }
 }
@@ -1285,7 +2399,7 @@ static VALUE unsafe_ftruncate(VALUE* args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("ftruncate"),4,wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_FTRUNCATE,4,rf_context(ctx),
     path, size, ffi);
 }
 
@@ -1296,18 +2410,21 @@ static int rf_ftruncate(const char *path, off_t size,
   VALUE res;
   int error = 0;
 
-  args[0] = rb_str_new2(path);
+  rf_write_settle(path,ffi);
+  args[0] = rf_path(path);
   args[1] = INT2NUM(size);
-  args[2] = wrap_file_info(ffi);
+  args[2] = rf_file_info(RF_OP_FTRUNCATE,ffi);
 
-  res = rb_protect((VALUE (*)())unsafe_ftruncate,(VALUE) args,&error);
+  res = rf_protect((VALUE (*)())unsafe_ftruncate,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_readahead_drop(path,0,ffi);
+    rf_attr_changed(path,RF_ATTR_PATH);
     return 0;
   }
 }
@@ -1321,7 +2438,7 @@ static VALUE unsafe_fgetattr(VALUE *args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("fgetattr"),3,wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_FGETATTR,3,rf_context(ctx),
     path,ffi);
 }
 
@@ -1332,14 +2449,15 @@ static int rf_fgetattr(const char *path, struct stat *stbuf,
   VALUE res;
   int error = 0;
 
-  args[0] = rb_str_new2(path);
-  args[1] = wrap_file_info(ffi);
+  rf_write_settle(path,ffi);
+  args[0] = rf_path(path);
+  args[1] = rf_file_info(RF_OP_FGETATTR,ffi);
 
-  res=rb_protect((VALUE (*)())unsafe_fgetattr,(VALUE) args,&error);
+  res=rf_protect((VALUE (*)())unsafe_fgetattr,(VALUE) args,&error);
 
   if (error || (res == Qnil))
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1359,7 +2477,7 @@ static VALUE unsafe_lock(VALUE *args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall(fuse_object,rb_intern("lock"),5,wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_LOCK,5,rf_context(ctx),
     path,ffi,cmd,lock);
 }
 
@@ -1371,16 +2489,7 @@ static int rf_lock(const char *path, struct fuse_file_info *ffi,
   int error = 0;
 
   //Create a struct for the lock structure
-  VALUE s  = rb_const_get(rb_cObject,rb_intern("Struct"));
-  VALUE lockc = rb_funcall(s,rb_intern("new"),5,
-    ID2SYM(rb_intern("l_type")),
-    ID2SYM(rb_intern("l_whence")),
-    ID2SYM(rb_intern("l_start")),
-    ID2SYM(rb_intern("l_len")),
-    ID2SYM(rb_intern("l_pid"))
-  );
-
-  VALUE locko = rb_funcall(lockc,rb_intern("new"),5,
+  VALUE locko = rb_struct_new(cFlock,
     UINT2NUM(lock->l_type),
     UINT2NUM(lock->l_whence),
     UINT2NUM(lock->l_start),
@@ -1388,16 +2497,16 @@ static int rf_lock(const char *path, struct fuse_file_info *ffi,
     UINT2NUM(lock->l_pid)
   );
 
-  args[0] = rb_str_new2(path);
-  args[1] = wrap_file_info(ffi);
+  args[0] = rf_path(path);
+  args[1] = rf_file_info(RF_OP_LOCK,ffi);
   args[2] = INT2NUM(cmd);
   args[3] = locko;
 
-  res = rb_protect((VALUE (*)())unsafe_lock,(VALUE) args,&error);
+  res = rf_protect((VALUE (*)())unsafe_lock,(VALUE) args,&error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1415,11 +2524,8 @@ static VALUE unsafe_utimens(VALUE *args)
 
   struct fuse_context *ctx=fuse_get_context();
 
-  return rb_funcall(
-    fuse_object,
-    rb_intern("utimens"),
-    4,
-    wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_UTIMENS,4,
+    rf_context(ctx),
     path,actime,modtime
   );
 }
@@ -1430,31 +2536,21 @@ static int rf_utimens(const char * path, const struct timespec tv[2])
   VALUE res;
   int   error = 0;
 
-  args[0] = rb_str_new2(path);
+  args[0] = rf_path(path);
 
   // tv_sec * 1000000 + tv_nsec
-  args[1] = rb_funcall(
-    rb_funcall(
-      INT2NUM(tv[0].tv_sec), rb_intern("*"), 1, INT2NUM(1000000)
-    ),
-    rb_intern("+"), 1, INT2NUM(tv[0].tv_nsec)
-  );
-
-  args[2] = rb_funcall(
-    rb_funcall(
-      INT2NUM(tv[1].tv_sec), rb_intern("*"), 1, INT2NUM(1000000)
-    ),
-    rb_intern("+"), 1, INT2NUM(tv[1].tv_nsec)
-  );
+  args[1] = LL2NUM((LONG_LONG) tv[0].tv_sec * 1000000 + tv[0].tv_nsec);
+  args[2] = LL2NUM((LONG_LONG) tv[1].tv_sec * 1000000 + tv[1].tv_nsec);
   
-  res = rb_protect((VALUE (*)())unsafe_utimens,(VALUE) args, &error);
+  res = rf_protect((VALUE (*)())unsafe_utimens,(VALUE) args, &error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
+    rf_attr_changed(path,RF_ATTR_PATH);
     return 0;
   }
 }
@@ -1469,7 +2565,7 @@ static VALUE unsafe_bmap(VALUE *args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall( fuse_object, rb_intern("bmap"), 4, wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_BMAP,4, rf_context(ctx),
     path, blocksize, idx);
 }
 
@@ -1479,15 +2575,15 @@ static int rf_bmap(const char *path, size_t blocksize, uint64_t *idx)
   VALUE res;
   int   error = 0;
 
-  args[0] = rb_str_new2(path);
+  args[0] = rf_path(path);
   args[1] = INT2NUM(blocksize);
   args[2] = LL2NUM(*idx);
 
-  res = rb_protect((VALUE (*)())unsafe_bmap,(VALUE) args, &error);
+  res = rf_protect((VALUE (*)())unsafe_bmap,(VALUE) args, &error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1509,7 +2605,7 @@ static VALUE unsafe_ioctl(VALUE *args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall( fuse_object, rb_intern("ioctl"), 7, wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_IOCTL,7, rf_context(ctx),
     path, cmd, arg, ffi, flags, data);
 }
 
@@ -1520,18 +2616,18 @@ static int rf_ioctl(const char *path, int cmd, void *arg,
   VALUE res;
   int   error = 0;
 
-  args[0] = rb_str_new2(path);
+  args[0] = rf_path(path);
   args[1] = INT2NUM(cmd);
   args[2] = wrap_buffer(arg);
-  args[3] = wrap_file_info(ffi);
+  args[3] = rf_file_info(RF_OP_IOCTL,ffi);
   args[4] = INT2NUM(flags);
   args[5] = wrap_buffer(data);
 
-  res = rb_protect((VALUE (*)())unsafe_ioctl,(VALUE) args, &error);
+  res = rf_protect((VALUE (*)())unsafe_ioctl,(VALUE) args, &error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
 
   return 0;
@@ -1548,7 +2644,7 @@ static VALUE unsafe_poll(VALUE *args)
 
   struct fuse_context *ctx = fuse_get_context();
 
-  return rb_funcall( fuse_object, rb_intern("poll"), 5, wrap_context(ctx),
+  return RF_FUNCALL(RF_OP_POLL,5, rf_context(ctx),
     path, ffi, ph, reventsp);
 }
 
@@ -1559,16 +2655,16 @@ static int rf_poll(const char *path, struct fuse_file_info *ffi,
   VALUE res;
   int   error = 0;
 
-  args[0] = rb_str_new2(path);
-  args[1] = wrap_file_info(ffi);
+  args[0] = rf_path(path);
+  args[1] = rf_file_info(RF_OP_POLL,ffi);
   args[2] = wrap_pollhandle(ph);
   args[3] = INT2NUM(*reventsp);
 
-  res = rb_protect((VALUE (*)())unsafe_poll,(VALUE) args, &error);
+  res = rf_protect((VALUE (*)())unsafe_poll,(VALUE) args, &error);
 
   if (error)
   {
-    return -(return_error(ENOENT));
+    return -(rf_error(error,ENOENT));
   }
   else
   {
@@ -1577,222 +2673,1620 @@ static int rf_poll(const char *path, struct fuse_file_info *ffi,
   return 0;
 }
 
-//----------------------LOOP
+//----------------------GVL
+// Fuse#loop waits for and processes kernel commands with the GVL released,
+// so other ruby threads keep running while the mount is idle. libfuse then
+// calls us back on a thread that doesn't hold the GVL: the operations
+// registered with fuse are the gvl_* shims below, which take the GVL back
+// for the duration of the rf_* trampoline only.
 
-static VALUE rf_loop(VALUE self)
-{
-  struct intern_fuse *inf;
-  Data_Get_Struct(self,struct intern_fuse,inf);
-  fuse_loop(inf->fuse);
-  return Qnil;
-}
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
 
-//----------------------LOOP_MT
+// Set while this thread runs libfuse code with the GVL released
+static __thread int rf_gvl_released = 0;
 
-static VALUE rf_loop_mt(VALUE self)
+static void *rf_call_with_gvl(void *(*func)(void *), void *data)
 {
-  struct intern_fuse *inf;
-  Data_Get_Struct(self,struct intern_fuse,inf);
-  fuse_loop_mt(inf->fuse);
-  return Qnil;
+  void *res;
+  rf_gvl_released = 0;
+  res = rb_thread_call_with_gvl(func, data);
+  rf_gvl_released = 1;
+  return res;
 }
 
-//----------------------EXIT
+#define RF_GVL_SHIM(type, name, params, args, call, pack) \
+  static void *gvl_##name##_call(void *data) \
+  { \
+    struct gvl_##name##_args *p = data; \
+    p->ret = rf_##name call; \
+    return NULL; \
+  } \
+  static type gvl_##name params \
+  { \
+    struct gvl_##name##_args p; \
+    if (!rf_gvl_released) \
+      return rf_##name args; \
+    pack; \
+    rf_call_with_gvl(gvl_##name##_call, &p); \
+    return p.ret; \
+  }
 
-VALUE rf_exit(VALUE self)
+#define RF_GVL_OP1(type, name, t1, a1) \
+  struct gvl_##name##_args { t1 a1; type ret; }; \
+  RF_GVL_SHIM(type, name, (t1 a1), (a1), (p->a1), \
+    p.a1 = a1)
+
+#define RF_GVL_OP2(type, name, t1, a1, t2, a2) \
+  struct gvl_##name##_args { t1 a1; t2 a2; type ret; }; \
+  RF_GVL_SHIM(type, name, (t1 a1, t2 a2), (a1, a2), (p->a1, p->a2), \
+    p.a1 = a1; p.a2 = a2)
+
+#define RF_GVL_OP3(type, name, t1, a1, t2, a2, t3, a3) \
+  struct gvl_##name##_args { t1 a1; t2 a2; t3 a3; type ret; }; \
+  RF_GVL_SHIM(type, name, (t1 a1, t2 a2, t3 a3), (a1, a2, a3), \
+    (p->a1, p->a2, p->a3), \
+    p.a1 = a1; p.a2 = a2; p.a3 = a3)
+
+#define RF_GVL_OP4(type, name, t1, a1, t2, a2, t3, a3, t4, a4) \
+  struct gvl_##name##_args { t1 a1; t2 a2; t3 a3; t4 a4; type ret; }; \
+  RF_GVL_SHIM(type, name, (t1 a1, t2 a2, t3 a3, t4 a4), (a1, a2, a3, a4), \
+    (p->a1, p->a2, p->a3, p->a4), \
+    p.a1 = a1; p.a2 = a2; p.a3 = a3; p.a4 = a4)
+
+#define RF_GVL_OP5(type, name, t1, a1, t2, a2, t3, a3, t4, a4, t5, a5) \
+  struct gvl_##name##_args { t1 a1; t2 a2; t3 a3; t4 a4; t5 a5; type ret; }; \
+  RF_GVL_SHIM(type, name, (t1 a1, t2 a2, t3 a3, t4 a4, t5 a5), \
+    (a1, a2, a3, a4, a5), \
+    (p->a1, p->a2, p->a3, p->a4, p->a5), \
+    p.a1 = a1; p.a2 = a2; p.a3 = a3; p.a4 = a4; p.a5 = a5)
+
+#define RF_GVL_OP6(type, name, t1, a1, t2, a2, t3, a3, t4, a4, t5, a5, t6, a6) \
+  struct gvl_##name##_args { \
+    t1 a1; t2 a2; t3 a3; t4 a4; t5 a5; t6 a6; type ret; \
+  }; \
+  RF_GVL_SHIM(type, name, (t1 a1, t2 a2, t3 a3, t4 a4, t5 a5, t6 a6), \
+    (a1, a2, a3, a4, a5, a6), \
+    (p->a1, p->a2, p->a3, p->a4, p->a5, p->a6), \
+    p.a1 = a1; p.a2 = a2; p.a3 = a3; p.a4 = a4; p.a5 = a5; p.a6 = a6)
+
+#define GVL(name) gvl_##name
+
+#else
+
+#define RF_GVL_OP1(type, name, ...)
+#define RF_GVL_OP2(type, name, ...)
+#define RF_GVL_OP3(type, name, ...)
+#define RF_GVL_OP4(type, name, ...)
+#define RF_GVL_OP5(type, name, ...)
+#define RF_GVL_OP6(type, name, ...)
+
+#define GVL(name) rf_##name
+
+#endif
+
+typedef const char *path_t;
+typedef struct fuse_file_info *ffi_t;
+
+RF_GVL_OP2(int, getattr,     path_t, path, struct stat *, stbuf)
+RF_GVL_OP3(int, readlink,    path_t, path, char *, buf, size_t, size)
+#ifndef RFUSE_FUSE3
+RF_GVL_OP3(int, getdir,      path_t, path, fuse_dirh_t, dh, fuse_dirfil_t, df)
+#endif
+RF_GVL_OP3(int, mknod,       path_t, path, mode_t, mode, dev_t, dev)
+RF_GVL_OP2(int, mkdir,       path_t, path, mode_t, mode)
+RF_GVL_OP1(int, unlink,      path_t, path)
+RF_GVL_OP1(int, rmdir,       path_t, path)
+RF_GVL_OP2(int, symlink,     path_t, path, path_t, as)
+RF_GVL_OP2(int, rename,      path_t, path, path_t, as)
+RF_GVL_OP2(int, link,        path_t, path, path_t, as)
+RF_GVL_OP2(int, chmod,       path_t, path, mode_t, mode)
+RF_GVL_OP3(int, chown,       path_t, path, uid_t, uid, gid_t, gid)
+RF_GVL_OP2(int, truncate,    path_t, path, off_t, offset)
+RF_GVL_OP2(int, utime,       path_t, path, struct utimbuf *, utim)
+RF_GVL_OP2(int, open,        path_t, path, ffi_t, ffi)
+RF_GVL_OP5(int, read,        path_t, path, char *, buf, size_t, size,
+  off_t, offset, ffi_t, ffi)
+RF_GVL_OP5(int, write,       path_t, path, const char *, buf, size_t, size,
+  off_t, offset, ffi_t, ffi)
+RF_GVL_OP2(int, statfs,      path_t, path, struct statvfs *, vfsinfo)
+RF_GVL_OP2(int, flush,       path_t, path, ffi_t, ffi)
+RF_GVL_OP2(int, release,     path_t, path, ffi_t, ffi)
+RF_GVL_OP3(int, fsync,       path_t, path, int, datasync, ffi_t, ffi)
+RF_GVL_OP5(int, setxattr,    path_t, path, const char *, name,
+  const char *, value, size_t, size, int, flags)
+RF_GVL_OP4(int, getxattr,    path_t, path, const char *, name, char *, buf,
+  size_t, size)
+RF_GVL_OP3(int, listxattr,   path_t, path, char *, buf, size_t, size)
+RF_GVL_OP2(int, removexattr, path_t, path, const char *, name)
+RF_GVL_OP2(int, opendir,     path_t, path, ffi_t, ffi)
+RF_GVL_OP5(int, readdir,     path_t, path, void *, buf,
+  fuse_fill_dir_t, filler, off_t, offset, ffi_t, ffi)
+RF_GVL_OP2(int, releasedir,  path_t, path, ffi_t, ffi)
+RF_GVL_OP3(int, fsyncdir,    path_t, path, int, meta, ffi_t, ffi)
+RF_GVL_OP1(void *, init,     struct fuse_conn_info *, conn)
+RF_GVL_OP2(int, access,      path_t, path, int, mask)
+RF_GVL_OP3(int, create,      path_t, path, mode_t, mode, ffi_t, ffi)
+RF_GVL_OP3(int, ftruncate,   path_t, path, off_t, size, ffi_t, ffi)
+RF_GVL_OP3(int, fgetattr,    path_t, path, struct stat *, stbuf, ffi_t, ffi)
+RF_GVL_OP4(int, lock,        path_t, path, ffi_t, ffi, int, cmd,
+  struct flock *, lock)
+RF_GVL_OP2(int, utimens,     path_t, path, const struct timespec *, tv)
+RF_GVL_OP3(int, bmap,        path_t, path, size_t, blocksize, uint64_t *, idx)
+RF_GVL_OP6(int, ioctl,       path_t, path, int, cmd, void *, arg, ffi_t, ffi,
+  unsigned int, flags, void *, data)
+RF_GVL_OP4(int, poll,        path_t, path, ffi_t, ffi,
+  struct fuse_pollhandle *, ph, unsigned *, reventsp)
+#if FUSE_VERSION >= 29
+RF_GVL_OP5(int, read_buf,    path_t, path, struct fuse_bufvec **, bufp,
+  size_t, size, off_t, offset, ffi_t, ffi)
+RF_GVL_OP4(int, write_buf,   path_t, path, struct fuse_bufvec *, buf,
+  off_t, offset, ffi_t, ffi)
+#endif
+RF_GVL_OP2(int, readahead_written, path_t, path, ffi_t, ffi)
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+// destroy returns nothing, so it doesn't fit the macros above
+static void *gvl_destroy_call(void *user_data)
 {
-  struct intern_fuse *inf;
-  Data_Get_Struct(self,struct intern_fuse,inf);
-  fuse_exit(inf->fuse);
-  return Qnil;
+  rf_destroy(user_data);
+  return NULL;
 }
 
-//----------------------UNMOUNT
-
-VALUE rf_unmount(VALUE self)
+static void gvl_destroy(void *user_data)
 {
-  struct intern_fuse *inf;
-  Data_Get_Struct(self,struct intern_fuse,inf);
-  fuse_unmount(inf->mountname, inf->fc);
-  return Qnil;
+  if (!rf_gvl_released)
+    rf_destroy(user_data);
+  else
+    rf_call_with_gvl(gvl_destroy_call, user_data);
 }
+#endif
 
-//----------------------MOUNTNAME
+//----------------------LOOP
+// Fuse#unmount destroys the channel, which the loops read and reply to
+// without the GVL (loop_fiber with its commands suspended). Each of them
+// counts itself in inf->loopers while it runs: an unmount meanwhile only
+// exits the mount, the last one to leave unmounts it.
 
-VALUE rf_mountname(VALUE self)
+void rfuse_loop_enter(struct intern_fuse *inf)
 {
-  struct intern_fuse *inf;
-  Data_Get_Struct(self,struct intern_fuse,inf);
-  return rb_str_new2(inf->mountname);
+  inf->loopers++;
 }
 
-//----------------------INVALIDATE
+void rfuse_loop_leave(struct intern_fuse *inf)
+{
+  if (--inf->loopers == 0 && inf->unmount_pending) {
+    inf->unmount_pending = 0;
+    rfuse_write_deliver_all(inf);
+    intern_fuse_unmount(inf);
+  }
+}
 
-VALUE rf_invalidate(VALUE self,VALUE path)
+static VALUE rf_loop_left(VALUE data)
 {
-  struct intern_fuse *inf;
-  Data_Get_Struct(self,struct intern_fuse,inf);
-  return fuse_invalidate(inf->fuse,STR2CSTR(path)); //TODO: check if str?
+  rfuse_loop_leave((struct intern_fuse *) data);
+  return Qnil;
 }
 
-//----------------------FD
-// Return /dev/fuse file descriptor for use with IO.select
-VALUE rf_fd(VALUE self)
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+// Runs without the GVL: wait for one command and process it
+static void *rf_loop_step(void *data)
 {
- struct intern_fuse *inf;
- Data_Get_Struct(self,struct intern_fuse,inf);
- return INT2NUM(intern_fuse_fd(inf));
+  struct intern_fuse *inf = data;
+  long res;
+
+  res = intern_fuse_wait(inf);
+
+  if (res > 0 && !intern_fuse_exited(inf)) {
+    rf_gvl_released = 1;
+    res = intern_fuse_process(inf);
+    rf_gvl_released = 0;
+  }
+  return (void *) res;
 }
 
-//----------------------PROCESS
-// Process one fuse command from the kernel
-// returns < 0 if we're not mounted.. won't be this simple in a mt scenario
-VALUE rf_process(VALUE self)
+// Runs without the GVL: process up to max commands already queued on the
+// mount. The reactor calls this for every ready channel it is watching.
+int rfuse_process_nogvl(struct intern_fuse *inf, int max)
 {
- struct intern_fuse *inf;
- Data_Get_Struct(self,struct intern_fuse,inf);
- return INT2NUM(intern_fuse_process(inf));
+  int res;
+  rf_gvl_released = 1;
+  res = intern_fuse_process_many(inf, max, -1);
+  rf_gvl_released = 0;
+  return res;
 }
+#endif
 
-#define RESPOND_TO(obj,methodname) \
-  rb_funcall( \
-    obj,rb_intern("respond_to?"), \
-    1, rb_str_new2(methodname) \
-  ) == Qtrue
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+// The body of Fuse#loop, also run by every loop_mt worker thread.
+// Signals and Thread#raise get us out of poll(), Fuse#exit wakes us up.
+static VALUE rf_loop_run(void *data)
+{
+  struct intern_fuse *inf = data;
 
-//-------------RUBY
+  while (!inf->stopping && !intern_fuse_exited(inf)) {
+    if ((long) rb_thread_call_without_gvl(
+          rf_loop_step, inf, RUBY_UBF_IO, NULL) < 0) {
+      break;
+    }
+  }
+  return Qnil;
+}
 
-static VALUE rf_initialize(
-  VALUE self,
-  VALUE mountpoint,
-  VALUE kernelopts,
-  VALUE libopts)
+// rf_loop_run counted in inf->loopers
+static VALUE rf_loop_serve(void *data)
 {
-  Check_Type(mountpoint, T_STRING);
-  Check_Type(kernelopts, T_ARRAY);
-  Check_Type(libopts, T_ARRAY);
+  rfuse_loop_enter(data);
+  return rb_ensure((VALUE (*)()) rf_loop_run, (VALUE) data,
+    rf_loop_left, (VALUE) data);
+}
+#endif
 
+static VALUE rf_loop(VALUE self)
+{
   struct intern_fuse *inf;
   Data_Get_Struct(self,struct intern_fuse,inf);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  if (intern_fuse_prepare_loop(inf) < 0) {
+    return Qnil;
+  }
+  rf_loop_serve(inf);
+  rfuse_write_deliver_all(inf);
+#else
+  fuse_loop(inf->fuse);
+#endif
+  return Qnil;
+}
 
-  if (RESPOND_TO(self,"getattr"))
-    inf->fuse_op.getattr     = rf_getattr;
-  if (RESPOND_TO(self,"readlink"))
-    inf->fuse_op.readlink    = rf_readlink;
-  if (RESPOND_TO(self,"getdir"))
-    inf->fuse_op.getdir      = rf_getdir;  // Deprecated
-  if (RESPOND_TO(self,"mknod"))
-    inf->fuse_op.mknod       = rf_mknod;
-  if (RESPOND_TO(self,"mkdir"))
-    inf->fuse_op.mkdir       = rf_mkdir;
-  if (RESPOND_TO(self,"unlink"))
-    inf->fuse_op.unlink      = rf_unlink;
-  if (RESPOND_TO(self,"rmdir"))
-    inf->fuse_op.rmdir       = rf_rmdir;
-  if (RESPOND_TO(self,"symlink"))
-    inf->fuse_op.symlink     = rf_symlink;
-  if (RESPOND_TO(self,"rename"))
-    inf->fuse_op.rename      = rf_rename;
-  if (RESPOND_TO(self,"link"))
-    inf->fuse_op.link        = rf_link;
-  if (RESPOND_TO(self,"chmod"))
-    inf->fuse_op.chmod       = rf_chmod;
-  if (RESPOND_TO(self,"chown"))
-    inf->fuse_op.chown       = rf_chown;
-  if (RESPOND_TO(self,"truncate"))
-    inf->fuse_op.truncate    = rf_truncate;
-  if (RESPOND_TO(self,"utime"))
-    inf->fuse_op.utime       = rf_utime;    // Deprecated
-  if (RESPOND_TO(self,"open"))
-    inf->fuse_op.open        = rf_open;
-  if (RESPOND_TO(self,"read"))
-    inf->fuse_op.read        = rf_read;
-  if (RESPOND_TO(self,"write"))
-    inf->fuse_op.write       = rf_write;
-  if (RESPOND_TO(self,"statfs"))
-    inf->fuse_op.statfs      = rf_statfs;
-  if (RESPOND_TO(self,"flush"))
-    inf->fuse_op.flush       = rf_flush;
-  if (RESPOND_TO(self,"release"))
-    inf->fuse_op.release     = rf_release;
-  if (RESPOND_TO(self,"fsync"))
-    inf->fuse_op.fsync       = rf_fsync;
-  if (RESPOND_TO(self,"setxattr"))
-    inf->fuse_op.setxattr    = rf_setxattr;
-  if (RESPOND_TO(self,"getxattr"))
-    inf->fuse_op.getxattr    = rf_getxattr;
-  if (RESPOND_TO(self,"listxattr"))
-    inf->fuse_op.listxattr   = rf_listxattr;
-  if (RESPOND_TO(self,"removexattr"))
-    inf->fuse_op.removexattr = rf_removexattr;
-  if (RESPOND_TO(self,"opendir"))
-    inf->fuse_op.opendir     = rf_opendir;
-  if (RESPOND_TO(self,"readdir"))
-    inf->fuse_op.readdir     = rf_readdir;
-  if (RESPOND_TO(self,"releasedir"))
-    inf->fuse_op.releasedir  = rf_releasedir;
-  if (RESPOND_TO(self,"fsyncdir"))
-    inf->fuse_op.fsyncdir    = rf_fsyncdir;
-  if (RESPOND_TO(self,"init"))
-    inf->fuse_op.init        = rf_init;
-  if (RESPOND_TO(self,"destroy"))
-    inf->fuse_op.destroy     = rf_destroy;
-  if (RESPOND_TO(self,"access"))
-    inf->fuse_op.access      = rf_access;
-  if (RESPOND_TO(self,"create"))
-    inf->fuse_op.create      = rf_create;
-  if (RESPOND_TO(self,"ftruncate"))
-    inf->fuse_op.ftruncate   = rf_ftruncate;
-  if (RESPOND_TO(self,"fgetattr"))
-    inf->fuse_op.fgetattr    = rf_fgetattr;
-  if (RESPOND_TO(self,"lock"))
-    inf->fuse_op.lock        = rf_lock;
-  if (RESPOND_TO(self,"utimens"))
-    inf->fuse_op.utimens     = rf_utimens;
-  if (RESPOND_TO(self,"bmap"))
-    inf->fuse_op.bmap        = rf_bmap;
-  if (RESPOND_TO(self,"ioctl"))
-    inf->fuse_op.ioctl       = rf_ioctl;
-  if (RESPOND_TO(self,"poll"))
-    inf->fuse_op.poll        = rf_poll;
+//----------------------LOOP_MT
+// loop_mt(threads = 10) runs the loop above on a pool of ruby threads, the
+// calling thread being one of them. Each of them waits for and decodes kernel
+// commands without the GVL, so a handler that blocks on I/O lets the others
+// pick up the next command. libfuse's own fuse_loop_mt() can't be used: its
+// worker threads are not ruby threads and can't call into the interpreter.
 
+#define RF_LOOP_MT_THREADS 10
 
-  struct fuse_args
-    *kargs = rarray2fuseargs(kernelopts),
-    *largs = rarray2fuseargs(libopts);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+struct rf_pool {
+  struct intern_fuse *inf;
+  VALUE workers;
+};
 
-  intern_fuse_init(inf, STR2CSTR(mountpoint), kargs, largs);
+static VALUE rf_loop_mt_join(VALUE worker)
+{
+  return rb_funcall(worker, rb_intern("join"), 0);
+}
 
-  //TODO this won't work with multithreading!!!
-  fuse_object=self;
+// Every worker is joined, even after one of them raised: the first error
+// is raised again once they are all gone and the writes delivered
+static VALUE rf_loop_mt_stop(VALUE data)
+{
+  struct rf_pool *pool = (struct rf_pool *) data;
+  VALUE error = Qnil;
+  int state, first = 0;
+  long i;
+
+  //the workers leave as soon as they see the flag
+  pool->inf->stopping = 1;
+  intern_fuse_wake(pool->inf);
+
+  for (i = 0; i < RARRAY_LEN(pool->workers); i++) {
+    rb_protect(rf_loop_mt_join, RARRAY_AREF(pool->workers, i), &state);
+    if (state && !first) {
+      first = state;
+      error = rb_errinfo();
+    }
+    rb_set_errinfo(Qnil);
+  }
+  rfuse_write_deliver_all(pool->inf);
 
-  return self;
+  if (first) {
+    if (!NIL_P(error)) {
+      rb_exc_raise(error);
+    }
+    rb_jump_tag(first);
+  }
+  return Qnil;
 }
+#endif
 
-static VALUE rf_new(VALUE class)
+static VALUE rf_loop_mt(int argc, VALUE *argv, VALUE self)
 {
   struct intern_fuse *inf;
-  VALUE self;
-  inf = intern_fuse_new();
-  self=Data_Wrap_Struct(class, 0, intern_fuse_destroy, inf);
-  return self;
-}
+  VALUE rthreads;
+  int threads;
 
-VALUE rfuse_init(VALUE module)
+  rb_scan_args(argc, argv, "01", &rthreads);
+  threads = NIL_P(rthreads) ? RF_LOOP_MT_THREADS : NUM2INT(rthreads);
+
+  if (threads < 1) {
+    rb_raise(rb_eArgError, "loop_mt needs at least one thread");
+  }
+
+  Data_Get_Struct(self,struct intern_fuse,inf);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  struct rf_pool pool;
+  int i;
+
+  if (intern_fuse_prepare_loop(inf) < 0) {
+    return Qnil;
+  }
+
+  pool.inf     = inf;
+  pool.workers = rb_ary_new();
+  for (i = 1; i < threads; i++) {
+    rb_ary_push(pool.workers, rb_thread_create(rf_loop_serve, inf));
+  }
+
+  rb_ensure((VALUE (*)()) rf_loop_serve, (VALUE) inf,
+    rf_loop_mt_stop, (VALUE) &pool);
+#else
+  //no way to run callbacks concurrently, serve them one by one
+  fuse_loop(inf->fuse);
+#endif
+  return Qnil;
+}
+
+//----------------------LOOP_FIBER
+// loop_fiber serves the mount from the current thread's Fiber scheduler.
+// Each command is read without blocking and processed in a fiber of its own
+// (Fiber.schedule), so a handler waiting on a backend only suspends its own
+// request. The whole libfuse call chain lives on the fiber's stack and the
+// reply goes out when that fiber finishes. Callbacks run with the GVL held,
+// handlers don't have to be thread safe. Several mounts may share the
+// scheduler: a callback resumed after others ran gets its own fuse context
+// back, see rf_protect.
+//
+// libfuse makes unlink, rmdir and rename wait until the requests in flight
+// on their path are done, and the requests coming after wait for them. Here
+// that wait would block the thread the suspended requests have to finish
+// on. So these commands run alone: the loop waits for the commands in flight
+// to be done, processes the command itself and only then reads the next one.
+//
+// Fuse#exit writes to the mount's wake pipe, the loop waits for it and the
+// channel at once: through an epoll set watching both, or IO.select.
+
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+struct rf_fiber_cmd {
+  struct intern_fuse *inf;
+  intern_cmd_t *cmd;
+};
+
+struct rf_fiber_loop {
+  struct intern_fuse *inf;
+  int epfd;   //channel and wake pipe, -1 without epoll
+  VALUE io;   //what the loop waits on: epfd, or the channel
+  VALUE wake; //without epoll: the wake pipe, or nil
+};
+
+static VALUE rf_fiber_dispatch(VALUE data)
+{
+  struct rf_fiber_cmd *fc = (struct rf_fiber_cmd *) data;
+  intern_fuse_dispatch(fc->inf, fc->cmd);
+  return Qnil;
+}
+
+//the loop may be waiting for the last command in flight, see rf_fiber_idle
+static VALUE rf_fiber_done(VALUE data)
+{
+  struct intern_fuse *inf = (struct intern_fuse *) data;
+  if (--inf->fiber_busy == 0 && inf->fiber_idle != NULL) {
+    rb_funcall((VALUE) inf->fiber_idle, rb_intern("push"), 1, Qnil);
+  }
+  rfuse_loop_leave(inf);
+  return Qnil;
+}
+
+//a command in flight keeps the mount from being unmounted under it
+static VALUE rf_fiber_process(RB_BLOCK_CALL_FUNC_ARGLIST(yielded, data))
+{
+  struct rf_fiber_cmd fc = *(struct rf_fiber_cmd *) data;
+  free((void *) data);
+  rfuse_loop_enter(fc.inf);
+  rb_ensure(rf_fiber_dispatch, (VALUE) &fc, rf_fiber_done, (VALUE) fc.inf);
+  return Qnil;
+}
+
+static VALUE rf_fiber_idle_pop(VALUE idle)
+{
+  return rb_funcall(idle, rb_intern("pop"), 0);
+}
+
+static VALUE rf_fiber_idle_end(VALUE data)
+{
+  ((struct intern_fuse *) data)->fiber_idle = NULL;
+  return Qnil;
+}
+
+// Suspend the loop until no command is in flight. The Queue lives on the
+// loop fiber's stack, inf only points at it meanwhile.
+static void rf_fiber_idle(struct intern_fuse *inf)
+{
+  VALUE idle;
+
+  if (inf->fiber_busy == 0) {
+    return;
+  }
+  idle = rb_class_new_instance(0, NULL, rb_path2class("Thread::Queue"));
+  inf->fiber_idle = (void *) idle;
+  rb_ensure(rf_fiber_idle_pop, idle, rf_fiber_idle_end, (VALUE) inf);
+  RB_GC_GUARD(idle);
+}
+
+// Suspend the loop until the kernel has a command or Fuse#exit was called
+static void rf_fiber_wait(struct rf_fiber_loop *fl)
+{
+  struct intern_fuse *inf = fl->inf;
+  char buf[64];
+
+  if (fl->epfd >= 0) {
+    rb_funcall(fl->io, rb_intern("wait_readable"), 0);
+  } else if (!NIL_P(fl->wake)) {
+    rb_funcall(rb_cIO, rb_intern("select"), 1,
+      rb_ary_new_from_args(2, fl->io, fl->wake));
+  } else {
+    rb_funcall(fl->io, rb_intern("wait_readable"), 0);
+  }
+
+  //a wakeup without an exit would keep the pipe readable
+  if (!intern_fuse_exited(inf) && inf->wake[0] >= 0) {
+    while (read(inf->wake[0], buf, sizeof(buf)) > 0);
+  }
+}
+
+static VALUE rf_fiber_serve(VALUE data)
+{
+  struct rf_fiber_loop *fl = (struct rf_fiber_loop *) data;
+  struct intern_fuse *inf = fl->inf;
+  intern_cmd_t *cmd;
+  struct rf_fiber_cmd *fc;
+  VALUE fiber = rb_const_get(rb_cObject, rb_intern("Fiber"));
+
+  while (!intern_fuse_exited(inf)) {
+    //NULL on EAGAIN, and after an unmount which exits the session
+    cmd = intern_fuse_read(inf);
+    if (cmd == NULL) {
+      if (!intern_fuse_exited(inf)) {
+        rf_fiber_wait(fl);
+      }
+      continue;
+    }
+
+    //unlink, rmdir and rename run alone, see above
+    if (intern_fuse_write_locks(cmd)) {
+      rf_fiber_idle(inf);
+      intern_fuse_dispatch(inf, cmd);
+      continue;
+    }
+
+    fc = malloc(sizeof(struct rf_fiber_cmd));
+    fc->inf  = inf;
+    fc->cmd  = cmd;
+    inf->fiber_busy++;
+    rb_block_call(fiber, rb_intern("schedule"), 0, NULL,
+      rf_fiber_process, (VALUE) fc);
+  }
+  rfuse_write_deliver_all(inf);
+  return Qnil;
+}
+
+static VALUE rf_fiber_close(VALUE data)
+{
+  struct rf_fiber_loop *fl = (struct rf_fiber_loop *) data;
+  if (fl->epfd >= 0) {
+    close(fl->epfd);
+  }
+  return Qnil;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int rf_fiber_watch(int epfd, int fd)
+{
+  struct epoll_event ev;
+  ev.events  = EPOLLIN;
+  ev.data.fd = fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+#endif
+
+static VALUE rf_loop_fiber_run(VALUE data)
+{
+  struct rf_fiber_loop fl;
+  VALUE opts;
+  int fd;
+
+  fl.inf  = (struct intern_fuse *) data;
+  fl.epfd = -1;
+  fl.wake = Qnil;
+  fd      = intern_fuse_fd(fl.inf);
+
+  opts = rb_hash_new();
+  rb_hash_aset(opts, ID2SYM(rb_intern("autoclose")), Qfalse);
+
+#ifdef HAVE_SYS_EPOLL_H
+  if (fl.inf->wake[0] >= 0) {
+    fl.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (fl.epfd < 0) {
+      rb_sys_fail("epoll_create1");
+    }
+    if (rf_fiber_watch(fl.epfd, fd) < 0 ||
+        rf_fiber_watch(fl.epfd, fl.inf->wake[0]) < 0) {
+      int e = errno;
+      close(fl.epfd);
+      errno = e;
+      rb_sys_fail("epoll_ctl");
+    }
+    fd = fl.epfd;
+  }
+#endif
+  if (fl.epfd < 0 && fl.inf->wake[0] >= 0) {
+    fl.wake = rb_funcall(rb_cIO, rb_intern("for_fd"), 2,
+      INT2NUM(fl.inf->wake[0]), opts);
+  }
+  fl.io = rb_funcall(rb_cIO, rb_intern("for_fd"), 2, INT2NUM(fd), opts);
+
+  rb_ensure(rf_fiber_serve, (VALUE) &fl, rf_fiber_close, (VALUE) &fl);
+
+  RB_GC_GUARD(fl.io);
+  RB_GC_GUARD(fl.wake);
+  return Qnil;
+}
+#endif
+
+static VALUE rf_loop_fiber(VALUE self)
+{
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  struct intern_fuse *inf;
+
+  if (NIL_P(rb_fiber_scheduler_current())) {
+    rb_raise(rb_eRuntimeError,
+      "loop_fiber needs a non-blocking fiber, see Fiber.schedule");
+  }
+
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  if (intern_fuse_prepare_loop(inf) < 0) {
+    return Qnil;
+  }
+  inf->fibers = 1;
+  rfuse_loop_enter(inf);
+  rb_ensure(rf_loop_fiber_run, (VALUE) inf, rf_loop_left, (VALUE) inf);
+#else
+  rb_raise(rb_eNotImpError, "loop_fiber needs ruby 3.0 or later");
+#endif
+  return Qnil;
+}
+
+//----------------------EXIT
+
+VALUE rf_exit(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  fuse_exit(inf->fuse);
+  intern_fuse_wake(inf);
+  return Qnil;
+}
+
+//----------------------UNMOUNT
+// While a loop (or the reactor) is serving the mount, possibly in another
+// thread or from one of its handlers, unmount exits it and the loop
+// unmounts on its way out, see rfuse_loop_leave.
+
+VALUE rf_unmount(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  if (inf->loopers > 0) {
+    inf->unmount_pending = 1;
+    rf_exit(self);
+    return Qnil;
+  }
+  rfuse_write_deliver_all(inf);
+  intern_fuse_unmount(inf);
+  return Qnil;
+}
+
+//----------------------MOUNTNAME
+
+VALUE rf_mountname(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return rb_str_new2(inf->mountname);
+}
+
+//----------------------INVALIDATE
+
+VALUE rf_invalidate(VALUE self,VALUE path)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+#ifdef RFUSE_FUSE3
+#ifdef HAVE_FUSE_INVALIDATE_PATH
+  return INT2NUM(fuse_invalidate_path(inf->fuse,STR2CSTR(path)));
+#else
+  return INT2NUM(-ENOSYS);
+#endif
+#else
+  return fuse_invalidate(inf->fuse,STR2CSTR(path)); //TODO: check if str?
+#endif
+}
+
+//----------------------FD
+// Return /dev/fuse file descriptor for use with IO.select
+VALUE rf_fd(VALUE self)
+{
+ struct intern_fuse *inf;
+ Data_Get_Struct(self,struct intern_fuse,inf);
+ return INT2NUM(intern_fuse_fd(inf));
+}
+
+//----------------------BORROW_WRITES
+// Fuse#borrow_writes = true hands write() a read-only IO::Buffer over the
+// request instead of a String copy. It is freed when write returns: use
+// the data (buf.write(io), buf.get_string, ...) before that. Needs ruby 3.1.
+VALUE rf_set_borrow_writes(VALUE self, VALUE borrow)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+#ifndef HAVE_RUBY_IO_BUFFER_H
+  if (RTEST(borrow))
+    rb_raise(rb_eNotImpError, "borrow_writes needs IO::Buffer (ruby 3.1)");
+#endif
+  inf->borrow_writes = RTEST(borrow);
+  return borrow;
+}
+
+VALUE rf_borrow_writes(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return inf->borrow_writes ? Qtrue : Qfalse;
+}
+
+//----------------------REUSE_OBJECTS
+// Fuse#reuse_objects = true: see rf_wrappers. A handler keeping its Context,
+// FileInfo or Filler past the call gets an error using it. Meant for loop,
+// loop_mt and the reactor, it has no effect once loop_fiber served the mount.
+VALUE rf_set_reuse_objects(VALUE self, VALUE reuse)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  inf->reuse_objects = RTEST(reuse);
+  return reuse;
+}
+
+VALUE rf_reuse_objects(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return inf->reuse_objects ? Qtrue : Qfalse;
+}
+
+//----------------------READAHEAD
+// Fuse#readahead = max prefetches up to max bytes ahead of sequential
+// reads, see rf_read. nil or 0 turns it off. Reads handled by read_buf
+// or served from a bound fd don't go through it.
+
+VALUE rf_set_readahead(VALUE self, VALUE max)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  inf->readahead = NIL_P(max) ? 0 : NUM2SIZET(max);
+  return max;
+}
+
+VALUE rf_readahead(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return inf->readahead == 0 ? Qnil : SIZET2NUM(inf->readahead);
+}
+
+// {:hits => n, :misses => n, :prefetched => bytes, :wasted => bytes}
+VALUE rf_readahead_stats(VALUE self)
+{
+  struct intern_fuse *inf;
+  VALUE h = rb_hash_new();
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  rb_hash_aset(h, ID2SYM(rb_intern("hits")), ULL2NUM(inf->ra_stats.hits));
+  rb_hash_aset(h, ID2SYM(rb_intern("misses")), ULL2NUM(inf->ra_stats.misses));
+  rb_hash_aset(h, ID2SYM(rb_intern("prefetched")),
+    ULL2NUM(inf->ra_stats.prefetched));
+  rb_hash_aset(h, ID2SYM(rb_intern("wasted")), ULL2NUM(inf->ra_stats.wasted));
+  return h;
+}
+
+//----------------------WRITE_BEHIND
+// Fuse#write_behind = size holds back writes of less than size bytes
+// following each other in an open file and hands them to write() in one
+// call, see rf_write. nil or 0 turns it off. An error of that write() is
+// the next flush's or fsync's. Files bound to an fd and writes handled by
+// write_buf don't go through it.
+
+VALUE rf_set_write_behind(VALUE self, VALUE max)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  inf->write_behind = NIL_P(max) ? 0 : NUM2SIZET(max);
+  if (inf->write_behind_age == 0)
+    inf->write_behind_age = 1000000000LL;
+  return max;
+}
+
+VALUE rf_write_behind(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return inf->write_behind == 0 ? Qnil : SIZET2NUM(inf->write_behind);
+}
+
+// seconds a write may be held back, 1 by default. There is no timer: the
+// next write of the file finds it too old and delivers.
+VALUE rf_set_write_behind_age(VALUE self, VALUE age)
+{
+  struct intern_fuse *inf;
+  double secs = NIL_P(age) ? 1 : NUM2DBL(age);
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  if (secs <= 0)
+    rb_raise(rb_eArgError,"write_behind_age must be positive");
+  inf->write_behind_age = (int64_t) (secs * 1e9);
+  return age;
+}
+
+VALUE rf_write_behind_age(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return rb_float_new(inf->write_behind_age == 0 ? 1 :
+    inf->write_behind_age / 1e9);
+}
+
+// {:writes => n, :deliveries => n, :bytes => n}
+VALUE rf_write_behind_stats(VALUE self)
+{
+  struct intern_fuse *inf;
+  VALUE h = rb_hash_new();
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  rb_hash_aset(h, ID2SYM(rb_intern("writes")), ULL2NUM(inf->wb_stats.writes));
+  rb_hash_aset(h, ID2SYM(rb_intern("deliveries")),
+    ULL2NUM(inf->wb_stats.deliveries));
+  rb_hash_aset(h, ID2SYM(rb_intern("bytes")), ULL2NUM(inf->wb_stats.bytes));
+  return h;
+}
+
+//----------------------PATH_CACHE
+// Fuse#path_cache = size keeps the path Strings of the last size paths
+// handlers were called for, see pathcache.c. They are frozen: a handler
+// modifying one gets a FrozenError. nil or 0 turns it off.
+
+VALUE rf_set_path_cache(VALUE self, VALUE size)
+{
+  struct intern_fuse *inf;
+  size_t max = NIL_P(size) ? 0 : NUM2SIZET(size);
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  if (max == 0) {
+    if (inf->paths != NULL)
+      pathcache_free(inf->paths);
+    inf->paths = NULL;
+  } else if (inf->paths == NULL) {
+    inf->paths = pathcache_new(max);
+  } else {
+    pathcache_set_max(inf->paths, max);
+  }
+  return size;
+}
+
+VALUE rf_path_cache(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return inf->paths == NULL ? Qnil : SIZET2NUM(inf->paths->max);
+}
+
+// {:hits => n, :misses => n, :entries => n}
+VALUE rf_path_cache_stats(VALUE self)
+{
+  struct intern_fuse *inf;
+  VALUE h = rb_hash_new();
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  rb_hash_aset(h, ID2SYM(rb_intern("hits")),
+    ULL2NUM(inf->paths != NULL ? inf->paths->hits : 0));
+  rb_hash_aset(h, ID2SYM(rb_intern("misses")),
+    ULL2NUM(inf->paths != NULL ? inf->paths->misses : 0));
+  rb_hash_aset(h, ID2SYM(rb_intern("entries")),
+    SIZET2NUM(inf->paths != NULL ? inf->paths->count : 0));
+  return h;
+}
+
+//----------------------ATTR_CACHE
+// Fuse#attr_cache = ttl keeps what getattr answers for ttl seconds and
+// answers from there, in C. A Stat#ttl overrides it for one entry.
+// Fuse#negative_cache = ttl does the same for the paths getattr says
+// ENOENT for. Changes made through the mount drop the entries concerned;
+// changes made behind its back need invalidate_attr. nil or 0 turns them
+// off.
+
+//caches stay until the mount goes, callbacks may be looking at them
+static struct attrcache *rf_cache(struct attrcache **acp)
+{
+  if (*acp == NULL)
+    *acp = attrcache_new();
+  return *acp;
+}
+
+static VALUE rf_cache_ttl(struct attrcache *ac)
+{
+  if (ac == NULL || attrcache_ttl(ac) == 0)
+    return Qnil;
+  return rb_float_new(attrcache_ttl(ac));
+}
+
+// {:hits => n, :misses => n, :entries => n}
+static VALUE rf_cache_stats(struct attrcache *ac)
+{
+  VALUE h = rb_hash_new();
+  uint64_t hits = 0, misses = 0;
+  size_t count = 0;
+  if (ac != NULL)
+    attrcache_stats(ac, &hits, &misses, &count);
+  rb_hash_aset(h, ID2SYM(rb_intern("hits")), ULL2NUM(hits));
+  rb_hash_aset(h, ID2SYM(rb_intern("misses")), ULL2NUM(misses));
+  rb_hash_aset(h, ID2SYM(rb_intern("entries")), SIZET2NUM(count));
+  return h;
+}
+
+VALUE rf_set_attr_cache(VALUE self, VALUE ttl)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  if (inf->attrs != NULL || !NIL_P(ttl))
+    attrcache_set_ttl(rf_cache(&inf->attrs), NIL_P(ttl) ? 0 : NUM2DBL(ttl));
+  return ttl;
+}
+
+VALUE rf_attr_cache(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return rf_cache_ttl(inf->attrs);
+}
+
+// entries kept at most, 16384 by default
+VALUE rf_set_attr_cache_size(VALUE self, VALUE size)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  attrcache_set_max(rf_cache(&inf->attrs), NUM2SIZET(size));
+  return size;
+}
+
+VALUE rf_attr_cache_stats(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return rf_cache_stats(inf->attrs);
+}
+
+VALUE rf_set_negative_cache(VALUE self, VALUE ttl)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  if (inf->misses != NULL || !NIL_P(ttl))
+    attrcache_set_ttl(rf_cache(&inf->misses), NIL_P(ttl) ? 0 : NUM2DBL(ttl));
+  return ttl;
+}
+
+VALUE rf_negative_cache(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return rf_cache_ttl(inf->misses);
+}
+
+VALUE rf_set_negative_cache_size(VALUE self, VALUE size)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  attrcache_set_max(rf_cache(&inf->misses), NUM2SIZET(size));
+  return size;
+}
+
+VALUE rf_negative_cache_stats(VALUE self)
+{
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  return rf_cache_stats(inf->misses);
+}
+
+// Fuse#invalidate_attr(path = nil, tree = false): forget what both caches
+// know about path, with tree about everything below it too. nil forgets
+// everything.
+VALUE rf_invalidate_attr(int argc, VALUE *argv, VALUE self)
+{
+  struct intern_fuse *inf;
+  VALUE path, tree;
+  const char *p;
+  rb_scan_args(argc, argv, "02", &path, &tree);
+  Data_Get_Struct(self,struct intern_fuse,inf);
+  p = NIL_P(path) ? NULL : StringValueCStr(path);
+  if (inf->attrs != NULL)
+    attrcache_invalidate(inf->attrs, p, RTEST(tree));
+  if (inf->misses != NULL)
+    attrcache_invalidate(inf->misses, p, RTEST(tree));
+  return Qnil;
+}
+
+//----------------------PROCESS
+// Process one fuse command from the kernel
+// returns < 0 if we're not mounted.. won't be this simple in a mt scenario
+VALUE rf_process(VALUE self)
+{
+ struct intern_fuse *inf;
+ Data_Get_Struct(self,struct intern_fuse,inf);
+ return INT2NUM(intern_fuse_process(inf));
+}
+
+//----------------------PROCESS_MANY
+// process_many(max, timeout = nil): process up to max queued commands without
+// blocking, and for no longer than timeout seconds if given. For event loops
+// watching Fuse#fd:
+//   Integer        - the number of commands processed, more may be queued
+//   :wait_readable - nothing was queued, wait for the fd again
+//   nil            - not mounted anymore
+VALUE rf_process_many(int argc, VALUE *argv, VALUE self)
+{
+ struct intern_fuse *inf;
+ VALUE rmax, rtimeout;
+ long long budget;
+ int max, res;
+
+ rb_scan_args(argc, argv, "11", &rmax, &rtimeout);
+ max = NUM2INT(rmax);
+ if (max < 1) {
+   rb_raise(rb_eArgError, "max must be at least 1");
+ }
+ budget = NIL_P(rtimeout) ? -1 : (long long) (NUM2DBL(rtimeout) * 1e9);
+
+ Data_Get_Struct(self,struct intern_fuse,inf);
+ res = intern_fuse_process_many(inf, max, budget);
+
+ if (res < 0) {
+   return Qnil;
+ }
+ if (res == 0) {
+   return ID2SYM(rb_intern("wait_readable"));
+ }
+ return INT2NUM(res);
+}
+
+//----------------------ATTR CACHE
+// With Fuse#attr_cache = ttl, what getattr answered is served from C for
+// ttl seconds (or the Stat#ttl it came with), without taking the GVL.
+// Fuse#negative_cache = ttl does the same for ENOENT.
+
+static int ac_getattr(const char *path, struct stat *stbuf)
+{
+  struct intern_fuse *inf = rf_current();
+  //held back writes change the size, getattr delivers them first
+  if (inf->wb_pending > 0)
+    return GVL(getattr)(path, stbuf);
+  if (inf->attrs != NULL && attrcache_get(inf->attrs, path, stbuf))
+    return 0;
+  if (inf->misses != NULL && attrcache_get(inf->misses, path, NULL))
+    return -ENOENT;
+  return GVL(getattr)(path, stbuf);
+}
+
+//----------------------PASSTHROUGH
+// Files bound to a backing file with FileInfo#fd= are served here, before
+// the GVL is taken: read, write, flush, fsync and fgetattr on them never
+// reach ruby. Everything else goes on to the handler.
+
+static int rf_bound_fd(struct fuse_file_info *ffi)
+{
+  struct open_file *h = open_file_of(ffi);
+  return h == NULL ? -1 : h->fd;
+}
+
+static int pt_read(const char *path, char *buf, size_t size, off_t offset,
+  struct fuse_file_info *ffi)
+{
+  struct intern_fuse *inf;
+  int fd = rf_bound_fd(ffi);
+  ssize_t res;
+
+  if (fd < 0) {
+    inf = rf_current();
+    if (!RESPOND_TO(inf,RF_OP_READ) && !RESPOND_TO(inf,RF_OP_READ_INTO))
+      return -ENOSYS;
+    return GVL(read)(path, buf, size, offset, ffi);
+  }
+  do {
+    res = pread(fd, buf, size, offset);
+  } while (res < 0 && errno == EINTR);
+  return res < 0 ? -errno : res;
+}
+
+static int pt_write(const char *path, const char *buf, size_t size,
+  off_t offset, struct fuse_file_info *ffi)
+{
+  int fd = rf_bound_fd(ffi);
+  ssize_t res;
+
+  if (fd < 0) {
+    if (!RESPOND_TO(rf_current(),RF_OP_WRITE))
+      return -ENOSYS;
+    return GVL(write)(path, buf, size, offset, ffi);
+  }
+  do {
+    res = pwrite(fd, buf, size, offset);
+  } while (res < 0 && errno == EINTR);
+  if (res < 0)
+    return -errno;
+  rf_attr_changed(path,RF_ATTR_PATH);
+  //other handles on the file may have read ahead
+  if (rf_current()->ra_count > 0)
+    GVL(readahead_written)(path, ffi);
+  return res;
+}
+
+//close() of a duplicate is what a flush of the backing file looks like
+static int pt_flush(const char *path, struct fuse_file_info *ffi)
+{
+  int fd = rf_bound_fd(ffi);
+
+  if (fd < 0) {
+    if (!RESPOND_TO(rf_current(),RF_OP_FLUSH) && !rf_write_pending(ffi))
+      return 0;
+    return GVL(flush)(path, ffi);
+  }
+  fd = dup(fd);
+  if (fd < 0 || close(fd) < 0)
+    return -errno;
+  return 0;
+}
+
+static int pt_fsync(const char *path, int datasync,
+  struct fuse_file_info *ffi)
+{
+  int fd = rf_bound_fd(ffi);
+
+  if (fd < 0) {
+    if (!RESPOND_TO(rf_current(),RF_OP_FSYNC) && !rf_write_pending(ffi))
+      return 0;
+    return GVL(fsync)(path, datasync, ffi);
+  }
+  if ((datasync ? fdatasync(fd) : fsync(fd)) < 0)
+    return -errno;
+  return 0;
+}
+
+static int pt_fgetattr(const char *path, struct stat *stbuf,
+  struct fuse_file_info *ffi)
+{
+  struct intern_fuse *inf;
+  int fd = rf_bound_fd(ffi);
+
+  if (fd < 0) {
+    inf = rf_current();
+    if (RESPOND_TO(inf,RF_OP_FGETATTR))
+      return GVL(fgetattr)(path, stbuf, ffi);
+    if (RESPOND_TO(inf,RF_OP_GETATTR))
+      return ac_getattr(path, stbuf);
+    return -ENOSYS;
+  }
+  if (fstat(fd, stbuf) < 0)
+    return -errno;
+  return 0;
+}
+
+#if FUSE_VERSION >= 29
+//with read_buf and write_buf, a bound file doesn't even need a copy
+static int pt_read_buf(const char *path, struct fuse_bufvec **bufp,
+  size_t size, off_t offset, struct fuse_file_info *ffi)
+{
+  int fd = rf_bound_fd(ffi);
+  struct fuse_bufvec *bv;
+
+  if (fd < 0)
+    return GVL(read_buf)(path, bufp, size, offset, ffi);
+
+  bv  = malloc(sizeof(struct fuse_bufvec));
+  *bv = FUSE_BUFVEC_INIT(size);
+  bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  bv->buf[0].fd    = fd;
+  bv->buf[0].pos   = offset;
+  *bufp = bv;
+  return 0;
+}
+
+static int pt_write_buf(const char *path, struct fuse_bufvec *buf,
+  off_t offset, struct fuse_file_info *ffi)
+{
+  int fd = rf_bound_fd(ffi);
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+  ssize_t res;
+
+  if (fd < 0)
+    return GVL(write_buf)(path, buf, offset, ffi);
+
+  dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  dst.buf[0].fd    = fd;
+  dst.buf[0].pos   = offset;
+  res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+  if (res > 0) {
+    rf_attr_changed(path,RF_ATTR_PATH);
+    if (rf_current()->ra_count > 0)
+      GVL(readahead_written)(path, ffi);
+  }
+  return res;
+}
+#endif
+
+//----------------------FUSE3
+// libfuse 3 changed a handful of signatures. The handler keeps the API it
+// always had: these adapters take the new callbacks apart and call the
+// (GVL) trampolines above. Like those, they run without the GVL.
+
+#ifdef RFUSE_FUSE3
+
+static int rf3_getattr(const char *path, struct stat *stbuf,
+  struct fuse_file_info *ffi)
+{
+  struct intern_fuse *inf = rf_current();
+  if (ffi != NULL)
+    return pt_fgetattr(path, stbuf, ffi);
+  if (RESPOND_TO(inf,RF_OP_GETATTR))
+    return ac_getattr(path, stbuf);
+  return -ENOSYS;
+}
+
+//RENAME_EXCHANGE and RENAME_NOREPLACE can't be expressed in the old call
+static int rf3_rename(const char *path, const char *as, unsigned int flags)
+{
+  if (flags != 0)
+    return -EINVAL;
+  return GVL(rename)(path, as);
+}
+
+static int rf3_chmod(const char *path, mode_t mode,
+  struct fuse_file_info *ffi)
+{
+  return GVL(chmod)(path, mode);
+}
+
+static int rf3_chown(const char *path, uid_t uid, gid_t gid,
+  struct fuse_file_info *ffi)
+{
+  return GVL(chown)(path, uid, gid);
+}
+
+static int rf3_truncate(const char *path, off_t offset,
+  struct fuse_file_info *ffi)
+{
+  struct intern_fuse *inf = rf_current();
+  if (ffi != NULL && RESPOND_TO(inf,RF_OP_FTRUNCATE))
+    return GVL(ftruncate)(path, offset, ffi);
+  if (RESPOND_TO(inf,RF_OP_TRUNCATE))
+    return GVL(truncate)(path, offset);
+  return -ENOSYS;
+}
+
+//handlers with only utime get seconds, UTIME_NOW and UTIME_OMIT both
+//become the current time as with libfuse 2
+static int rf3_utimens(const char *path, const struct timespec tv[2],
+  struct fuse_file_info *ffi)
+{
+  struct intern_fuse *inf = rf_current();
+  struct utimbuf utim;
+  time_t now;
+
+  if (RESPOND_TO(inf,RF_OP_UTIMENS))
+    return GVL(utimens)(path, tv);
+
+  now = time(NULL);
+  utim.actime  = (tv == NULL || tv[0].tv_nsec == UTIME_NOW ||
+    tv[0].tv_nsec == UTIME_OMIT) ? now : tv[0].tv_sec;
+  utim.modtime = (tv == NULL || tv[1].tv_nsec == UTIME_NOW ||
+    tv[1].tv_nsec == UTIME_OMIT) ? now : tv[1].tv_sec;
+  return GVL(utime)(path, &utim);
+}
+
+static int rf3_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+  off_t offset, struct fuse_file_info *ffi, enum fuse_readdir_flags flags)
+{
+  return GVL(readdir)(path, buf, filler, offset, ffi);
+}
+
+//the fuse_config is left alone, the handler negotiates through conn->want
+static void *rf3_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+  return GVL(init)(conn);
+}
+
+#define RF3(name) rf3_##name
+
+#else
+
+#define RF3(name) GVL(name)
+
+#endif
+
+//-------------RUBY
+
+static VALUE unsafe_arity(VALUE *args)
+{
+  VALUE method = rb_funcall(args[0],rb_intern("method"),1,args[1]);
+  return rb_funcall(method,rb_intern("arity"),0);
+}
+
+// The number of arguments the handler's op takes, -1 if it takes any
+// number or can't tell (method_missing)
+static int rf_arity(VALUE self, int op)
+{
+  VALUE args[2];
+  VALUE res;
+  int error = 0;
+  args[0] = self;
+  args[1] = ID2SYM(rf_op_ids[op]);
+  res = rb_protect((VALUE (*)())unsafe_arity,(VALUE) args,&error);
+  if (error) {
+    rb_set_errinfo(Qnil);
+    return -1;
+  }
+  return NUM2INT(res);
+}
+
+static VALUE rf_initialize(
+  VALUE self,
+  VALUE mountpoint,
+  VALUE kernelopts,
+  VALUE libopts)
+{
+  Check_Type(mountpoint, T_STRING);
+  Check_Type(kernelopts, T_ARRAY);
+  Check_Type(libopts, T_ARRAY);
+
+  struct intern_fuse *inf;
+  Data_Get_Struct(self,struct intern_fuse,inf);
+
+  //Ask the handler once which callbacks it implements
+  int op;
+  inf->ops = 0;
+  for (op = 0; op < RF_OP_MAX; op++) {
+    if (rb_respond_to(self,rf_op_ids[op]))
+      inf->ops |= RF_OP_BIT(op);
+  }
+
+  //and which of them leave out ctx, or ctx and the FileInfo, see RF_FUNCALL
+  int arity;
+  inf->noctx = 0;
+  inf->noffi = 0;
+  for (op = 0; op < RF_OP_MAX; op++) {
+    if (!RESPOND_TO(inf,op))
+      continue;
+    arity = rf_arity(self,op);
+    if (arity == rf_op_argc[op] - 1) {
+      inf->noctx |= RF_OP_BIT(op);
+    } else if (rf_op_ffi[op] >= 0 && arity == rf_op_argc[op] - 2) {
+      inf->noctx |= RF_OP_BIT(op);
+      inf->noffi |= RF_OP_BIT(op);
+    }
+  }
+
+  //files opened by open or create may be bound to a backing file, which
+  //needs its own read, write, ... see PASSTHROUGH
+  int files = RESPOND_TO(inf,RF_OP_OPEN) || RESPOND_TO(inf,RF_OP_CREATE);
+
+  if (RESPOND_TO(inf,RF_OP_GETATTR))
+#ifdef RFUSE_FUSE3
+    inf->fuse_op.getattr     = rf3_getattr;
+#else
+    inf->fuse_op.getattr     = ac_getattr;
+#endif
+  if (RESPOND_TO(inf,RF_OP_READLINK))
+    inf->fuse_op.readlink    = GVL(readlink);
+#ifndef RFUSE_FUSE3
+  if (RESPOND_TO(inf,RF_OP_GETDIR))
+    inf->fuse_op.getdir      = GVL(getdir);  // Deprecated
+#endif
+  if (RESPOND_TO(inf,RF_OP_MKNOD))
+    inf->fuse_op.mknod       = GVL(mknod);
+  if (RESPOND_TO(inf,RF_OP_MKDIR))
+    inf->fuse_op.mkdir       = GVL(mkdir);
+  if (RESPOND_TO(inf,RF_OP_UNLINK))
+    inf->fuse_op.unlink      = GVL(unlink);
+  if (RESPOND_TO(inf,RF_OP_RMDIR))
+    inf->fuse_op.rmdir       = GVL(rmdir);
+  if (RESPOND_TO(inf,RF_OP_SYMLINK))
+    inf->fuse_op.symlink     = GVL(symlink);
+  if (RESPOND_TO(inf,RF_OP_RENAME))
+    inf->fuse_op.rename      = RF3(rename);
+  if (RESPOND_TO(inf,RF_OP_LINK))
+    inf->fuse_op.link        = GVL(link);
+  if (RESPOND_TO(inf,RF_OP_CHMOD))
+    inf->fuse_op.chmod       = RF3(chmod);
+  if (RESPOND_TO(inf,RF_OP_CHOWN))
+    inf->fuse_op.chown       = RF3(chown);
+#ifdef RFUSE_FUSE3
+  if (RESPOND_TO(inf,RF_OP_TRUNCATE) || RESPOND_TO(inf,RF_OP_FTRUNCATE))
+    inf->fuse_op.truncate    = rf3_truncate;
+  if (RESPOND_TO(inf,RF_OP_UTIMENS) || RESPOND_TO(inf,RF_OP_UTIME))
+    inf->fuse_op.utimens     = rf3_utimens;
+  if (files || RESPOND_TO(inf,RF_OP_FGETATTR))
+    inf->fuse_op.getattr     = rf3_getattr;
+#else
+  if (RESPOND_TO(inf,RF_OP_TRUNCATE))
+    inf->fuse_op.truncate    = GVL(truncate);
+  if (RESPOND_TO(inf,RF_OP_UTIME))
+    inf->fuse_op.utime       = GVL(utime);    // Deprecated
+#endif
+  if (RESPOND_TO(inf,RF_OP_OPEN))
+    inf->fuse_op.open        = GVL(open);
+  if (files || RESPOND_TO(inf,RF_OP_READ) || RESPOND_TO(inf,RF_OP_READ_INTO))
+    inf->fuse_op.read        = pt_read;
+  if (files || RESPOND_TO(inf,RF_OP_WRITE))
+    inf->fuse_op.write       = pt_write;
+  if (RESPOND_TO(inf,RF_OP_STATFS))
+    inf->fuse_op.statfs      = GVL(statfs);
+  if (files || RESPOND_TO(inf,RF_OP_FLUSH))
+    inf->fuse_op.flush       = pt_flush;
+  if (files || RESPOND_TO(inf,RF_OP_RELEASE))
+    inf->fuse_op.release     = GVL(release);
+  if (files || RESPOND_TO(inf,RF_OP_FSYNC))
+    inf->fuse_op.fsync       = pt_fsync;
+  if (RESPOND_TO(inf,RF_OP_SETXATTR))
+    inf->fuse_op.setxattr    = GVL(setxattr);
+  if (RESPOND_TO(inf,RF_OP_GETXATTR))
+    inf->fuse_op.getxattr    = GVL(getxattr);
+  if (RESPOND_TO(inf,RF_OP_LISTXATTR))
+    inf->fuse_op.listxattr   = GVL(listxattr);
+  if (RESPOND_TO(inf,RF_OP_REMOVEXATTR))
+    inf->fuse_op.removexattr = GVL(removexattr);
+  if (RESPOND_TO(inf,RF_OP_OPENDIR))
+    inf->fuse_op.opendir     = GVL(opendir);
+  if (RESPOND_TO(inf,RF_OP_READDIR))
+    inf->fuse_op.readdir     = RF3(readdir);
+  if (RESPOND_TO(inf,RF_OP_OPENDIR) || RESPOND_TO(inf,RF_OP_RELEASEDIR))
+    inf->fuse_op.releasedir  = GVL(releasedir);
+  if (RESPOND_TO(inf,RF_OP_FSYNCDIR))
+    inf->fuse_op.fsyncdir    = GVL(fsyncdir);
+#ifdef RFUSE_PASSTHROUGH
+  inf->fuse_op.init          = RF3(init); //negotiates passthrough, see rf_init
+#else
+  if (RESPOND_TO(inf,RF_OP_INIT))
+    inf->fuse_op.init        = RF3(init);
+#endif
+  if (RESPOND_TO(inf,RF_OP_DESTROY))
+    inf->fuse_op.destroy     = GVL(destroy);
+  if (RESPOND_TO(inf,RF_OP_ACCESS))
+    inf->fuse_op.access      = GVL(access);
+  if (RESPOND_TO(inf,RF_OP_CREATE))
+    inf->fuse_op.create      = GVL(create);
+#ifndef RFUSE_FUSE3
+  if (RESPOND_TO(inf,RF_OP_FTRUNCATE))
+    inf->fuse_op.ftruncate   = GVL(ftruncate);
+  if (files || RESPOND_TO(inf,RF_OP_FGETATTR))
+    inf->fuse_op.fgetattr    = pt_fgetattr;
+#endif
+  if (RESPOND_TO(inf,RF_OP_LOCK))
+    inf->fuse_op.lock        = GVL(lock);
+#ifndef RFUSE_FUSE3
+  if (RESPOND_TO(inf,RF_OP_UTIMENS))
+    inf->fuse_op.utimens     = GVL(utimens);
+#endif
+  if (RESPOND_TO(inf,RF_OP_BMAP))
+    inf->fuse_op.bmap        = GVL(bmap);
+  if (RESPOND_TO(inf,RF_OP_IOCTL))
+    inf->fuse_op.ioctl       = GVL(ioctl);
+  if (RESPOND_TO(inf,RF_OP_POLL))
+    inf->fuse_op.poll        = GVL(poll);
+#if FUSE_VERSION >= 29
+  if (RESPOND_TO(inf,RF_OP_READ_BUF))
+    inf->fuse_op.read_buf    = pt_read_buf;
+  if (RESPOND_TO(inf,RF_OP_WRITE_BUF))
+    inf->fuse_op.write_buf   = pt_write_buf;
+#endif
+
+
+  struct fuse_args
+    *kargs = rarray2fuseargs(kernelopts),
+    *largs = rarray2fuseargs(libopts);
+
+  //before mounting, init() may be called as soon as the kernel talks to us
+  inf->handler = (void *) self;
+
+  intern_fuse_init(inf, STR2CSTR(mountpoint), kargs, largs);
+
+  return self;
+}
+
+//the handler is the Fuse object itself, the init() result and the fh of
+//open files need marking
+static void rf_mark(struct intern_fuse *inf)
+{
+  struct open_file *h;
+  if (inf->init_data != NULL) {
+    rb_gc_mark((VALUE) inf->init_data);
+  }
+  for (h = inf->handles; h != NULL; h = h->next) {
+    rb_gc_mark(h->value);
+  }
+  if (inf->paths != NULL) {
+    pathcache_mark(inf->paths);
+  }
+}
+
+//files still open when the Fuse object goes away were never released
+static void rf_free(struct intern_fuse *inf)
+{
+  //no calling write() from here, see rfuse_write_deliver_all
+  if (inf->wb_pending > 0)
+    fprintf(stderr, "rfuse: %s: writes held back for %lu open files lost\n",
+      inf->mountname, (unsigned long) inf->wb_pending);
+  //backing ids went with the session
+  inf->passthrough = 0;
+  while (inf->handles != NULL) {
+    rf_handle_free(inf, inf->handles);
+  }
+  if (inf->attrs != NULL)
+    attrcache_free(inf->attrs);
+  if (inf->misses != NULL)
+    attrcache_free(inf->misses);
+  if (inf->paths != NULL)
+    pathcache_free(inf->paths);
+  intern_fuse_destroy(inf);
+}
+
+static VALUE rf_new(VALUE class)
+{
+  struct intern_fuse *inf;
+  VALUE self;
+  inf = intern_fuse_new();
+  self=Data_Wrap_Struct(class, rf_mark, rf_free, inf);
+  return self;
+}
+
+VALUE rfuse_init(VALUE module)
 {
   VALUE cFuse=rb_define_class_under(module,"Fuse",rb_cObject);
 
+  int op;
+  for (op = 0; op < RF_OP_MAX; op++) {
+    rf_op_ids[op] = rb_intern(rf_op_names[op]);
+  }
+  id_errno     = rb_intern("errno");
+  id_Errno     = rb_intern("Errno");
+  id_wrappers  = rb_intern("__rfuse_wrappers");
+  id_read_buf_io = rb_intern("__rfuse_read_buf_io");
+  rf_errnos    = rb_hash_new();
+  rb_global_variable(&rf_errnos);
+  id_backtrace = rb_intern("backtrace");
+
+  cConnInfo = rb_struct_define(NULL,
+    "proto_major", "proto_minor", "async_read", "max_write",
+    "max_readahead", "capable", "want", NULL);
+  rb_global_variable(&cConnInfo);
+
+  cFlock = rb_struct_define(NULL,
+    "l_type", "l_whence", "l_start", "l_len", "l_pid", NULL);
+  rb_global_variable(&cFlock);
+
   rb_define_alloc_func(cFuse,rf_new);
 
+  //capability bits for ConnInfo#want in init(), whatever this libfuse knows
+  rb_define_const(module,"FUSE_MAJOR_VERSION",INT2FIX(FUSE_MAJOR_VERSION));
+#define RF_CAP(name) rb_define_const(module,"CAP_" #name,UINT2NUM(FUSE_CAP_##name))
+#ifdef FUSE_CAP_ASYNC_READ
+  RF_CAP(ASYNC_READ);
+#endif
+#ifdef FUSE_CAP_POSIX_LOCKS
+  RF_CAP(POSIX_LOCKS);
+#endif
+#ifdef FUSE_CAP_ATOMIC_O_TRUNC
+  RF_CAP(ATOMIC_O_TRUNC);
+#endif
+#ifdef FUSE_CAP_EXPORT_SUPPORT
+  RF_CAP(EXPORT_SUPPORT);
+#endif
+#ifdef FUSE_CAP_BIG_WRITES
+  RF_CAP(BIG_WRITES);
+#endif
+#ifdef FUSE_CAP_DONT_MASK
+  RF_CAP(DONT_MASK);
+#endif
+#ifdef FUSE_CAP_SPLICE_WRITE
+  RF_CAP(SPLICE_WRITE);
+#endif
+#ifdef FUSE_CAP_SPLICE_MOVE
+  RF_CAP(SPLICE_MOVE);
+#endif
+#ifdef FUSE_CAP_SPLICE_READ
+  RF_CAP(SPLICE_READ);
+#endif
+#ifdef FUSE_CAP_FLOCK_LOCKS
+  RF_CAP(FLOCK_LOCKS);
+#endif
+#ifdef FUSE_CAP_IOCTL_DIR
+  RF_CAP(IOCTL_DIR);
+#endif
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+  RF_CAP(AUTO_INVAL_DATA);
+#endif
+#ifdef FUSE_CAP_READDIRPLUS
+  RF_CAP(READDIRPLUS);
+#endif
+#ifdef FUSE_CAP_READDIRPLUS_AUTO
+  RF_CAP(READDIRPLUS_AUTO);
+#endif
+#ifdef FUSE_CAP_ASYNC_DIO
+  RF_CAP(ASYNC_DIO);
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+  RF_CAP(WRITEBACK_CACHE);
+#endif
+#ifdef FUSE_CAP_NO_OPEN_SUPPORT
+  RF_CAP(NO_OPEN_SUPPORT);
+#endif
+#ifdef FUSE_CAP_PARALLEL_DIROPS
+  RF_CAP(PARALLEL_DIROPS);
+#endif
+#ifdef FUSE_CAP_POSIX_ACL
+  RF_CAP(POSIX_ACL);
+#endif
+#ifdef FUSE_CAP_HANDLE_KILLPRIV
+  RF_CAP(HANDLE_KILLPRIV);
+#endif
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+  RF_CAP(CACHE_SYMLINKS);
+#endif
+#ifdef FUSE_CAP_NO_OPENDIR_SUPPORT
+  RF_CAP(NO_OPENDIR_SUPPORT);
+#endif
+#ifdef FUSE_CAP_EXPLICIT_INVAL_DATA
+  RF_CAP(EXPLICIT_INVAL_DATA);
+#endif
+#ifdef FUSE_CAP_PASSTHROUGH
+  RF_CAP(PASSTHROUGH);
+#endif
+#undef RF_CAP
+
   rb_define_method(cFuse,"initialize",rf_initialize,3);
   rb_define_method(cFuse,"loop",rf_loop,0);
-  rb_define_method(cFuse,"loop_mt",rf_loop_mt,0); //TODO: multithreading
+  rb_define_method(cFuse,"loop_mt",rf_loop_mt,-1);
   rb_define_method(cFuse,"exit",rf_exit,0);
   rb_define_method(cFuse,"invalidate",rf_invalidate,1);
   rb_define_method(cFuse,"unmount",rf_unmount,0);
   rb_define_method(cFuse,"mountname",rf_mountname,0);
   rb_define_method(cFuse,"fd",rf_fd,0);
+  rb_define_method(cFuse,"borrow_writes=",rf_set_borrow_writes,1);
+  rb_define_method(cFuse,"borrow_writes?",rf_borrow_writes,0);
+  rb_define_method(cFuse,"reuse_objects=",rf_set_reuse_objects,1);
+  rb_define_method(cFuse,"reuse_objects?",rf_reuse_objects,0);
+  rb_define_method(cFuse,"path_cache=",rf_set_path_cache,1);
+  rb_define_method(cFuse,"path_cache",rf_path_cache,0);
+  rb_define_method(cFuse,"path_cache_stats",rf_path_cache_stats,0);
+  rb_define_method(cFuse,"readahead=",rf_set_readahead,1);
+  rb_define_method(cFuse,"readahead",rf_readahead,0);
+  rb_define_method(cFuse,"readahead_stats",rf_readahead_stats,0);
+  rb_define_method(cFuse,"write_behind=",rf_set_write_behind,1);
+  rb_define_method(cFuse,"write_behind",rf_write_behind,0);
+  rb_define_method(cFuse,"write_behind_age=",rf_set_write_behind_age,1);
+  rb_define_method(cFuse,"write_behind_age",rf_write_behind_age,0);
+  rb_define_method(cFuse,"write_behind_stats",rf_write_behind_stats,0);
+  rb_define_method(cFuse,"attr_cache=",rf_set_attr_cache,1);
+  rb_define_method(cFuse,"attr_cache",rf_attr_cache,0);
+  rb_define_method(cFuse,"attr_cache_size=",rf_set_attr_cache_size,1);
+  rb_define_method(cFuse,"attr_cache_stats",rf_attr_cache_stats,0);
+  rb_define_method(cFuse,"negative_cache=",rf_set_negative_cache,1);
+  rb_define_method(cFuse,"negative_cache",rf_negative_cache,0);
+  rb_define_method(cFuse,"negative_cache_size=",rf_set_negative_cache_size,1);
+  rb_define_method(cFuse,"negative_cache_stats",rf_negative_cache_stats,0);
+  rb_define_method(cFuse,"invalidate_attr",rf_invalidate_attr,-1);
   rb_define_method(cFuse,"process",rf_process,0);
+  rb_define_method(cFuse,"process_many",rf_process_many,-1);
+  rb_define_method(cFuse,"loop_fiber",rf_loop_fiber,0);
 
   return cFuse;
 }
@@ -1,3 +1,21 @@
 #include <ruby.h>
 
+struct intern_fuse;
+
 VALUE rfuse_init(VALUE module);
+
+// errno to report for the exception a handler raised, def_error if it has
+// none
+int return_error(int def_error);
+
+// Hand writes Fuse#write_behind held back to write(), the mount is no
+// longer served
+void rfuse_write_deliver_all(struct intern_fuse *inf);
+
+// Serving the mount, Fuse#unmount waits for rfuse_loop_leave
+void rfuse_loop_enter(struct intern_fuse *inf);
+void rfuse_loop_leave(struct intern_fuse *inf);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+int rfuse_process_nogvl(struct intern_fuse *inf, int max);
+#endif
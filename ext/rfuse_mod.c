@@ -2,11 +2,25 @@
 #include "filler.h"
 #include "file_info.h"
 #include "context.h"
+#include "pollhandle.h"
+#include "bufferwrapper.h"
+#include "readbuffer.h"
+#include "reactor.h"
+#include "request.h"
+#include "lowlevel.h"
+#include "rstat.h"
 
 void Init_rfuse_ng() {
   VALUE mRFuse=rb_define_module("RFuse");
   file_info_init(mRFuse);
+  rstat_init(mRFuse);
   context_init(mRFuse);
   rfiller_init(mRFuse);
+  pollhandle_init(mRFuse);
+  bufferwrapper_init(mRFuse);
+  readbuffer_init(mRFuse);
   rfuse_init(mRFuse);
+  reactor_init(mRFuse);
+  request_init(mRFuse);
+  lowlevel_init(mRFuse);
 }
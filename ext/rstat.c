@@ -0,0 +1,324 @@
+// RFuse::Stat holds a struct stat. A handler answering getattr (or
+// Filler#push, Request#reply_attr...) with one has it copied as it is,
+// instead of every field being asked for with a method call.
+//
+//   st = RFuse::Stat.new(:mode => 0100644, :size => data.bytesize)
+//   st.mtime = Time.now
+//
+// Times keep their nanoseconds. Stat.new(File.lstat(path)) copies anything
+// answering to the stat fields, an Array or a Hash, see rstat_convert.
+// ttl is how long Fuse#attr_cache may keep it, nil for the mount's own.
+
+#include <ruby.h>
+#include <string.h>
+#include <time.h>
+
+#include "rstat.h"
+
+static VALUE cStat;
+
+struct rstat {
+  struct stat st;
+  double ttl; //< 0: not set
+};
+
+// In the order of the Array form
+enum rstat_field {
+  RSTAT_DEV, RSTAT_INO, RSTAT_MODE, RSTAT_NLINK, RSTAT_UID, RSTAT_GID,
+  RSTAT_RDEV, RSTAT_SIZE, RSTAT_BLKSIZE, RSTAT_BLOCKS,
+  RSTAT_ATIME, RSTAT_MTIME, RSTAT_CTIME,
+  RSTAT_FIELDS
+};
+
+static const char *rstat_names[RSTAT_FIELDS] = {
+  "dev", "ino", "mode", "nlink", "uid", "gid",
+  "rdev", "size", "blksize", "blocks",
+  "atime", "mtime", "ctime"
+};
+
+static ID rstat_ids[RSTAT_FIELDS];
+static VALUE rstat_keys[RSTAT_FIELDS]; //Hash keys, symbols
+static ID id_to_i;
+
+#ifdef HAVE_STRUCT_STAT_ST_ATIM
+#define RSTAT_TIME(st, x) ((st)->st_##x##tim)
+#else
+static struct timespec rstat_ts(time_t sec)
+{
+  struct timespec ts;
+  ts.tv_sec  = sec;
+  ts.tv_nsec = 0;
+  return ts;
+}
+#define RSTAT_TIME(st, x) rstat_ts((st)->st_##x##time)
+#endif
+
+// Time, Integer, Float or Rational; anything else has to answer to_i
+static struct timespec rstat_timespec(VALUE v)
+{
+  if (!rb_obj_is_kind_of(v, rb_cTime) && !rb_obj_is_kind_of(v, rb_cNumeric)) {
+    v = rb_funcall(v, id_to_i, 0);
+  }
+  return rb_time_timespec(v);
+}
+
+static void rstat_set_time(struct stat *st, int field, VALUE v)
+{
+  struct timespec ts = rstat_timespec(v);
+#ifdef HAVE_STRUCT_STAT_ST_ATIM
+  switch (field) {
+    case RSTAT_ATIME: st->st_atim = ts; break;
+    case RSTAT_MTIME: st->st_mtim = ts; break;
+    default:          st->st_ctim = ts; break;
+  }
+#else
+  switch (field) {
+    case RSTAT_ATIME: st->st_atime = ts.tv_sec; break;
+    case RSTAT_MTIME: st->st_mtime = ts.tv_sec; break;
+    default:          st->st_ctime = ts.tv_sec; break;
+  }
+#endif
+}
+
+// nil is 0
+static void rstat_set(struct stat *st, int field, VALUE v)
+{
+  if (NIL_P(v)) {
+    v = INT2FIX(0);
+  }
+  switch (field) {
+    case RSTAT_DEV:     st->st_dev     = NUM2ULL(v);  break;
+    case RSTAT_INO:     st->st_ino     = NUM2ULL(v);  break;
+    case RSTAT_MODE:    st->st_mode    = NUM2UINT(v); break;
+    case RSTAT_NLINK:   st->st_nlink   = NUM2ULONG(v); break;
+    case RSTAT_UID:     st->st_uid     = NUM2UINT(v); break;
+    case RSTAT_GID:     st->st_gid     = NUM2UINT(v); break;
+    case RSTAT_RDEV:    st->st_rdev    = NUM2ULL(v);  break;
+    case RSTAT_SIZE:    st->st_size    = NUM2OFFT(v); break;
+    case RSTAT_BLKSIZE: st->st_blksize = NUM2LONG(v); break;
+    case RSTAT_BLOCKS:  st->st_blocks  = NUM2LL(v);   break;
+    default:            rstat_set_time(st, field, v); break;
+  }
+}
+
+static VALUE rstat_time(struct timespec ts)
+{
+  return rb_time_nano_new(ts.tv_sec, ts.tv_nsec);
+}
+
+static VALUE rstat_field(const struct stat *st, int field)
+{
+  switch (field) {
+    case RSTAT_DEV:     return ULL2NUM(st->st_dev);
+    case RSTAT_INO:     return ULL2NUM(st->st_ino);
+    case RSTAT_MODE:    return UINT2NUM(st->st_mode);
+    case RSTAT_NLINK:   return ULONG2NUM(st->st_nlink);
+    case RSTAT_UID:     return UINT2NUM(st->st_uid);
+    case RSTAT_GID:     return UINT2NUM(st->st_gid);
+    case RSTAT_RDEV:    return ULL2NUM(st->st_rdev);
+    case RSTAT_SIZE:    return OFFT2NUM(st->st_size);
+    case RSTAT_BLKSIZE: return LONG2NUM(st->st_blksize);
+    case RSTAT_BLOCKS:  return LL2NUM(st->st_blocks);
+    case RSTAT_ATIME:   return rstat_time(RSTAT_TIME(st, a));
+    case RSTAT_MTIME:   return rstat_time(RSTAT_TIME(st, m));
+    default:            return rstat_time(RSTAT_TIME(st, c));
+  }
+}
+
+static struct rstat *rstat_get(VALUE self)
+{
+  struct rstat *rs;
+  Data_Get_Struct(self, struct rstat, rs);
+  return rs;
+}
+
+static struct stat *rstat_of(VALUE self)
+{
+  return &rstat_get(self)->st;
+}
+
+static int rstat_is(VALUE v)
+{
+  return RB_TYPE_P(v, T_DATA) && rb_obj_is_kind_of(v, cStat);
+}
+
+// Copies an RFuse::Stat, returns 0 for anything else
+int rstat_copy(VALUE rstat, struct stat *st)
+{
+  if (!rstat_is(rstat)) {
+    return 0;
+  }
+  *st = *rstat_of(rstat);
+  return 1;
+}
+
+// The Stat#ttl of rstat, < 0 if it has none
+double rstat_ttl(VALUE rstat)
+{
+  return rstat_is(rstat) ? rstat_get(rstat)->ttl : -1;
+}
+
+// An Array of the fields in struct order (dev, ino, mode, nlink, uid, gid,
+// rdev, size, blksize, blocks, atime, mtime, ctime), a Hash of them by
+// Symbol, or any object answering to them. Fields left out are 0.
+void rstat_convert(VALUE rstat, struct stat *st)
+{
+  long i, len;
+
+  memset(st, 0, sizeof(struct stat));
+  switch (TYPE(rstat)) {
+    case T_ARRAY:
+      len = RARRAY_LEN(rstat);
+      if (len > RSTAT_FIELDS) {
+        rb_raise(rb_eArgError, "a stat has %d fields, got %ld",
+          RSTAT_FIELDS, len);
+      }
+      for (i = 0; i < len; i++) {
+        rstat_set(st, i, RARRAY_AREF(rstat, i));
+      }
+      break;
+    case T_HASH:
+      for (i = 0; i < RSTAT_FIELDS; i++) {
+        rstat_set(st, i, rb_hash_lookup(rstat, rstat_keys[i]));
+      }
+      break;
+    default:
+      for (i = 0; i < RSTAT_FIELDS; i++) {
+        rstat_set(st, i, rb_funcall(rstat, rstat_ids[i], 0));
+      }
+      break;
+  }
+}
+
+static VALUE rstat_alloc(VALUE class)
+{
+  struct rstat *rs;
+  VALUE self = Data_Make_Struct(class, struct rstat, 0, free, rs);
+  rs->ttl = -1;
+  return self;
+}
+
+// A new RFuse::Stat holding a copy of st, without a ttl
+VALUE rstat_new(const struct stat *st)
+{
+  VALUE self = rstat_alloc(cStat);
+  *rstat_of(self) = *st;
+  return self;
+}
+
+// Stat.new(from = nil): all zero, or the fields of from (a Stat, an
+// Array, a Hash or a File::Stat like object)
+static VALUE rstat_initialize(int argc, VALUE *argv, VALUE self)
+{
+  VALUE from;
+  rb_scan_args(argc, argv, "01", &from);
+  if (!NIL_P(from) && !rstat_copy(from, rstat_of(self))) {
+    rstat_convert(from, rstat_of(self));
+  }
+  return self;
+}
+
+static VALUE rstat_initialize_copy(VALUE self, VALUE orig)
+{
+  if (rstat_is(orig)) {
+    *rstat_get(self) = *rstat_get(orig);
+  }
+  return self;
+}
+
+static VALUE rstat_get_ttl(VALUE self)
+{
+  double ttl = rstat_get(self)->ttl;
+  return ttl < 0 ? Qnil : rb_float_new(ttl);
+}
+
+// seconds, 0 keeps it out of the cache, nil is the mount's ttl
+static VALUE rstat_set_ttl(VALUE self, VALUE ttl)
+{
+  double t = NIL_P(ttl) ? -1 : NUM2DBL(ttl);
+  if (!NIL_P(ttl) && t < 0) {
+    t = 0;
+  }
+  rstat_get(self)->ttl = t;
+  return ttl;
+}
+
+// The Array form, see rstat_convert
+static VALUE rstat_to_a(VALUE self)
+{
+  struct stat *st = rstat_of(self);
+  VALUE ary = rb_ary_new2(RSTAT_FIELDS);
+  int i;
+  for (i = 0; i < RSTAT_FIELDS; i++) {
+    rb_ary_push(ary, rstat_field(st, i));
+  }
+  return ary;
+}
+
+#define RSTAT_ACCESSOR(name, field) \
+  static VALUE rstat_get_##name(VALUE self) \
+  { \
+    return rstat_field(rstat_of(self), field); \
+  } \
+  static VALUE rstat_set_##name(VALUE self, VALUE v) \
+  { \
+    rstat_set(rstat_of(self), field, v); \
+    return v; \
+  }
+
+RSTAT_ACCESSOR(dev,     RSTAT_DEV)
+RSTAT_ACCESSOR(ino,     RSTAT_INO)
+RSTAT_ACCESSOR(mode,    RSTAT_MODE)
+RSTAT_ACCESSOR(nlink,   RSTAT_NLINK)
+RSTAT_ACCESSOR(uid,     RSTAT_UID)
+RSTAT_ACCESSOR(gid,     RSTAT_GID)
+RSTAT_ACCESSOR(rdev,    RSTAT_RDEV)
+RSTAT_ACCESSOR(size,    RSTAT_SIZE)
+RSTAT_ACCESSOR(blksize, RSTAT_BLKSIZE)
+RSTAT_ACCESSOR(blocks,  RSTAT_BLOCKS)
+RSTAT_ACCESSOR(atime,   RSTAT_ATIME)
+RSTAT_ACCESSOR(mtime,   RSTAT_MTIME)
+RSTAT_ACCESSOR(ctime,   RSTAT_CTIME)
+
+#undef RSTAT_ACCESSOR
+
+VALUE rstat_init(VALUE module)
+{
+  int i;
+
+  id_to_i = rb_intern("to_i");
+  for (i = 0; i < RSTAT_FIELDS; i++) {
+    rstat_ids[i]  = rb_intern(rstat_names[i]);
+    rstat_keys[i] = ID2SYM(rstat_ids[i]);
+  }
+
+  cStat = rb_define_class_under(module, "Stat", rb_cObject);
+  rb_global_variable(&cStat);
+  rb_define_alloc_func(cStat, rstat_alloc);
+  rb_define_method(cStat, "initialize", rstat_initialize, -1);
+  rb_define_method(cStat, "initialize_copy", rstat_initialize_copy, 1);
+  rb_define_method(cStat, "to_a", rstat_to_a, 0);
+  rb_define_method(cStat, "ttl", rstat_get_ttl, 0);
+  rb_define_method(cStat, "ttl=", rstat_set_ttl, 1);
+
+#define RSTAT_DEFINE(name) \
+  rb_define_method(cStat, #name, rstat_get_##name, 0); \
+  rb_define_method(cStat, #name "=", rstat_set_##name, 1)
+
+  RSTAT_DEFINE(dev);
+  RSTAT_DEFINE(ino);
+  RSTAT_DEFINE(mode);
+  RSTAT_DEFINE(nlink);
+  RSTAT_DEFINE(uid);
+  RSTAT_DEFINE(gid);
+  RSTAT_DEFINE(rdev);
+  RSTAT_DEFINE(size);
+  RSTAT_DEFINE(blksize);
+  RSTAT_DEFINE(blocks);
+  RSTAT_DEFINE(atime);
+  RSTAT_DEFINE(mtime);
+  RSTAT_DEFINE(ctime);
+
+#undef RSTAT_DEFINE
+  return cStat;
+}
@@ -0,0 +1,14 @@
+#include <sys/stat.h>
+#include <ruby.h>
+
+#ifndef _RSTAT_H
+#define _RSTAT_H
+
+int rstat_copy(VALUE rstat, struct stat *st);
+VALUE rstat_new(const struct stat *st);
+void rstat_convert(VALUE rstat, struct stat *st);
+double rstat_ttl(VALUE rstat);
+
+VALUE rstat_init(VALUE module);
+
+#endif
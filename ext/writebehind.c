@@ -0,0 +1,103 @@
+// Write-behind for Fuse#write_behind=. Small writes that follow each other
+// in an open file are acknowledged at once and kept; write() gets them in
+// one go once they reach the mount's size or age, or a write goes
+// elsewhere in the file. flush, fsync, release, (f)truncate, reads and
+// writes of the file through any handle deliver what is pending first,
+// getattr, unlink and rename of its path too, and so does the end of the
+// loop or an unmount. A write() that fails is reported by the next flush
+// or fsync, see rf_write_deliver.
+//
+// Nothing in here touches ruby; everything runs with the GVL held.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "writebehind.h"
+
+static int64_t writebehind_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct writebehind *writebehind_new()
+{
+  struct writebehind *wb = malloc(sizeof(struct writebehind));
+  memset(wb, 0, sizeof(struct writebehind));
+  return wb;
+}
+
+void writebehind_free(struct writebehind *wb)
+{
+  free(wb->buf);
+  free(wb->path);
+  free(wb);
+}
+
+// Whether size bytes at offset may join what is buffered: right after it,
+// within max bytes and before it is max_age ns old
+int writebehind_fits(struct writebehind *wb, size_t size, off_t offset,
+  size_t max, int64_t max_age)
+{
+  if (wb->len == 0) {
+    return size < max;
+  }
+  return offset == wb->start + (off_t) wb->len &&
+    wb->len + size <= max &&
+    writebehind_now() - wb->since < max_age;
+}
+
+// Appends, writebehind_fits said it may. The buffer takes max bytes.
+void writebehind_add(struct writebehind *wb, const char *path,
+  const char *buf, size_t size, off_t offset,
+  const struct fuse_file_info *ffi, size_t max)
+{
+  if (wb->buf == NULL || wb->cap < wb->len + size) {
+    wb->cap = max > wb->len + size ? max : wb->len + size;
+    wb->buf = realloc(wb->buf, wb->cap);
+  }
+  if (wb->len == 0) {
+    wb->start = offset;
+    wb->since = writebehind_now();
+  }
+  memcpy(wb->buf + wb->len, buf, size);
+  wb->len += size;
+  wb->ffi  = *ffi;
+  if (wb->path == NULL || strcmp(wb->path, path) != 0) {
+    free(wb->path);
+    wb->path = strdup(path);
+  }
+}
+
+// The buffered writes, for write(); the caller frees them
+char *writebehind_take(struct writebehind *wb, size_t *len, off_t *start)
+{
+  char *buf = wb->buf;
+  *len   = wb->len;
+  *start = wb->start;
+  wb->buf = NULL;
+  wb->len = 0;
+  wb->cap = 0;
+  return buf;
+}
+
+// Something is pending for path, or with tree below it. NULL is any path.
+int writebehind_match(struct writebehind *wb, const char *path, int tree)
+{
+  size_t len;
+  if (wb->len == 0 || wb->path == NULL) {
+    return 0;
+  }
+  if (path == NULL) {
+    return 1;
+  }
+  len = strlen(path);
+  if (!tree) {
+    return strcmp(wb->path, path) == 0;
+  }
+  return strncmp(wb->path, path, len) == 0 &&
+    (wb->path[len] == '\0' || wb->path[len] == '/' ||
+     (len > 0 && path[len - 1] == '/'));
+}
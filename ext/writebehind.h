@@ -0,0 +1,40 @@
+#ifndef _WRITEBEHIND_H
+#define _WRITEBEHIND_H
+
+#include <fuse.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Writes an open file has yet to hand to write(), see writebehind.c
+struct writebehind {
+  char    *buf;
+  size_t  len;
+  size_t  cap;
+  off_t   start;  //buf goes at start
+  int64_t since;  //CLOCK_MONOTONIC ns, when buf got its first write
+  char    *path;  //of the last write
+  struct fuse_file_info ffi; //of the last write, for write()
+  int     error;  //errno of a write() that failed, for flush or fsync
+  int     delivering; //write() is running with what was taken
+  int     released;   //the file went meanwhile, the deliverer frees
+};
+
+// Per mount, Fuse#write_behind_stats
+struct writebehind_stats {
+  uint64_t writes;     //write requests buffered
+  uint64_t deliveries; //write() calls made with them
+  uint64_t bytes;      //delivered
+};
+
+struct writebehind *writebehind_new();
+void writebehind_free(struct writebehind *wb);
+int writebehind_fits(struct writebehind *wb, size_t size, off_t offset,
+  size_t max, int64_t max_age);
+void writebehind_add(struct writebehind *wb, const char *path,
+  const char *buf, size_t size, off_t offset,
+  const struct fuse_file_info *ffi, size_t max);
+char *writebehind_take(struct writebehind *wb, size_t *len, off_t *start);
+int writebehind_match(struct writebehind *wb, const char *path, int tree);
+
+#endif
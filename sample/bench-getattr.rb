@@ -0,0 +1,156 @@
+#!/usr/bin/ruby
+
+# getattr throughput benchmark for RFuse-ng
+#
+# Mounts one or more filesystems in this process whose getattr always
+# answers with the same stat. Every mount is hammered with lstat() from its
+# own child process. Prints getattr ops/s per mount and in total, so N mounts
+# can be compared against one.
+#
+#   $ sudo mkdir /tmp/fuse
+#   $ sudo sample/bench-getattr.rb [mountpoint] [seconds] [mounts] [mode] [stat] [miss] [reuse]
+#
+# mode is "loop" (the default) for one Fuse#loop thread per mount,
+# "reactor" to serve all of them from a single RFuse::Reactor, or "select"
+# for an IO.select loop calling Fuse#process_many.
+#
+# stat is what getattr answers with: "object" (the default) for a plain
+# ruby object, "native" for an RFuse::Stat, "array" or "hash".
+#
+# miss makes every lstat one of a missing file, failed by getattr with
+# "raise" (raise Errno::ENOENT), "errno" (return -Errno::ENOENT::Errno) or
+# "class" (return Errno::ENOENT), or "-" for none.
+#
+# reuse is "reuse" to turn on Fuse#reuse_objects. The ruby objects allocated
+# per getattr are printed as well.
+#
+# With more than one mount, the mounts are created as mountpoint/0,
+# mountpoint/1, ...
+
+require "rfuse_ng"
+
+class BenchStat
+  attr_accessor :dev, :ino, :mode, :nlink, :uid, :gid, :rdev, :size,
+    :blksize, :blocks, :atime, :mtime, :ctime
+  def initialize(mode)
+    @dev=0; @ino=0; @nlink=1; @uid=0; @gid=0; @rdev=0; @size=0
+    @blksize=4096; @blocks=0
+    @atime=Time.at(0); @mtime=Time.at(0); @ctime=Time.at(0)
+    @mode=mode
+  end
+end
+
+mountpoint = ARGV[0] || "/tmp/fuse"
+seconds    = (ARGV[1] || 5).to_f
+mounts     = (ARGV[2] || 1).to_i
+mode       = ARGV[3] || "loop"
+statkind   = ARGV[4] || "object"
+miss       = ARGV[5] == "-" ? nil : ARGV[5]
+reuse      = ARGV[6] == "reuse"
+
+def bench_stat(kind, mode)
+  st = BenchStat.new(mode)
+  case kind
+  when "native" then RFuse::Stat.new(st)
+  when "array"  then RFuse::Stat.new(st).to_a
+  when "hash"
+    h = {}
+    [:dev, :ino, :mode, :nlink, :uid, :gid, :rdev, :size, :blksize,
+     :blocks, :atime, :mtime, :ctime].each { |f| h[f] = st.send(f) }
+    h
+  else st
+  end
+end
+
+class BenchFS < RFuse::Fuse
+  def initialize(root, file, miss, *args)
+    @root = root
+    @file = file
+    @miss = miss
+    super(*args)
+  end
+
+  def getattr(ctx,path)
+    return @root if path == "/"
+    case @miss
+    when nil     then @file
+    when "errno" then -Errno::ENOENT::Errno
+    when "class" then Errno::ENOENT
+    else raise Errno::ENOENT
+    end
+  end
+end
+
+if mounts == 1
+  mountpoints = [mountpoint]
+else
+  mountpoints = (0...mounts).map { |i| File.join(mountpoint,i.to_s) }
+  mountpoints.each { |m| Dir.mkdir(m) unless File.directory?(m) }
+end
+
+# the first element of each option array is discarded, see test-ruby.rb
+root  = bench_stat(statkind, 040755)
+file  = bench_stat(statkind, 0100644)
+fuses = mountpoints.map do |m|
+  BenchFS.new(root,file,miss,
+    m,["bench"],["bench","-o","attr_timeout=0,entry_timeout=0"])
+end
+fuses.each { |f| f.reuse_objects = reuse }
+
+rd, wr = IO.pipe
+allocated = GC.stat(:total_allocated_objects)
+
+pids = mountpoints.map do |m|
+  fork do
+    rd.close
+    # the kernel caches nothing (timeouts are 0), so every lstat is a getattr
+    ops   = 0
+    path  = File.join(m,"file")
+    start = Time.now
+    while (Time.now - start) < seconds
+      100.times { File.lstat(path) rescue nil }
+      ops += 100
+    end
+    wr.puts("#{m} #{ops} #{Time.now - start}")
+    wr.close
+    system("fusermount","-u",m)
+  end
+end
+wr.close
+
+if mode == "reactor"
+  reactor = RFuse::Reactor.new
+  fuses.each { |f| reactor.register(f) }
+  # returns once every mount has been unmounted
+  reactor.run
+  pids.each { |pid| Process.wait(pid) }
+elsif mode == "select"
+  ios = {}
+  fuses.each { |f| ios[IO.for_fd(f.fd, :autoclose => false)] = f }
+  until ios.empty?
+    ready, = IO.select(ios.keys)
+    ready.each do |io|
+      ios.delete(io) if ios[io].process_many(64).nil?
+    end
+  end
+  pids.each { |pid| Process.wait(pid) }
+else
+  threads = fuses.map { |f| Thread.new { f.loop } }
+  pids.each { |pid| Process.wait(pid) }
+  threads.each { |t| t.join }
+end
+
+allocated = GC.stat(:total_allocated_objects) - allocated
+
+total = 0.0
+total_ops = 0
+rd.each_line do |line|
+  m, ops, elapsed = line.split
+  total_ops += ops.to_i
+  rate = ops.to_f / elapsed.to_f
+  total += rate
+  printf("%s: getattr %.0f ops/s\n", m, rate)
+end
+printf("%d mount(s), %s, %s%s: getattr %.0f ops/s total, %.1f allocations/op\n",
+  mounts, mode, miss ? "#{miss} ENOENT" : "#{statkind} stat",
+  reuse ? ", reused objects" : "", total, allocated.to_f / [total_ops, 1].max)
@@ -0,0 +1,107 @@
+#!/usr/bin/ruby
+
+# Inode based TestFS for RFuse-ng, on top of RFuse::LowLevel
+#
+# Every node has an inode number, the kernel asks for names one directory
+# at a time (lookup) and then only talks inodes, there are no paths to
+# split and walk.
+#
+#   $ sudo mkdir /tmp/fuse
+#   $ sudo sample/test-lowlevel.rb [mountpoint]
+
+require "rfuse_ng"
+
+class LLStat
+  attr_accessor :dev, :ino, :mode, :nlink, :uid, :gid, :rdev, :size,
+    :blksize, :blocks, :atime, :mtime, :ctime
+  def initialize(ino,mode,size)
+    @dev=0; @ino=ino; @nlink=1; @uid=0; @gid=0; @rdev=0; @size=size
+    @blksize=4096; @blocks=(size + 511) / 512
+    @atime=Time.at(0); @mtime=Time.at(0); @ctime=Time.at(0)
+    @mode=mode
+  end
+end
+
+class LLNode
+  attr_reader :ino, :children
+  attr_accessor :mode, :data, :uid, :gid, :atime, :mtime
+  def initialize(ino,mode,data=nil)
+    @ino=ino; @mode=mode; @data=data; @children={}
+    @uid=0; @gid=0; @atime=Time.at(0); @mtime=Time.at(0)
+  end
+  def stat
+    st = LLStat.new(@ino,@mode,@data ? @data.size : 0)
+    st.uid=@uid; st.gid=@gid; st.atime=@atime; st.mtime=@mtime
+    st
+  end
+end
+
+class LowLevelFS < RFuse::LowLevel
+  TIMEOUT = 10.0
+
+  def initialize(*args)
+    @nodes = {}
+    root = add(040755)
+    add(0100444,"Hello from the low-level API\n",root,"hello")
+    sub = add(040755,nil,root,"sub")
+    add(0100444,"deep\n",sub,"file")
+    super
+  end
+
+  def add(mode,data=nil,parent=nil,name=nil)
+    node = LLNode.new(@nodes.size + 1,mode,data)
+    @nodes[node.ino] = node
+    parent.children[name] = node if parent
+    node
+  end
+
+  def lookup(req,parent,name)
+    node = @nodes[parent].children[name]
+    # a nil stat caches the miss for TIMEOUT seconds
+    req.reply_entry(node && node.stat,TIMEOUT,TIMEOUT)
+  end
+
+  def forget(ino,nlookup)
+  end
+
+  def getattr(req,ino,fi)
+    node = @nodes[ino] or raise Errno::ENOENT
+    req.reply_attr(node.stat,TIMEOUT)
+  end
+
+  # chmod, chown, truncate and touch: attr is an RFuse::Stat, only the
+  # fields flagged in to_set are meant
+  def setattr(req,ino,attr,to_set,fi)
+    node = @nodes[ino] or raise Errno::ENOENT
+    set = lambda { |bit| to_set & bit != 0 }
+    node.mode = (node.mode & ~07777) | (attr.mode & 07777) if set[SET_ATTR_MODE]
+    node.uid = attr.uid if set[SET_ATTR_UID]
+    node.gid = attr.gid if set[SET_ATTR_GID]
+    if set[SET_ATTR_SIZE]
+      raise Errno::EISDIR unless node.data
+      node.data = node.data[0,attr.size].ljust(attr.size,"\0")
+    end
+    node.atime = set[SET_ATTR_ATIME_NOW] ? Time.now : attr.atime if set[SET_ATTR_ATIME]
+    node.mtime = set[SET_ATTR_MTIME_NOW] ? Time.now : attr.mtime if set[SET_ATTR_MTIME]
+    req.reply_attr(node.stat,TIMEOUT)
+  end
+
+  def readdir(req,ino,size,off,fi)
+    dir = @nodes[ino]
+    entries = [[".",ino,dir.mode],["..",ino,dir.mode]]
+    dir.children.each { |name,node| entries << [name,node.ino,node.mode] }
+    entries.each_with_index { |e,i| e << i + 1 }
+    req.reply_dir(entries[off..-1] || [])
+  end
+
+  def open(req,ino,fi)
+    req.reply_open(fi)
+  end
+
+  def read(req,ino,size,off,fi)
+    req.reply_data(@nodes[ino].data[off,size] || "")
+  end
+end
+
+fs = LowLevelFS.new(ARGV[0] || "/tmp/fuse",["allow_other"],["lowlevel"])
+fs.loop
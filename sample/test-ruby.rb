@@ -382,13 +382,15 @@ fo = MyFuse.new("/tmp/fuse",["notparsed","-o notparsed,allow_other"],["debug"],
 #         max_read=N,fsname=NAME
 #library: debug,hard_remove
 
+# exit makes loop return, the mount is released once it has
 Signal.trap("TERM") do
   fo.exit
-  fo.unmount
 end
 
 begin
   fo.loop
 rescue
   print "Error:" + $!
+ensure
+  fo.unmount
 end